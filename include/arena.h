@@ -0,0 +1,45 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Every allocation is aligned on this boundary (bytes), like plane rows
+#define ARENA_ALIGN 32
+
+// Default size of the first block of an arena
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+typedef struct arena_block {
+  struct arena_block* next;  // older block
+  size_t size;               // usable bytes after the header
+  size_t used;
+} ArenaBlock;
+
+// Bump allocator for memory that dies together (one image, one task).
+// Allocations are never freed one by one: arena_rewind() drops everything
+// allocated after a mark, arena_reset() drops everything. Blocks are kept
+// for the next use, and a reset merges them into one block large enough
+// for the peak so far, so a steady stream of similar images allocates
+// nothing. Not thread-safe: use one arena per thread.
+typedef struct arena {
+  ArenaBlock* blocks;  // newest first
+  ArenaBlock* spare;   // blocks freed by arena_rewind, reused before malloc
+  size_t block_size;
+} Arena;
+
+typedef struct arena_mark {
+  ArenaBlock* block;
+  size_t used;
+} ArenaMark;
+
+Arena*    arena_create(size_t block_size);
+void      arena_free(Arena* arena);
+void*     arena_alloc(Arena* arena, size_t size);
+void*     arena_calloc(Arena* arena, size_t count, size_t size);
+void      arena_release(Arena* arena, void* ptr);
+ArenaMark arena_mark(const Arena* arena);
+void      arena_rewind(Arena* arena, ArenaMark mark);
+void      arena_reset(Arena* arena);
+size_t    arena_capacity(const Arena* arena);
+
+#endif /* ARENA_H */
@@ -0,0 +1,26 @@
+#ifndef BATCH_H
+#define BATCH_H
+#include "fingerprint.h"
+#include "pool.h"
+
+// Totals of a batch run
+typedef struct batch_stats {
+  int images;
+  int failed;
+  long long pixels;
+  double seconds;      // wall clock time of the whole batch
+  double busy;         // sum of the per-image times
+  double max_latency;  // slowest image, seconds
+  double read;         // time the reader spent mapping and decoding
+  double compute;      // time the workers spent enrolling, summed
+  double starved;      // time the workers waited for a decoded image
+  double write;        // time the writer spent saving outputs
+} BatchStats;
+
+char** batch_inputs(const char* path, int* count);
+char** batch_templates(const char* path, int* count);
+void   batch_inputs_free(char** inputs, int count);
+int    batch_run(const Pipeline* pl, char* const* inputs, int count, const char* out_dir, Pool* pool, BatchStats* stats);
+void   batch_print_stats(const BatchStats* stats, int threads);
+
+#endif /* BATCH_H */
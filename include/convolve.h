@@ -0,0 +1,41 @@
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+#include "plane.h"
+#include "pool.h"
+
+// How samples outside the source image are obtained.
+typedef enum border_mode {
+  BORDER_VALID,     // no padding: the output shrinks by (kernel size - 1)
+  BORDER_ZERO,      // outside samples are 0
+  BORDER_REPLICATE, // aaa|abcd|ddd
+  BORDER_REFLECT    // cb|abcd|cb
+} BorderMode;
+
+// Float kernel, row-major. Kernels whose taps form an outer product
+// col * row are flagged separable and applied as two 1D passes.
+// The anchor (output pixel) is the tap at (width / 2, height / 2).
+typedef struct kernel {
+  int width;
+  int height;
+  float* taps;
+  int separable;
+  float* row; // width taps of the horizontal pass
+  float* col; // height taps of the vertical pass
+} Kernel;
+
+Kernel* kernel_create(const float* taps, int width, int height);
+Kernel* kernel_from_int(const int* taps, int size);
+Kernel* kernel_separable(const float* row, int width, const float* col, int height);
+void    kernel_free(Kernel* k);
+void    kernel_view(Kernel* k, float* taps, int width, int height, float* row, float* col);
+
+// Whole-image convolution, run in bands of rows over `pool` (may be NULL).
+// The output is allocated in `arena`, or on the heap when it is NULL.
+PlaneF* convolve(const PlaneF* src, const Kernel* k, BorderMode border, Pool* pool, Arena* arena);
+PlaneF* convolve_plane8(const Plane8* src, const Kernel* k, BorderMode border, Pool* pool, Arena* arena);
+void    convolve_region(const PlaneF* src, const Kernel* k, BorderMode border, int x0, int y0, PlaneF* dst, Arena* scratch);
+
+// Name of the row kernel selected for this CPU ("avx2", "sse" or "scalar")
+const char* convolve_backend(void);
+
+#endif /* CONVOLVE_H */
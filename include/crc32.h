@@ -0,0 +1,11 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32 (IEEE 802.3, as zlib and gzip): crc32(0, data, n) checks a whole
+// buffer, crc32(previous, more, m) continues it.
+uint32_t crc32(uint32_t crc, const void* data, size_t length);
+
+#endif /* CRC32_H */
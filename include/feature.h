@@ -0,0 +1,30 @@
+#ifndef FEATURE_H
+#define FEATURE_H
+#include "fingerprint.h"
+
+// Orientation part: the field resampled to a FEATURE_GRID x FEATURE_GRID
+// grid of FEATURE_CELL pixel cells centred on the reference point
+#define FEATURE_GRID 8
+#define FEATURE_CELL 16
+
+// Minutiae part: histogram of directions, and of distances to the
+// reference point in rings of FEATURE_RING pixels (the last one open)
+#define FEATURE_DIRECTIONS 8
+#define FEATURE_RINGS 4
+#define FEATURE_RING 24
+
+// Layout of the full vector:
+//   [0, 2 G²)        coherence-weighted cos 2a, sin 2a of each cell
+//   then 2           endings and bifurcations per 10^3 foreground pixels
+//   then DIRECTIONS  fractions of minutiae per direction
+//   then RINGS       fractions of minutiae per ring
+#define FEATURE_DIM (2 * FEATURE_GRID * FEATURE_GRID + 2 + FEATURE_DIRECTIONS + FEATURE_RINGS)
+
+// Compact vector, small enough for the VP-tree: minutiae densities, mean
+// ridge period (tens of pixels) and number of cores (halved)
+#define FEATURE_COMPACT_DIM 4
+
+void feature_extract(const Enrollment* res, float* out);
+void feature_compact(const Enrollment* res, float* out);
+
+#endif /* FEATURE_H */
@@ -0,0 +1,31 @@
+#ifndef FFT_H
+#define FFT_H
+
+typedef struct complex_f {
+  float re;
+  float im;
+} ComplexF;
+
+// Precomputed factorisation and twiddles for transforms of length n.
+// Any n works, but lengths whose factors are only 2, 3 and 5 (see
+// fft_good_size) are much faster. A plan is read-only once built and may
+// be shared between threads.
+typedef struct fft_plan {
+  int n;
+  int factors[64]; // (radix, remaining length) pairs, ended by m == 1
+  ComplexF* twiddles;
+} FftPlan;
+
+FftPlan* fft_plan(int n);
+void     fft_plan_free(FftPlan* plan);
+void     fft_forward(const FftPlan* plan, const ComplexF* in, ComplexF* out);
+void     fft_inverse(const FftPlan* plan, const ComplexF* in, ComplexF* out); // unscaled
+int      fft_good_size(int n);
+
+// In-place 2D transforms of a rows x cols array: `row` plans the length
+// cols transforms, `col` the length rows ones; `work` holds rows * cols
+// values. Power-of-two sizes take a vectorized Stockham path.
+void fft2d_forward(const FftPlan* row, const FftPlan* col, ComplexF* data, ComplexF* work);
+void fft2d_inverse(const FftPlan* row, const FftPlan* col, ComplexF* data, ComplexF* work);
+
+#endif /* FFT_H */
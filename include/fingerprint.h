@@ -0,0 +1,55 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+#include "ppm.h"
+#include "convolve.h"
+#include "gabor.h"
+#include "pool.h"
+#include "segment.h"
+#include "minutiae.h"
+#include "singular.h"
+
+#define PI 3.14159265358979
+
+// Settings and precomputed kernels of the enrollment pipeline, built once
+// and shared read-only between images and threads.
+typedef struct pipeline {
+  int block_size;        // Sobel kernel size and side of the block grid
+  int step;              // > 0: dense orientation field sampled every step pixels
+  int window;            // sliding window of the dense field
+  float smooth;          // sigma of the orientation smoothing in pixels, 0: none
+  Kernel* sobel_x;
+  Kernel* sobel_y;
+  const GaborBank* bank; // borrowed
+} Pipeline;
+
+// Everything the pipeline produces for one image
+typedef struct enrollment {
+  BlockMask* mask;       // foreground cells of fp
+  Fingerprint* fp;
+  Singularities* singular; // cores and deltas of fp
+  float* frequency;      // one ridge frequency per Ridge of fp, 0 when unknown
+  PlaneF* enhanced;      // zero-centred Gabor response
+  BlockMask* skeleton;   // one bit per pixel: ridges thinned to one pixel
+  Minutiae* minutiae;
+  int grid;              // pixels per cell of fp
+  Arena* arena;          // where the above live, NULL for the heap
+} Enrollment;
+
+Fingerprint* create_fingerprint(int width, int height);
+Fingerprint* create_fingerprint_in(Arena* arena, int width, int height);
+void         free_fingerprint(Fingerprint* fp);
+void         normalize_coherence(Fingerprint* fp, const BlockMask* mask);
+void         generate_sobel_kernels(int size, int** sobel_x, int** sobel_y);
+
+Pipeline* pipeline_create(int block_size, int step, int window, float smooth, const GaborBank* bank);
+void      pipeline_free(Pipeline* pl);
+int       pipeline_run(const Pipeline* pl, const Plane8* im, Pool* pool, Arena* arena, Enrollment* res);
+void      enrollment_free(Enrollment* res);
+void      pipeline_grid(const Pipeline* pl, const Plane8* im, int* grid, int* width, int* height);
+
+void         compute_gradients(const Pipeline* pl, const Plane8* im, const BlockMask* mask, PlaneF** grad_x, PlaneF** grad_y, Pool* pool, Arena* arena);
+Fingerprint* compute_fingerprint(const Pipeline* pl, const Plane8* im, const BlockMask* mask, Pool* pool, Arena* arena);
+Fingerprint* compute_dense_fingerprint(const Pipeline* pl, const Plane8* im, const BlockMask* mask, Pool* pool, Arena* arena);
+int          draw_svg(const Fingerprint* fp, const char* filename);
+
+#endif /* FINGERPRINT_H */
@@ -0,0 +1,22 @@
+#ifndef FREQUENCY_H
+#define FREQUENCY_H
+#include "ppm.h"
+#include "pool.h"
+#include "segment.h"
+
+// Oriented window of the ridge frequency estimate: FREQUENCY_WINDOW pixels
+// across the ridges (about 3 periods) by FREQUENCY_ALONG along them
+#define FREQUENCY_WINDOW 31
+#define FREQUENCY_ALONG 15
+
+// Orientations of the precomputed window layouts (over PI)
+#define FREQUENCY_ANGLES 64
+
+// Ridge periods, in pixels, accepted as valid estimates
+#define FREQUENCY_MIN_PERIOD 3.0f
+#define FREQUENCY_MAX_PERIOD 25.0f
+
+float* frequency_map(const Plane8* im, const Fingerprint* fp, int block_size, const BlockMask* mask, Pool* pool, Arena* arena);
+int    frequency_interpolate(float* frequency, int width, int height, const BlockMask* mask, Arena* scratch);
+
+#endif /* FREQUENCY_H */
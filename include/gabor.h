@@ -1,9 +1,45 @@
 #ifndef GABOR_H
 #define GABOR_H
 #include "ppm.h"
+#include "convolve.h"
+#include "segment.h"
+
+// Ridge frequencies (cycles per pixel) the enhancement handles: periods of
+// 3 to 25 pixels.
+#define GABOR_MIN_FREQ 0.04f
+#define GABOR_MAX_FREQ 0.33f
+
+// Default quantization of the filter bank
+#define GABOR_BANK_ANGLES 16
+#define GABOR_BANK_FREQS 16
+
+// Zero-mean Gabor kernels precomputed for n_angles orientations in [0, PI)
+// times n_freqs frequencies evenly spaced in [min_freq, max_freq].
+// All taps live in one block: kernel (a, f) starts at offsets[f * n_angles + a]
+// and is sizes[f] pixels wide (the envelope only depends on the frequency).
+// A bank is read-only once built and can be shared between threads.
+typedef struct gabor_bank {
+  int n_angles;
+  int n_freqs;
+  float min_freq;
+  float max_freq;
+  int* sizes;
+  long* offsets;
+  long n_taps;
+  float* taps;
+  float* passes;   // row/col storage of the separable kernels
+  Kernel* kernels; // views over taps, n_freqs * n_angles
+} GaborBank;
 
 float** create_gabor_kernel(int size, float angle, float frequency, float sigma_x, float sigma_y);
-float** create_gabor_kernel(int size, float angle, float frequency, float sigma_x, float sigma_y);
+void    free_gabor_kernel(float** kernel, int size);
+
+GaborBank*    gabor_bank_create(int n_angles, int n_freqs, float min_freq, float max_freq, float separable_energy);
+void          gabor_bank_free(GaborBank* bank);
+const Kernel* gabor_bank_lookup(const GaborBank* bank, float angle, float frequency);
+int           gabor_bank_save(const GaborBank* bank, const char* filename);
+GaborBank*    gabor_bank_load(const char* filename);
 
+PlaneF* gabor_enhance(const Plane8* im, const Fingerprint* fp, const float* frequency, int block_size, const BlockMask* mask, const GaborBank* bank, Pool* pool, Arena* arena);
 
 #endif /* GABOR_H */
@@ -0,0 +1,46 @@
+#ifndef GALLERY_H
+#define GALLERY_H
+#include <stdint.h>
+#include "match.h"
+#include "triplet.h"
+#include "pool.h"
+
+// Templates of the gallery run through the fine matcher for each query
+#define GALLERY_SHORTLIST 32
+
+// Coarse description of a template: its number of cores (0 arch, 1 loop,
+// 2 whorl or twin loop) and of distinct triplet keys
+typedef struct gallery_key {
+  int cores;
+  int triplets;
+} GalleryKey;
+
+// Templates loaded for 1:N identification, ready for matching, and the
+// inverted index of their triplets. Everything but `names` lives in
+// `arena`.
+typedef struct gallery {
+  int count;
+  char** names;
+  GalleryKey* keys;
+  MatchTemplate** templates;
+  TripletIndex* index;
+  Arena* arena;
+} Gallery;
+
+typedef struct gallery_hit {
+  int entry;
+  float score;
+} GalleryHit;
+
+// Where the time of one query went
+typedef struct gallery_query {
+  int shortlisted;  // templates given to the fine matcher
+  double coarse;    // seconds preparing the probe and voting
+  double fine;      // seconds matching the shortlist
+} GalleryQuery;
+
+Gallery* gallery_load(char* const* files, int count);
+void     gallery_free(Gallery* g);
+int      gallery_identify(const Gallery* g, const TemplateView* probe, Pool* pool, Arena* scratch, GalleryHit* hits, int k, GalleryQuery* query);
+
+#endif /* GALLERY_H */
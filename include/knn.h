@@ -0,0 +1,52 @@
+#ifndef KNN_H
+#define KNN_H
+
+// Rows of a matrix are padded to a multiple of this many floats (one AVX
+// register), the padding being zero
+#define KNN_LANES 8
+
+// Rows scored at a time by brute-force search before their distances go
+// through the top-k heap
+#define KNN_BLOCK 64
+
+// Row-major matrix of `rows` vectors of `dim` floats, contiguous and
+// aligned, rows `stride` floats apart
+typedef struct knn_matrix {
+  int rows;
+  int dim;
+  int stride;
+  float* data;
+} KnnMatrix;
+
+typedef struct knn_hit {
+  int row;
+  float distance;  // squared euclidean
+} KnnHit;
+
+// Vantage-point tree over the rows of a matrix, for low dimensions where
+// the triangle inequality prunes well. Node n splits the rows of its
+// subtree on their distance to row `vantage`: those within `radius` are
+// under node `inside`, the others under `outside` (-1: none).
+typedef struct knn_node {
+  int vantage;
+  float radius;  // euclidean, not squared
+  int inside;
+  int outside;
+} KnnNode;
+
+typedef struct knn_tree {
+  const KnnMatrix* m;  // borrowed
+  int root;
+  KnnNode* nodes;
+} KnnTree;
+
+KnnMatrix*  knn_matrix_create(int rows, int dim);
+void        knn_matrix_free(KnnMatrix* m);
+float*      knn_row(const KnnMatrix* m, int row);
+int         knn_search(const KnnMatrix* m, const float* query, int k, KnnHit* hits);
+KnnTree*    knn_tree_build(const KnnMatrix* m);
+void        knn_tree_free(KnnTree* t);
+int         knn_tree_search(const KnnTree* t, const float* query, int k, KnnHit* hits);
+const char* knn_backend(void);
+
+#endif /* KNN_H */
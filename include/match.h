@@ -0,0 +1,61 @@
+#ifndef MATCH_H
+#define MATCH_H
+#include "template.h"
+
+// Nearest neighbours described in the local descriptor of a minutia
+#define MATCH_NEIGHBOURS 5
+
+// Neighbours of two descriptors agree within these tolerances
+#define MATCH_NEIGHBOUR_DISTANCE 8  // pixels
+#define MATCH_NEIGHBOUR_ANGLE 14    // 2 PI = 256, about 0.35 radians
+
+// Two minutiae may be the same point when their descriptors share this
+// many neighbours; only such pairs are tried as alignments
+#define MATCH_MIN_NEIGHBOURS 2
+
+// Alignments tried, best descriptor agreement first
+#define MATCH_MAX_PAIRS 24
+
+// Aligned minutiae pair up within these tolerances. The distance is also
+// the side of the cells of the spatial grid.
+#define MATCH_DISTANCE 12.0f  // pixels
+#define MATCH_ANGLE 0.4f      // radians
+
+// Descriptors are compared this many reference minutiae at a time
+#define MATCH_LANES 16
+
+typedef struct match_minutia {
+  float x;
+  float y;
+  float angle;
+} MatchMinutia;
+
+// Minutiae of a template ready for matching.
+// Descriptors: the MATCH_NEIGHBOURS nearest minutiae of minutia j, in its
+// own frame, nearest first. Neighbour k is at index k * lanes + j of
+//   distance   pixels, 255 when there is no such neighbour
+//   position   direction of the neighbour from the minutia  } relative to
+//   direction  direction of the neighbour                   } the minutia's
+// with angles in 1/256 turns; `lanes` is count rounded up to MATCH_LANES.
+// Grid: MATCH_DISTANCE pixel cells listing the minutiae of each cell
+// (cell c holds items[start[c]] to items[start[c + 1] - 1]).
+typedef struct match_template {
+  int count;
+  int lanes;
+  MatchMinutia* minutiae;
+  uint8_t* distance;
+  uint8_t* position;
+  uint8_t* direction;
+  float origin_x;
+  float origin_y;
+  int grid_width;
+  int grid_height;
+  int* start;
+  int* items;
+} MatchTemplate;
+
+MatchTemplate* match_prepare(const TemplateView* t, Arena* arena);
+void           match_template_free(MatchTemplate* t);
+float          match_score(const MatchTemplate* probe, const MatchTemplate* ref, Arena* scratch);
+
+#endif /* MATCH_H */
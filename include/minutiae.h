@@ -0,0 +1,41 @@
+#ifndef MINUTIAE_H
+#define MINUTIAE_H
+#include <stdint.h>
+#include "ppm.h"
+#include "segment.h"
+
+// Values of Minutia.type: the crossing number of the skeleton pixel
+#define MINUTIA_ENDING 1
+#define MINUTIA_BIFURCATION 3
+
+// Pixels followed along the skeleton to orient a minutia
+#define MINUTIAE_TRACE 10
+
+// Minutiae closer than this (pixels) are taken for artefacts of a broken
+// ridge, a short spur or a bridge, and dropped in pairs
+#define MINUTIAE_MIN_DISTANCE 8
+
+// Minutiae closer than this (pixels) to the image border are dropped
+#define MINUTIAE_BORDER 8
+
+// Minimum quality (0-255, from the block coherence) of a kept minutia
+#define MINUTIAE_MIN_QUALITY 40
+
+// 12 bytes, stored contiguously for matching
+typedef struct minutia {
+  uint16_t x;
+  uint16_t y;
+  float angle;     // direction in [0, 2 PI): along the ridge, out of an ending or between the arms of a bifurcation
+  uint8_t type;
+  uint8_t quality;
+} Minutia;
+
+typedef struct minutiae {
+  int count;
+  Minutia* points; // sorted by y, then x
+} Minutiae;
+
+Minutiae* minutiae_extract(const BlockMask* skeleton, const Fingerprint* fp, const BlockMask* mask, int block_size, Arena* arena);
+void      minutiae_free(Minutiae* m);
+
+#endif /* MINUTIAE_H */
@@ -0,0 +1,36 @@
+#ifndef ORIENTATION_H
+#define ORIENTATION_H
+#include "ppm.h"
+#include "pool.h"
+#include "convolve.h"
+#include "segment.h"
+
+// Default sigma, in pixels, of the Gaussian smoothing of the orientation
+// field (see orientation_smooth)
+#define ORIENTATION_SMOOTH_SIGMA 6.0f
+
+// Largest sigma, in pixels, accepted on the command line
+#define ORIENTATION_MAX_SMOOTH_SIGMA 256.0f
+
+// Summed-area tables of the gradient products Gx², GxGy and Gy².
+// Entry (x, y) holds the sum over [0, x) x [0, y), so each table has
+// (width + 1) x (height + 1) entries; doubles keep large sums exact enough.
+typedef struct tensor_sat {
+  int width;
+  int height;
+  double* xx;
+  double* xy;
+  double* yy;
+} TensorSat;
+
+void tensor_orientation(float gxx, float gxy, float gyy, float* angle, float* coherence);
+void structure_tensor_field(const PlaneF* grad_x, const PlaneF* grad_y, int block_size, Fingerprint* fp, const BlockMask* mask, Pool* pool);
+
+TensorSat* tensor_sat_create(const PlaneF* grad_x, const PlaneF* grad_y, Arena* arena);
+void       tensor_sat_free(TensorSat* sat);
+void       tensor_sat_window(const TensorSat* sat, int x0, int y0, int x1, int y1, float* gxx, float* gxy, float* gyy);
+void       dense_orientation_field(const TensorSat* sat, int window, int step, Fingerprint* fp, const BlockMask* mask, Pool* pool);
+
+void orientation_smooth(Fingerprint* fp, const BlockMask* mask, float sigma, Pool* pool, Arena* arena);
+
+#endif /* ORIENTATION_H */
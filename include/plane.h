@@ -0,0 +1,61 @@
+#ifndef PLANE_H
+#define PLANE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "arena.h"
+
+// Every row of a plane starts on this boundary (bytes), so that a row
+// can be loaded with aligned vector instructions.
+#define PLANE_ALIGN 32
+
+// Values of Plane8.owned / PlaneF.owned
+#define PLANE_BORROWED 0 // data belongs to someone else (e.g. a mapped file)
+#define PLANE_OWNED 1    // data is freed with the plane
+#define PLANE_ARENA 2    // plane and data live in an arena: *_free ignores them
+
+// Single channel 8-bit image stored as one contiguous block.
+// Rows are `stride` bytes apart; `owned` tells who releases `data`.
+typedef struct plane8 {
+  int width;
+  int height;
+  int stride;
+  int owned;
+  uint8_t* data;
+} Plane8;
+
+// Same layout with float samples (gradients, filter responses).
+// `stride` is counted in floats, not bytes.
+typedef struct planef {
+  int width;
+  int height;
+  int stride;
+  int owned;
+  float* data;
+} PlaneF;
+
+Plane8* plane8_create(int width, int height);
+Plane8* plane8_create_in(Arena* arena, int width, int height);
+Plane8* plane8_wrap(uint8_t* data, int width, int height, int stride);
+void    plane8_free(Plane8* p);
+
+PlaneF* planef_create(int width, int height);
+PlaneF* planef_create_in(Arena* arena, int width, int height);
+PlaneF* planef_wrap(float* data, int width, int height, int stride);
+void    planef_free(PlaneF* p);
+
+PlaneF* plane8_to_f(const Plane8* p);
+PlaneF* plane8_to_f_in(Arena* arena, const Plane8* p);
+Plane8* planef_to_8(const PlaneF* p);
+Plane8* planef_to_8_in(Arena* arena, const PlaneF* p);
+
+// Row views: pointer to the first sample of row y.
+static inline uint8_t* plane8_row(const Plane8* p, int y) {
+  return p->data + (size_t)y * p->stride;
+}
+
+static inline float* planef_row(const PlaneF* p, int y) {
+  return p->data + (size_t)y * p->stride;
+}
+
+#endif /* PLANE_H */
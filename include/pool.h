@@ -0,0 +1,50 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include "arena.h"
+
+// Body of a parallel loop: called once for every index in [0, count),
+// `worker` in [0, pool_threads()) identifies the calling thread so that
+// tasks can use per-worker scratch buffers.
+typedef void (*PoolTask)(void* ctx, int index, int worker);
+
+// Range [lo, hi) of indices still owned by one worker, packed in a single
+// 64-bit word (lo in the low half) so that it is updated with one CAS.
+// Padded to a cache line to avoid false sharing.
+typedef struct pool_deque {
+  _Atomic uint64_t range;
+  char pad[64 - sizeof(uint64_t)];
+} PoolDeque;
+
+// Fixed set of threads running parallel loops. Each loop is cut into one
+// contiguous range per worker; a worker pops indices from the front of its
+// own range, and once it is empty steals the back half of another one.
+// The calling thread takes part as worker 0. Every worker also has a
+// scratch arena for the temporaries of its tasks (see pool_scratch).
+typedef struct pool {
+  int threads;
+  pthread_t* handles;
+  PoolDeque* deques;
+  Arena** scratch;
+
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  unsigned long generation;
+  int busy;
+  int shutdown;
+
+  PoolTask task;
+  void* ctx;
+} Pool;
+
+Pool* pool_create(int threads);
+void  pool_free(Pool* pool);
+int   pool_threads(const Pool* pool);
+Arena* pool_scratch(const Pool* pool, int worker);
+void  pool_run(Pool* pool, int count, PoolTask task, void* ctx);
+
+#endif /* POOL_H */
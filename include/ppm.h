@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include "plane.h"
 
 typedef struct pixel {
   int r;
@@ -17,6 +18,32 @@ typedef struct image {
   Pixel** p;
 } Image;
 
+// Header of a binary PNM file (P6 colour or P5 greyscale).
+typedef struct ppm_header {
+  int width;
+  int height;
+  int maxval;
+  int channels;    // 3 for P6, 1 for P5
+  int sample_size; // bytes per sample: 1, or 2 (big endian) when maxval > 255
+  long offset;     // byte offset of the pixel payload in the file
+} PpmHeader;
+
+// Read-only view of a memory-mapped PNM file. `raw` borrows the pixel
+// payload in place: each of its rows is width * channels * sample_size
+// bytes long, so for an 8-bit P5 file it is directly the greyscale image.
+typedef struct ppm_map {
+  PpmHeader header;
+  void* base;
+  size_t length;
+  Plane8 raw;
+} PpmMap;
+
+// Luminance weights used when converting colour to greyscale.
+typedef enum grey_weights {
+  GREY_MEAN,  // (r + g + b) / 3
+  GREY_BT601  // 0.299 r + 0.587 g + 0.114 b
+} GreyWeights;
+
 typedef struct ridge {
   float angle;
   float coherence;
@@ -29,11 +56,17 @@ typedef struct fingerprint {
 } Fingerprint;
 
 Image* ppm_open(char* filename);
+int    ppm_probe(const char* filename, PpmHeader* header);
+PpmMap* ppm_map(const char* filename);
+void   ppm_unmap(PpmMap* map);
 Image* ppm_create(int width, int height);
 void   ppm_free(Image* im);
 int    ppm_save(Image* im, char* filename);
+int    pgm_save(const Plane8* im, const char* filename);
 Image* ppm_convolution(Image* im, int* kernel, int size);
-Image* grey_scale(Image* im);
+Plane8* grey_scale(Image* im);
+Plane8* ppm_open_grey(const char* filename, GreyWeights weights);
+void   ppm_decode_grey(const PpmMap* map, GreyWeights weights, Plane8* dst);
 Image* ppm_normalize(Image* im);
 
 #endif
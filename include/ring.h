@@ -0,0 +1,38 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Slot of a ring: `sequence` tells whose turn it is. A producer may fill
+// slot i at position p when sequence == p, a consumer may empty it when
+// sequence == p + 1; emptying sets it to p + capacity for the next lap.
+typedef struct ring_slot {
+  _Atomic size_t sequence;
+  void* item;
+} RingSlot;
+
+// Bounded lock-free queue of pointers, any number of producers and
+// consumers (Vyukov's bounded MPMC queue). Producers and consumers claim
+// positions with one CAS on their own counter, each on its own cache line,
+// and never wait on a lock; a full or empty ring makes ring_push and
+// ring_pop back off (spin, then yield, then sleep) until it is not.
+// Items are opaque, NULL included.
+typedef struct ring {
+  size_t mask;  // capacity - 1, capacity a power of two
+  RingSlot* slots;
+  char pad0[64 - sizeof(size_t) - sizeof(RingSlot*)];
+  _Atomic size_t tail;  // next position to fill
+  char pad1[64 - sizeof(size_t)];
+  _Atomic size_t head;  // next position to empty
+  char pad2[64 - sizeof(size_t)];
+} Ring;
+
+Ring* ring_create(size_t capacity);
+void  ring_free(Ring* r);
+int   ring_try_push(Ring* r, void* item);
+int   ring_try_pop(Ring* r, void** item);
+void  ring_push(Ring* r, void* item);
+void* ring_pop(Ring* r);
+
+#endif /* RING_H */
@@ -0,0 +1,46 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+#include "ppm.h"
+#include "pool.h"
+
+// Side of the window, in pixels, whose grey level statistics decide
+// whether a block is foreground
+#define SEGMENT_WINDOW 16
+
+// A block is foreground when its window variance reaches this fraction of
+// the variance of the whole image...
+#define SEGMENT_MIN_VARIANCE 0.1f
+// ...and its neighbourhood has a consistent ridge orientation
+#define SEGMENT_MIN_CONSISTENCY 0.2f
+
+// One bit per block of a grid (or per pixel, see skeleton.h), row-major;
+// each row is padded to whole 64-bit words (padding bits are always 0).
+typedef struct block_mask {
+  int width;
+  int height;
+  int words; // words per row
+  uint64_t* bits;
+} BlockMask;
+
+// A NULL mask stands for "every block is foreground"
+static inline int mask_get(const BlockMask* m, int i, int j) {
+  if (!m) return 1;
+  return (m->bits[(size_t)j * m->words + (i >> 6)] >> (i & 63)) & 1;
+}
+
+static inline void mask_set(BlockMask* m, int i, int j, int value) {
+  uint64_t* word = &m->bits[(size_t)j * m->words + (i >> 6)];
+  uint64_t bit = (uint64_t)1 << (i & 63);
+  *word = value ? (*word | bit) : (*word & ~bit);
+}
+
+BlockMask* mask_create_in(Arena* arena, int width, int height);
+void       mask_free(BlockMask* m);
+int        mask_count(const BlockMask* m);
+void       mask_dilate(BlockMask* m, Arena* scratch);
+void       mask_erode(BlockMask* m, Arena* scratch);
+
+BlockMask* segment_image(const Plane8* im, int block_size, int width, int height, Pool* pool, Arena* arena);
+void       segment_refine(BlockMask* m, Fingerprint* fp, int block_size, Arena* scratch);
+
+#endif /* SEGMENT_H */
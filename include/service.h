@@ -0,0 +1,109 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+#include <pthread.h>
+#include <stdio.h>
+#include "fingerprint.h"
+#include "gallery.h"
+#include "pool.h"
+
+// Requests read ahead of the replies: once this many are pending, reading
+// stops until the oldest reply is written
+#define SERVICE_QUEUE 64
+
+// Clients served at once by service_listen; the others wait to be accepted
+#define SERVICE_CLIENTS 16
+
+// Pause after a connection could not be accepted (e.g. out of file
+// descriptors), in milliseconds
+#define SERVICE_RETRY_MS 100
+
+// Longest request and reply lines, newline included; longer requests get
+// "error request too long"
+#define SERVICE_LINE 4096
+
+// Candidates of an identify request when it does not say
+#define SERVICE_CANDIDATES 5
+
+// Files a request names, at most
+#define SERVICE_FILES 2
+
+// File named by a request: bytes [at, at + len) of its line
+typedef struct service_file {
+  int at;
+  int len;
+  int written;
+} ServiceFile;
+
+// Slot of the request queue
+typedef struct service_request {
+  char line[SERVICE_LINE];
+  char reply[SERVICE_LINE];
+  int done;
+  int too_long;  // the line did not fit: only its start is in `line`
+  ServiceFile files[SERVICE_FILES];
+  int n_files;
+} ServiceRequest;
+
+// What a worker keeps from one request to the next (see BatchWorker)
+typedef struct service_worker {
+  Arena* arena;
+  Pool* serial;
+} ServiceWorker;
+
+// One client of the server and its requests. Requests are read into a
+// ring of SERVICE_QUEUE slots, processed by the workers in any order and
+// answered in the order they came, so a client may send many requests
+// without waiting for the replies. A request that names a file an earlier
+// pending one writes, or writes a file an earlier one names, waits for it:
+// an enroll and a verify of the template it saves may be sent back to
+// back. Files are compared by the path as written.
+// Slots [head, next) are being processed, [next, tail) wait for a worker.
+typedef struct service_stream {
+  struct service* s;
+  FILE* out;
+  int fd;                // socket of the client, -1 when not one
+  ServiceRequest slots[SERVICE_QUEUE];
+  unsigned long head;    // oldest request without a reply written
+  unsigned long next;    // oldest request no worker has taken
+  unsigned long tail;    // where the next request goes
+  int closing;           // no more requests on this stream
+  pthread_cond_t done;   // a reply is ready
+  pthread_cond_t space;  // a slot was freed
+  struct service_stream* link;  // next stream of the service
+} ServiceStream;
+
+// Long-running server: the pipeline, its filter bank and the gallery are
+// loaded once, and every worker keeps its arenas warm between requests.
+// The workers are shared by all the streams being served, taking their
+// requests in turn.
+//   enroll <image> [template.fpt]       ok minutiae=.. endings=.. singular=.. bytes=..
+//   verify <probe.fpt> <reference.fpt>  ok score=..
+//   identify <probe.fpt> [k]            ok candidates=.. shortlisted=.. <name>=<score>...
+//   ping                                ok pong
+// Every reply ends with ms=<time spent on the request>; failures reply
+// "error <reason>". "quit" ends the stream, "shutdown" the server.
+typedef struct service {
+  const Pipeline* pl;    // borrowed
+  const Gallery* gallery; // borrowed, NULL: no identification
+  int threads;
+  pthread_t* handles;
+  ServiceWorker* workers;
+
+  ServiceStream* streams; // being served
+  ServiceStream* cursor;  // stream the workers look at first
+  int listener;          // listening socket, -1 when none
+  int clients;           // connections being served by service_listen
+  int shutdown;          // a client asked the server to stop
+  int stop;              // workers exit
+
+  pthread_mutex_t lock;
+  pthread_cond_t queued; // a request was added
+  pthread_cond_t left;   // a client connection ended
+} Service;
+
+Service* service_create(const Pipeline* pl, const Gallery* gallery, int threads);
+void     service_free(Service* s);
+int      service_run(Service* s, FILE* in, FILE* out);
+int      service_listen(Service* s, const char* path);
+
+#endif /* SERVICE_H */
@@ -0,0 +1,33 @@
+#ifndef SINGULAR_H
+#define SINGULAR_H
+#include "ppm.h"
+#include "segment.h"
+
+// Values of SingularPoint.type: the Poincaré index in half turns
+#define SINGULAR_CORE 1
+#define SINGULAR_DELTA -1
+
+// Half side, in pixels, of the square curve around which the orientation
+// turns are summed
+#define SINGULAR_RADIUS 6
+
+// A core and a delta closer than this (pixels) come from orientation
+// noise and cancel out
+#define SINGULAR_MIN_DISTANCE 16
+
+typedef struct singular_point {
+  float x;   // pixels, centroid of the cells of the point
+  float y;
+  int type;
+  int cells; // number of cells with this index around the point
+} SingularPoint;
+
+typedef struct singularities {
+  int count;
+  SingularPoint* points;
+} Singularities;
+
+Singularities* singularities_detect(const Fingerprint* fp, const BlockMask* mask, int block_size, Arena* arena);
+void           singularities_free(Singularities* s);
+
+#endif /* SINGULAR_H */
@@ -0,0 +1,31 @@
+#ifndef SKELETON_H
+#define SKELETON_H
+#include "ppm.h"
+#include "pool.h"
+#include "segment.h"
+
+// 3x3 neighbourhood of pixel (x, y), which must not be on the frame, read
+// straight from three packed rows: bits 0-2 are the row above (x - 1 to
+// x + 1), bits 3-5 the pixel's own row and bits 6-8 the row below
+static inline unsigned ridge_neighbourhood(const BlockMask* m, int x, int y) {
+  const uint64_t* row = m->bits + (size_t)y * m->words;
+  unsigned code = 0;
+  for (int r = 0; r < 3; r++) {
+    const uint64_t* words = row + (r - 1) * m->words;
+    int lo = x - 1, b = lo & 63;
+    uint64_t bits = words[lo >> 6] >> b;
+    if (b > 61) bits |= words[(lo >> 6) + 1] << (64 - b);
+    code |= (bits & 7) << (3 * r);
+  }
+  return code;
+}
+
+// Ridge pixels of the enhanced image: one bit per pixel, set on ridges of
+// the foreground blocks. The one pixel frame of the image is always clear
+// so that 3x3 neighbourhoods never leave the image.
+BlockMask* binarize(const PlaneF* enhanced, const BlockMask* mask, int block_size, Pool* pool, Arena* arena);
+
+int        thin(BlockMask* ridges, Arena* scratch);
+Plane8*    skeleton_to_plane8(const BlockMask* ridges, Arena* arena);
+
+#endif /* SKELETON_H */
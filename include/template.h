@@ -0,0 +1,85 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+#include <stddef.h>
+#include <stdint.h>
+#include "fingerprint.h"
+
+#define TEMPLATE_MAGIC "FPT\0"
+#define TEMPLATE_VERSION 1
+
+// Side, in pixels, of the cells of the downsampled orientation and
+// frequency fields
+#define TEMPLATE_FIELD_STEP 16
+
+// Stored ridge periods are in 1/TEMPLATE_PERIOD_SCALE pixels
+#define TEMPLATE_PERIOD_SCALE 8
+
+// A template is one contiguous little endian buffer, read in place once
+// written or mapped: no parsing, no pointers. Sections follow the header
+// in this order, each starting on an 8-byte boundary:
+//   TemplateMinutia[minutiae]
+//   TemplateSingular[singular]
+//   uint8_t orientation[field_width * field_height]  (angle, PI = 256)
+//   uint8_t period[field_width * field_height]       (0: background)
+typedef struct template_header {
+  char magic[4];
+  uint16_t version;
+  uint16_t header_size;  // sizeof(TemplateHeader)
+  uint32_t size;         // whole template in bytes, a multiple of 8
+  uint16_t width;        // image size in pixels
+  uint16_t height;
+  uint16_t minutiae;
+  uint16_t singular;
+  uint16_t field_width;  // 0 when the fields are left out
+  uint16_t field_height;
+  uint16_t field_step;
+  uint16_t reserved;
+  uint32_t crc;          // CRC-32 of the template, this field taken as 0
+} TemplateHeader;
+
+typedef struct template_minutia {
+  uint16_t x;
+  uint16_t y;
+  uint8_t angle;         // 2 PI = 256
+  uint8_t type;
+  uint8_t quality;
+  uint8_t reserved;
+} TemplateMinutia;
+
+typedef struct template_singular {
+  int16_t x;             // pixels, rounded
+  int16_t y;
+  int8_t type;
+  uint8_t reserved;
+  uint16_t cells;
+} TemplateSingular;
+
+// Typed pointers into a template buffer
+typedef struct template_view {
+  const TemplateHeader* header;
+  const TemplateMinutia* minutiae;
+  const TemplateSingular* singular;
+  const uint8_t* orientation;  // NULL without fields
+  const uint8_t* period;
+} TemplateView;
+
+// Read-only mapping of a template file
+typedef struct template_map {
+  void* base;
+  size_t length;
+  TemplateView view;
+} TemplateMap;
+
+static inline float template_minutia_angle(const TemplateMinutia* m) {
+  return m->angle * (float)(2 * PI / 256);
+}
+
+size_t       template_size(int minutiae, int singular, int field_width, int field_height);
+void*        template_build(const Enrollment* res, int fields, size_t* size, Arena* arena);
+int          template_view(const void* data, size_t size, TemplateView* view);
+int          template_check(const void* data, size_t size);
+int          template_save(const void* data, size_t size, const char* filename);
+TemplateMap* template_map(const char* filename);
+void         template_unmap(TemplateMap* map);
+
+#endif /* TEMPLATE_H */
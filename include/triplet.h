@@ -0,0 +1,47 @@
+#ifndef TRIPLET_H
+#define TRIPLET_H
+#include <stdint.h>
+#include "template.h"
+
+// Triangles are made of a minutia and two of its this many nearest
+// neighbours
+#define TRIPLET_NEIGHBOURS 4
+
+// Quantization of the features of a triangle: sides in this many pixels,
+// directions of the minutiae in 1/8 turns, ridges crossed by the longest
+// side in pairs of ridges
+#define TRIPLET_DISTANCE 8
+#define TRIPLET_RIDGES 2
+
+// Longer sides would not survive the distortion of the skin
+#define TRIPLET_MAX_SIDE 248
+
+// Slot of the hash table: the posting list of one key, entries
+// postings[start] to postings[start + count - 1]. Empty when count is 0.
+typedef struct triplet_slot {
+  uint32_t key;
+  uint32_t start;
+  uint32_t count;
+} TripletSlot;
+
+// Inverted index from triplet keys to the gallery entries that have them:
+// an open-addressing table (linear probing, power of two capacity) of
+// posting lists stored back to back in one array
+typedef struct triplet_index {
+  int bits;  // capacity is 1 << bits
+  TripletSlot* slots;
+  uint32_t* postings;
+  size_t count;  // postings
+} TripletIndex;
+
+typedef struct triplet_vote {
+  int entry;
+  int votes;
+} TripletVote;
+
+int           triplet_max_keys(const TemplateView* t);
+int           triplet_keys(const TemplateView* t, uint32_t* keys, Arena* scratch);
+TripletIndex* triplet_index_build(uint64_t* pairs, size_t count, Arena* arena);
+TripletVote*  triplet_index_vote(const TripletIndex* index, const uint32_t* keys, int n, int* count, Arena* scratch);
+
+#endif /* TRIPLET_H */
@@ -0,0 +1,141 @@
+#include "arena.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks are allocated with their header; the data starts on the next
+// ARENA_ALIGN boundary
+#define HEADER_SIZE ((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static inline char* block_data(ArenaBlock* b) {
+  return (char*)b + HEADER_SIZE;
+}
+
+static ArenaBlock* block_create(size_t size) {
+  size = align_up(size);
+  ArenaBlock* b = aligned_alloc(ARENA_ALIGN, HEADER_SIZE + size);
+  if (!b) return NULL;
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+static void blocks_free(ArenaBlock* b) {
+  while (b) {
+    ArenaBlock* next = b->next;
+    free(b);
+    b = next;
+  }
+}
+
+Arena* arena_create(size_t block_size) {
+  Arena* arena = malloc(sizeof(Arena));
+  if (!arena) return NULL;
+  arena->blocks = NULL;
+  arena->spare = NULL;
+  arena->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+  return arena;
+}
+
+void arena_free(Arena* arena) {
+  if (!arena) return;
+  blocks_free(arena->blocks);
+  blocks_free(arena->spare);
+  free(arena);
+}
+
+// `size` bytes aligned on ARENA_ALIGN. A NULL arena falls back on the
+// heap: the memory must then be given back with arena_release().
+void* arena_alloc(Arena* arena, size_t size) {
+  size = align_up(size ? size : 1);
+  if (!arena) return aligned_alloc(ARENA_ALIGN, size);
+
+  ArenaBlock* b = arena->blocks;
+  if (!b || b->size - b->used < size) {
+    // Reuse a spare block if it is large enough, otherwise grow: each new
+    // block is at least as large as everything allocated so far
+    ArenaBlock** link = &arena->spare;
+    while (*link && (*link)->size < size) link = &(*link)->next;
+
+    if (*link) {
+      b = *link;
+      *link = b->next;
+    } else {
+      size_t want = arena->block_size;
+      size_t total = arena_capacity(arena);
+      if (want < total) want = total;
+      if (want < size) want = size;
+      b = block_create(want);
+      if (!b) return NULL;
+    }
+    b->used = 0;
+    b->next = arena->blocks;
+    arena->blocks = b;
+  }
+
+  void* ptr = block_data(b) + b->used;
+  b->used += size;
+  return ptr;
+}
+
+void* arena_calloc(Arena* arena, size_t count, size_t size) {
+  void* ptr = arena_alloc(arena, count * size);
+  if (ptr) memset(ptr, 0, count * size);
+  return ptr;
+}
+
+// Give back memory from arena_alloc(): frees it when it came from the heap
+// (NULL arena), does nothing for arena memory, which is only reclaimed by
+// arena_rewind() and arena_reset()
+void arena_release(Arena* arena, void* ptr) {
+  if (!arena) free(ptr);
+}
+
+ArenaMark arena_mark(const Arena* arena) {
+  ArenaMark mark = { NULL, 0 };
+  if (arena && arena->blocks) {
+    mark.block = arena->blocks;
+    mark.used = arena->blocks->used;
+  }
+  return mark;
+}
+
+// Drop every allocation made since `mark`
+void arena_rewind(Arena* arena, ArenaMark mark) {
+  if (!arena) return;
+
+  while (arena->blocks && arena->blocks != mark.block) {
+    ArenaBlock* b = arena->blocks;
+    arena->blocks = b->next;
+    b->next = arena->spare;
+    arena->spare = b;
+  }
+  if (arena->blocks) arena->blocks->used = mark.used;
+}
+
+// Drop everything. When the last use needed several blocks they are
+// replaced by a single one of their total size.
+void arena_reset(Arena* arena) {
+  if (!arena) return;
+
+  arena_rewind(arena, (ArenaMark){ NULL, 0 });
+  if (arena->spare && arena->spare->next) {
+    size_t total = arena_capacity(arena);
+    blocks_free(arena->spare);
+    arena->spare = block_create(total);
+  }
+}
+
+// Bytes held by the arena, used or not
+size_t arena_capacity(const Arena* arena) {
+  size_t total = 0;
+  if (!arena) return 0;
+  for (ArenaBlock* b = arena->blocks; b; b = b->next) total += b->size;
+  for (ArenaBlock* b = arena->spare; b; b = b->next) total += b->size;
+  return total;
+}
@@ -0,0 +1,488 @@
+#include "convolve.h"
+#include "fft.h"
+#include "pool.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CONVOLVE_X86 1
+#endif
+
+// Output rows produced per strip; bounds the padded scratch buffers
+#define STRIP_ROWS 64
+
+// Kernel area (taps) from which non-separable kernels are applied through
+// the FFT instead of directly. Measured on 512x512 planes against the AVX2
+// row kernel, the crossover is around 21x21 taps. Regions smaller than two
+// kernels stay direct whatever the kernel: Gabor enhancement filters
+// groups of a few blocks, and sending those through the FFT (one kernel
+// transform per region) measured 15 to 30 times slower, up to 37x37 taps.
+#ifndef CONVOLVE_FFT_AREA
+#define CONVOLVE_FFT_AREA 441
+#endif
+
+// Relative tolerance of the rank-1 test in kernel_create
+#define SEPARABLE_TOLERANCE 1E-5
+
+/* Row kernels: out[x] += k * in[x] for x in [0, n) */
+
+typedef void (*axpy_fn)(float* restrict out, const float* restrict in, float k, int n);
+
+static void axpy_scalar(float* restrict out, const float* restrict in, float k, int n) {
+  for (int x = 0; x < n; x++) out[x] += k * in[x];
+}
+
+#ifdef CONVOLVE_X86
+__attribute__((target("sse2")))
+static void axpy_sse(float* restrict out, const float* restrict in, float k, int n) {
+  __m128 kv = _mm_set1_ps(k);
+  int x = 0;
+  for (; x + 4 <= n; x += 4) {
+    __m128 acc = _mm_loadu_ps(out + x);
+    acc = _mm_add_ps(acc, _mm_mul_ps(kv, _mm_loadu_ps(in + x)));
+    _mm_storeu_ps(out + x, acc);
+  }
+  for (; x < n; x++) out[x] += k * in[x];
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(float* restrict out, const float* restrict in, float k, int n) {
+  __m256 kv = _mm256_set1_ps(k);
+  int x = 0;
+  for (; x + 16 <= n; x += 16) {
+    __m256 a0 = _mm256_fmadd_ps(kv, _mm256_loadu_ps(in + x), _mm256_loadu_ps(out + x));
+    __m256 a1 = _mm256_fmadd_ps(kv, _mm256_loadu_ps(in + x + 8), _mm256_loadu_ps(out + x + 8));
+    _mm256_storeu_ps(out + x, a0);
+    _mm256_storeu_ps(out + x + 8, a1);
+  }
+  for (; x + 8 <= n; x += 8) {
+    __m256 acc = _mm256_fmadd_ps(kv, _mm256_loadu_ps(in + x), _mm256_loadu_ps(out + x));
+    _mm256_storeu_ps(out + x, acc);
+  }
+  for (; x < n; x++) out[x] += k * in[x];
+}
+#endif
+
+static axpy_fn axpy = axpy_scalar;
+static const char* backend = "scalar";
+
+// Pick the widest row kernel the CPU supports, once, before main runs
+__attribute__((constructor))
+static void convolve_select_backend(void) {
+#ifdef CONVOLVE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    axpy = axpy_avx2;
+    backend = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    axpy = axpy_sse;
+    backend = "sse";
+  }
+#endif
+}
+
+const char* convolve_backend(void) {
+  return backend;
+}
+
+/* Kernels */
+
+static Kernel* kernel_alloc(int width, int height) {
+  Kernel* k = malloc(sizeof(Kernel));
+  k->width = width;
+  k->height = height;
+  k->taps = malloc(sizeof(float) * width * height);
+  k->row = malloc(sizeof(float) * width);
+  k->col = malloc(sizeof(float) * height);
+  k->separable = 0;
+  return k;
+}
+
+// Rank-1 test: pivot on the largest tap (p, q), then check that every
+// tap equals col[j] * row[i] with row = taps[p][.] and col = taps[.][q] / pivot.
+static void detect_separable(Kernel* k) {
+  int w = k->width, h = k->height;
+  int p = 0, q = 0;
+  float max = 0;
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      if (fabsf(k->taps[j * w + i]) > max) {
+        max = fabsf(k->taps[j * w + i]);
+        p = j;
+        q = i;
+      }
+    }
+  }
+  if (max == 0) return;
+
+  float pivot = k->taps[p * w + q];
+  for (int i = 0; i < w; i++) k->row[i] = k->taps[p * w + i];
+  for (int j = 0; j < h; j++) k->col[j] = k->taps[j * w + q] / pivot;
+
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      if (fabsf(k->taps[j * w + i] - k->col[j] * k->row[i]) > SEPARABLE_TOLERANCE * max) return;
+    }
+  }
+  k->separable = 1;
+}
+
+Kernel* kernel_create(const float* taps, int width, int height) {
+  if (!taps || width <= 0 || height <= 0) return NULL;
+
+  Kernel* k = kernel_alloc(width, height);
+  memcpy(k->taps, taps, sizeof(float) * width * height);
+  detect_separable(k);
+  return k;
+}
+
+Kernel* kernel_from_int(const int* taps, int size) {
+  if (!taps || size <= 0) return NULL;
+
+  Kernel* k = kernel_alloc(size, size);
+  for (int i = 0; i < size * size; i++) k->taps[i] = taps[i];
+  detect_separable(k);
+  return k;
+}
+
+Kernel* kernel_separable(const float* row, int width, const float* col, int height) {
+  if (!row || !col || width <= 0 || height <= 0) return NULL;
+
+  Kernel* k = kernel_alloc(width, height);
+  memcpy(k->row, row, sizeof(float) * width);
+  memcpy(k->col, col, sizeof(float) * height);
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) k->taps[j * width + i] = col[j] * row[i];
+  }
+  k->separable = 1;
+  return k;
+}
+
+// Set up `k` over storage owned by the caller (e.g. a filter bank):
+// `row` and `col` receive the 1D passes if the taps turn out separable.
+// Views must not be passed to kernel_free.
+void kernel_view(Kernel* k, float* taps, int width, int height, float* row, float* col) {
+  k->width = width;
+  k->height = height;
+  k->taps = taps;
+  k->row = row;
+  k->col = col;
+  k->separable = 0;
+  detect_separable(k);
+}
+
+void kernel_free(Kernel* k) {
+  if (!k) return;
+  free(k->taps);
+  free(k->row);
+  free(k->col);
+  free(k);
+}
+
+/* Padding */
+
+// Either a float or an 8-bit plane; both entry points share the engine
+typedef struct source {
+  const PlaneF* f;
+  const Plane8* u8;
+  int width;
+  int height;
+} Source;
+
+// Map a coordinate outside [0, n) according to the border mode.
+// Returns -1 when the sample is zero.
+static int border_index(int i, int n, BorderMode border) {
+  if (i >= 0 && i < n) return i;
+
+  if (border == BORDER_ZERO) return -1;
+  if (border == BORDER_REFLECT) {
+    if (n == 1) return 0;
+    int period = 2 * (n - 1);
+    i %= period;
+    if (i < 0) i += period;
+    return i < n ? i : period - i;
+  }
+  // BORDER_REPLICATE; VALID only gets here through convolve_region
+  return i < 0 ? 0 : n - 1;
+}
+
+// Fill `out` with the len samples of source row sy starting at column sx0
+static void fill_row(const Source* s, int sy, int sx0, int len, BorderMode border, float* out) {
+  sy = border_index(sy, s->height, border);
+  if (sy < 0) {
+    memset(out, 0, sizeof(float) * len);
+    return;
+  }
+
+  // Columns [a, b) of the output read inside the source row
+  int a = sx0 < 0 ? -sx0 : 0;
+  int b = s->width - sx0 < len ? s->width - sx0 : len;
+  if (a > len) a = len;
+  if (b < a) b = a;
+
+  if (s->f) {
+    const float* src = planef_row(s->f, sy);
+    memcpy(out + a, src + sx0 + a, sizeof(float) * (b - a));
+    for (int x = 0; x < a; x++) {
+      int sx = border_index(sx0 + x, s->width, border);
+      out[x] = sx < 0 ? 0 : src[sx];
+    }
+    for (int x = b; x < len; x++) {
+      int sx = border_index(sx0 + x, s->width, border);
+      out[x] = sx < 0 ? 0 : src[sx];
+    }
+  } else {
+    const uint8_t* src = plane8_row(s->u8, sy);
+    for (int x = a; x < b; x++) out[x] = src[sx0 + x];
+    for (int x = 0; x < a; x++) {
+      int sx = border_index(sx0 + x, s->width, border);
+      out[x] = sx < 0 ? 0 : src[sx];
+    }
+    for (int x = b; x < len; x++) {
+      int sx = border_index(sx0 + x, s->width, border);
+      out[x] = sx < 0 ? 0 : src[sx];
+    }
+  }
+}
+
+/* Engine */
+
+// dst(x, y) = sum k(i, j) * src(x0 + x + i - ax, y0 + y + j - ay)
+// The source is padded one strip of output rows at a time; separable
+// kernels run a horizontal pass into `tmp`, then a vertical pass.
+// Both buffers come from `scratch` (heap when NULL).
+static void convolve_direct(const Source* s, const Kernel* k, BorderMode border, int x0, int y0, PlaneF* dst, Arena* scratch) {
+  int w = k->width, h = k->height;
+  int ax = w / 2, ay = h / 2;
+  int out_w = dst->width;
+  int pad_w = out_w + w - 1;
+  int pad_rows = STRIP_ROWS + h - 1;
+
+  ArenaMark mark = arena_mark(scratch);
+  float* patch = arena_alloc(scratch, sizeof(float) * pad_w * pad_rows);
+  float* tmp = k->separable ? arena_alloc(scratch, sizeof(float) * out_w * pad_rows) : NULL;
+
+  for (int ys = 0; ys < dst->height; ys += STRIP_ROWS) {
+    int rows = dst->height - ys < STRIP_ROWS ? dst->height - ys : STRIP_ROWS;
+
+    for (int r = 0; r < rows + h - 1; r++) {
+      fill_row(s, y0 + ys + r - ay, x0 - ax, pad_w, border, patch + r * pad_w);
+    }
+
+    if (k->separable) {
+      for (int r = 0; r < rows + h - 1; r++) {
+        float* t = tmp + r * out_w;
+        memset(t, 0, sizeof(float) * out_w);
+        for (int i = 0; i < w; i++) {
+          if (k->row[i] != 0) axpy(t, patch + r * pad_w + i, k->row[i], out_w);
+        }
+      }
+      for (int y = 0; y < rows; y++) {
+        float* out = planef_row(dst, ys + y);
+        memset(out, 0, sizeof(float) * out_w);
+        for (int j = 0; j < h; j++) {
+          if (k->col[j] != 0) axpy(out, tmp + (y + j) * out_w, k->col[j], out_w);
+        }
+      }
+    } else {
+      for (int y = 0; y < rows; y++) {
+        float* out = planef_row(dst, ys + y);
+        memset(out, 0, sizeof(float) * out_w);
+        for (int j = 0; j < h; j++) {
+          for (int i = 0; i < w; i++) {
+            float t = k->taps[j * w + i];
+            if (t != 0) axpy(out, patch + (y + j) * pad_w + i, t, out_w);
+          }
+        }
+      }
+    }
+  }
+
+  arena_release(scratch, patch);
+  arena_release(scratch, tmp);
+  arena_rewind(scratch, mark);
+}
+
+// FFT size along one axis for a kernel of `taps` over `len` padded samples:
+// a power of two spanning several kernel widths, so that most of each
+// transform carries new input, but never much more than the input itself.
+static int fft_tile_size(int taps, int len) {
+  int want = 4 * taps;
+  if (want > len + taps - 1) want = len + taps - 1;
+  int n = 16;
+  while (n < want) n *= 2;
+  return n;
+}
+
+// Same result as convolve_direct, by tiled overlap-add. The padded source
+// is cut into tiles of (nx - w + 1) x (ny - h + 1) samples; each tile is
+// fully convolved in the frequency domain and added into dst.
+// Tiles go two at a time through one complex transform (the first in the
+// real part, the second in the imaginary part): the kernel is real, so the
+// two results come back separated in the real and imaginary parts.
+static void convolve_fft(const Source* s, const Kernel* k, BorderMode border, int x0, int y0, PlaneF* dst, Arena* scratch) {
+  int w = k->width, h = k->height;
+  int ax = w / 2, ay = h / 2;
+  int out_w = dst->width, out_h = dst->height;
+  int pad_w = out_w + w - 1, pad_h = out_h + h - 1;
+
+  int nx = fft_tile_size(w, pad_w);
+  int ny = fft_tile_size(h, pad_h);
+  int bx = nx - w + 1, by = ny - h + 1;
+  FftPlan* row_plan = fft_plan(nx);
+  FftPlan* col_plan = fft_plan(ny);
+
+  ArenaMark mark = arena_mark(scratch);
+  ComplexF* spectrum = arena_calloc(scratch, (size_t)nx * ny, sizeof(ComplexF));
+  ComplexF* buf = arena_alloc(scratch, sizeof(ComplexF) * nx * ny);
+  ComplexF* work = arena_alloc(scratch, sizeof(ComplexF) * nx * ny);
+  float* line = arena_alloc(scratch, sizeof(float) * bx);
+
+  // Correlation is a convolution with the flipped kernel; the inverse
+  // transform scale is folded into the spectrum
+  float scale = 1.0 / ((double)nx * ny);
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++) {
+      spectrum[j * nx + i].re = k->taps[(h - 1 - j) * w + (w - 1 - i)] * scale;
+    }
+  }
+  fft2d_forward(row_plan, col_plan, spectrum, work);
+
+  for (int y = 0; y < out_h; y++) memset(planef_row(dst, y), 0, sizeof(float) * out_w);
+
+  int tiles_x = (pad_w + bx - 1) / bx;
+  int tiles = tiles_x * ((pad_h + by - 1) / by);
+
+  for (int t = 0; t < tiles; t += 2) {
+    int pair = t + 1 < tiles ? 2 : 1;
+    memset(buf, 0, sizeof(ComplexF) * nx * ny);
+
+    for (int p = 0; p < pair; p++) {
+      int tx = ((t + p) % tiles_x) * bx, ty = ((t + p) / tiles_x) * by;
+      int len = pad_w - tx < bx ? pad_w - tx : bx;
+      int rows = pad_h - ty < by ? pad_h - ty : by;
+      for (int r = 0; r < rows; r++) {
+        fill_row(s, y0 - ay + ty + r, x0 - ax + tx, len, border, line);
+        ComplexF* dst_row = buf + r * nx;
+        if (p == 0) for (int x = 0; x < len; x++) dst_row[x].re = line[x];
+        else        for (int x = 0; x < len; x++) dst_row[x].im = line[x];
+      }
+    }
+
+    fft2d_forward(row_plan, col_plan, buf, work);
+    for (int i = 0; i < nx * ny; i++) {
+      ComplexF a = buf[i], b = spectrum[i];
+      buf[i].re = a.re * b.re - a.im * b.im;
+      buf[i].im = a.re * b.im + a.im * b.re;
+    }
+    fft2d_inverse(row_plan, col_plan, buf, work);
+
+    // Full convolution sample (X, Y) of the padded source is output
+    // pixel (X - w + 1, Y - h + 1)
+    for (int p = 0; p < pair; p++) {
+      int tx = ((t + p) % tiles_x) * bx, ty = ((t + p) / tiles_x) * by;
+      for (int v = 0; v < ny; v++) {
+        int y = ty + v - (h - 1);
+        if (y < 0 || y >= out_h) continue;
+        float* out = planef_row(dst, y);
+        const ComplexF* src = buf + v * nx;
+        int u0 = (w - 1) - tx > 0 ? (w - 1) - tx : 0;
+        int u1 = out_w + (w - 1) - tx < nx ? out_w + (w - 1) - tx : nx;
+        if (p == 0) for (int u = u0; u < u1; u++) out[tx + u - (w - 1)] += src[u].re;
+        else        for (int u = u0; u < u1; u++) out[tx + u - (w - 1)] += src[u].im;
+      }
+    }
+  }
+
+  arena_release(scratch, line);
+  arena_release(scratch, work);
+  arena_release(scratch, buf);
+  arena_release(scratch, spectrum);
+  arena_rewind(scratch, mark);
+  fft_plan_free(row_plan);
+  fft_plan_free(col_plan);
+}
+
+static void convolve_source(const Source* s, const Kernel* k, BorderMode border, int x0, int y0, PlaneF* dst, Arena* scratch) {
+  // Separable kernels are cheap enough directly whatever their size, and
+  // outputs smaller than a couple of kernels do not amortise the transforms
+  int large_output = dst->width >= 2 * k->width && dst->height >= 2 * k->height;
+  if (!k->separable && large_output && k->width * k->height >= CONVOLVE_FFT_AREA) {
+    convolve_fft(s, k, border, x0, y0, dst, scratch);
+  } else {
+    convolve_direct(s, k, border, x0, y0, dst, scratch);
+  }
+}
+
+typedef struct band_job {
+  const Source* s;
+  const Kernel* k;
+  BorderMode border;
+  int x0, y0;
+  int rows;
+  PlaneF* dst;
+  Pool* pool;
+} BandJob;
+
+// One band of output rows; the halo rows above and below it are read in
+// place from the shared source, with the border mode applied at its edges
+static void convolve_band(void* ctx, int index, int worker) {
+  const BandJob* job = ctx;
+  int y = index * job->rows;
+  int rows = job->dst->height - y < job->rows ? job->dst->height - y : job->rows;
+  PlaneF band = { job->dst->width, rows, job->dst->stride, 0, planef_row(job->dst, y) };
+  convolve_source(job->s, job->k, job->border, job->x0, job->y0 + y, &band, pool_scratch(job->pool, worker));
+}
+
+// Output plane for a whole-image convolution; VALID shrinks it and
+// starts at the anchor so that no sample is read outside the source.
+// The output is cut into bands of a fixed height whatever the pool, so
+// the result does not depend on the number of threads.
+static PlaneF* convolve_whole(const Source* s, const Kernel* k, BorderMode border, Pool* pool, Arena* arena) {
+  int x0 = 0, y0 = 0;
+  int width = s->width, height = s->height;
+
+  if (border == BORDER_VALID) {
+    width -= k->width - 1;
+    height -= k->height - 1;
+    x0 = k->width / 2;
+    y0 = k->height / 2;
+    if (width <= 0 || height <= 0) return NULL;
+  }
+
+  PlaneF* dst = planef_create_in(arena, width, height);
+  if (!dst) return NULL;
+
+  BandJob job = { s, k, border, x0, y0, STRIP_ROWS, dst, pool };
+  if (job.rows < 2 * k->height) job.rows = 2 * k->height;
+  pool_run(pool, (height + job.rows - 1) / job.rows, convolve_band, &job);
+  return dst;
+}
+
+PlaneF* convolve(const PlaneF* src, const Kernel* k, BorderMode border, Pool* pool, Arena* arena) {
+  if (!src || !k) return NULL;
+
+  Source s = { src, NULL, src->width, src->height };
+  return convolve_whole(&s, k, border, pool, arena);
+}
+
+PlaneF* convolve_plane8(const Plane8* src, const Kernel* k, BorderMode border, Pool* pool, Arena* arena) {
+  if (!src || !k) return NULL;
+
+  Source s = { NULL, src, src->width, src->height };
+  return convolve_whole(&s, k, border, pool, arena);
+}
+
+// Fill dst with the convolution output whose top-left pixel sits at
+// (x0, y0) of the source (kernel anchored on the output pixel).
+// BORDER_VALID behaves as BORDER_REPLICATE for reads outside the source.
+// Temporaries come from `scratch` (heap when NULL) and are released before
+// returning.
+void convolve_region(const PlaneF* src, const Kernel* k, BorderMode border, int x0, int y0, PlaneF* dst, Arena* scratch) {
+  if (!src || !k || !dst) return;
+
+  Source s = { src, NULL, src->width, src->height };
+  convolve_source(&s, k, border, x0, y0, dst, scratch);
+}
@@ -0,0 +1,40 @@
+#include "crc32.h"
+#include <string.h>
+
+#define CRC32_POLY 0xedb88320u
+
+// table[k][b]: CRC of byte b followed by k zero bytes
+static uint32_t table[8][256];
+
+__attribute__((constructor))
+static void crc32_build_tables(void) {
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t c = b;
+    for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+    table[0][b] = c;
+  }
+  for (int k = 1; k < 8; k++) {
+    for (int b = 0; b < 256; b++) table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+  }
+}
+
+// Slicing by 8: eight table lookups per 8 bytes instead of one per byte.
+// Assumes a little endian host.
+uint32_t crc32(uint32_t crc, const void* data, size_t length) {
+  const uint8_t* p = data;
+  crc = ~crc;
+
+  while (length >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+        ^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+    p += 8;
+    length -= 8;
+  }
+  while (length--) crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+
+  return ~crc;
+}
@@ -0,0 +1,252 @@
+#include "fft.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Mixed-radix decimation-in-time FFT. The input is split recursively by
+// the factors of n, then each level is recombined with a radix-p butterfly.
+// The inverse transform reuses the forward twiddles conjugated.
+
+static inline ComplexF cmul(ComplexF a, ComplexF b, int inverse) {
+  ComplexF r;
+  if (inverse) b.im = -b.im;
+  r.re = a.re * b.re - a.im * b.im;
+  r.im = a.re * b.im + a.im * b.re;
+  return r;
+}
+
+static void butterfly2(ComplexF* out, int fstride, const FftPlan* plan, int m, int inverse) {
+  ComplexF* out2 = out + m;
+  for (int k = 0; k < m; k++) {
+    ComplexF t = cmul(out2[k], plan->twiddles[k * fstride], inverse);
+    out2[k].re = out[k].re - t.re;
+    out2[k].im = out[k].im - t.im;
+    out[k].re += t.re;
+    out[k].im += t.im;
+  }
+}
+
+static void butterfly4(ComplexF* out, int fstride, const FftPlan* plan, int m, int inverse) {
+  for (int k = 0; k < m; k++) {
+    ComplexF s0 = cmul(out[k + m], plan->twiddles[k * fstride], inverse);
+    ComplexF s1 = cmul(out[k + 2 * m], plan->twiddles[2 * k * fstride], inverse);
+    ComplexF s2 = cmul(out[k + 3 * m], plan->twiddles[3 * k * fstride], inverse);
+
+    ComplexF s5 = { out[k].re - s1.re, out[k].im - s1.im };
+    out[k].re += s1.re;
+    out[k].im += s1.im;
+
+    ComplexF s3 = { s0.re + s2.re, s0.im + s2.im };
+    ComplexF s4 = { s0.re - s2.re, s0.im - s2.im };
+
+    out[k + 2 * m].re = out[k].re - s3.re;
+    out[k + 2 * m].im = out[k].im - s3.im;
+    out[k].re += s3.re;
+    out[k].im += s3.im;
+
+    // Multiplying s4 by -i (forward) or +i (inverse)
+    if (inverse) {
+      out[k + m].re = s5.re - s4.im;
+      out[k + m].im = s5.im + s4.re;
+      out[k + 3 * m].re = s5.re + s4.im;
+      out[k + 3 * m].im = s5.im - s4.re;
+    } else {
+      out[k + m].re = s5.re + s4.im;
+      out[k + m].im = s5.im - s4.re;
+      out[k + 3 * m].re = s5.re - s4.im;
+      out[k + 3 * m].im = s5.im + s4.re;
+    }
+  }
+}
+
+// Any radix, O(p^2) per output group
+static void butterfly_generic(ComplexF* out, int fstride, const FftPlan* plan, int m, int p, int inverse) {
+  ComplexF stack[16];
+  ComplexF* scratch = p <= 16 ? stack : malloc(sizeof(ComplexF) * p);
+  int n = plan->n;
+
+  for (int u = 0; u < m; u++) {
+    for (int q = 0, k = u; q < p; q++, k += m) scratch[q] = out[k];
+
+    for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+      int tw = 0;
+      out[k] = scratch[0];
+      for (int q = 1; q < p; q++) {
+        tw += fstride * k;
+        if (tw >= n) tw -= n;
+        ComplexF t = cmul(scratch[q], plan->twiddles[tw], inverse);
+        out[k].re += t.re;
+        out[k].im += t.im;
+      }
+    }
+  }
+
+  if (scratch != stack) free(scratch);
+}
+
+// `fstride` is the twiddle stride of this level; input samples are
+// fstride * in_stride apart (in_stride > 1 for strided columns)
+static void fft_work(ComplexF* out, const ComplexF* in, int fstride, int in_stride, const int* factors, const FftPlan* plan, int inverse) {
+  int p = factors[0];
+  int m = factors[1];
+  ComplexF* out_end = out + p * m;
+  size_t step = (size_t)fstride * in_stride;
+
+  if (m == 1) {
+    for (ComplexF* o = out; o != out_end; o++, in += step) *o = *in;
+  } else {
+    for (ComplexF* o = out; o != out_end; o += m, in += step) {
+      fft_work(o, in, fstride * p, in_stride, factors + 2, plan, inverse);
+    }
+  }
+
+  switch (p) {
+    case 2: butterfly2(out, fstride, plan, m, inverse); break;
+    case 4: butterfly4(out, fstride, plan, m, inverse); break;
+    default: butterfly_generic(out, fstride, plan, m, p, inverse); break;
+  }
+}
+
+FftPlan* fft_plan(int n) {
+  if (n <= 0) return NULL;
+
+  FftPlan* plan = malloc(sizeof(FftPlan));
+  plan->n = n;
+  plan->twiddles = malloc(sizeof(ComplexF) * n);
+
+  for (int i = 0; i < n; i++) {
+    double phase = -2.0 * M_PI * i / n;
+    plan->twiddles[i].re = cos(phase);
+    plan->twiddles[i].im = sin(phase);
+  }
+
+  // Radix 4 first, then 2, then odd factors in increasing order
+  int* f = plan->factors;
+  int p = 4, rest = n;
+  do {
+    while (rest % p) {
+      if (p == 4) p = 2;
+      else if (p == 2) p = 3;
+      else p += 2;
+      if (p * p > rest) p = rest;
+    }
+    rest /= p;
+    *f++ = p;
+    *f++ = rest;
+  } while (rest > 1);
+
+  return plan;
+}
+
+void fft_plan_free(FftPlan* plan) {
+  if (!plan) return;
+  free(plan->twiddles);
+  free(plan);
+}
+
+// `in` and `out` must not overlap
+void fft_forward(const FftPlan* plan, const ComplexF* in, ComplexF* out) {
+  fft_work(out, in, 1, 1, plan->factors, plan, 0);
+}
+
+void fft_inverse(const FftPlan* plan, const ComplexF* in, ComplexF* out) {
+  fft_work(out, in, 1, 1, plan->factors, plan, 1);
+}
+
+// Smallest length >= n whose only prime factors are 2, 3 and 5
+int fft_good_size(int n) {
+  if (n <= 1) return 1;
+  for (;; n++) {
+    int m = n;
+    while (m % 2 == 0) m /= 2;
+    while (m % 3 == 0) m /= 3;
+    while (m % 5 == 0) m /= 5;
+    if (m == 1) return n;
+  }
+}
+
+// Radix-2 Stockham transform along axis 0 of an n x len array, n a power
+// of two: each butterfly combines two whole rows, so the inner loop runs
+// over contiguous memory and vectorizes. `x` and `y` are ping-pong
+// buffers; the result ends up back in `x`.
+static void stockham_rows(const FftPlan* plan, int len, ComplexF* x, ComplexF* y, int inverse) {
+  int n = plan->n;
+  ComplexF* in = x;
+  ComplexF* out = y;
+
+  for (int span = n, s = 1; span > 1; span /= 2, s *= 2) {
+    int half = span / 2;
+    size_t block = (size_t)s * len;
+
+    for (int p = 0; p < half; p++) {
+      ComplexF w = plan->twiddles[p * (n / span)];
+      if (inverse) w.im = -w.im;
+
+      const ComplexF* restrict a = in + block * p;
+      const ComplexF* restrict b = in + block * (p + half);
+      ComplexF* restrict y0 = out + block * 2 * p;
+      ComplexF* restrict y1 = y0 + block;
+      for (size_t q = 0; q < block; q++) {
+        float dr = a[q].re - b[q].re, di = a[q].im - b[q].im;
+        y0[q].re = a[q].re + b[q].re;
+        y0[q].im = a[q].im + b[q].im;
+        y1[q].re = dr * w.re - di * w.im;
+        y1[q].im = dr * w.im + di * w.re;
+      }
+    }
+
+    ComplexF* t = in;
+    in = out;
+    out = t;
+  }
+
+  if (in != x) memcpy(x, in, sizeof(ComplexF) * n * len);
+}
+
+static void transpose(const ComplexF* in, ComplexF* out, int rows, int cols) {
+  // Small tiles keep both sides in cache
+  for (int y0 = 0; y0 < rows; y0 += 16) {
+    for (int x0 = 0; x0 < cols; x0 += 16) {
+      for (int y = y0; y < y0 + 16 && y < rows; y++) {
+        for (int x = x0; x < x0 + 16 && x < cols; x++) out[x * rows + y] = in[y * cols + x];
+      }
+    }
+  }
+}
+
+static int is_pow2(int n) {
+  return (n & (n - 1)) == 0;
+}
+
+static void fft2d(const FftPlan* row, const FftPlan* col, ComplexF* data, ComplexF* work, int inverse) {
+  int cols = row->n, rows = col->n;
+
+  if (is_pow2(rows) && is_pow2(cols)) {
+    // Columns first, then rows as the columns of the transpose
+    stockham_rows(col, cols, data, work, inverse);
+    transpose(data, work, rows, cols);
+    stockham_rows(row, rows, work, data, inverse);
+    transpose(work, data, cols, rows);
+    return;
+  }
+
+  for (int y = 0; y < rows; y++) {
+    ComplexF* r = data + y * cols;
+    memcpy(work, r, sizeof(ComplexF) * cols);
+    fft_work(r, work, 1, 1, row->factors, row, inverse);
+  }
+
+  // Columns are transformed straight from the strided input
+  for (int x = 0; x < cols; x++) {
+    fft_work(work, data + x, 1, cols, col->factors, col, inverse);
+    for (int y = 0; y < rows; y++) data[y * cols + x] = work[y];
+  }
+}
+
+void fft2d_forward(const FftPlan* row, const FftPlan* col, ComplexF* data, ComplexF* work) {
+  fft2d(row, col, data, work, 0);
+}
+
+void fft2d_inverse(const FftPlan* row, const FftPlan* col, ComplexF* data, ComplexF* work) {
+  fft2d(row, col, data, work, 1);
+}
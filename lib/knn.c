@@ -0,0 +1,297 @@
+#include "knn.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KNN_X86 1
+#endif
+
+/* Distance kernels: out[r] = |q - rows[r]|² for r in [0, count), rows
+   `stride` floats apart, stride a multiple of KNN_LANES */
+
+typedef void (*distance_fn)(const float* restrict q, const float* restrict rows, int stride, int count, float* restrict out);
+
+static void distance_scalar(const float* restrict q, const float* restrict rows, int stride, int count, float* restrict out) {
+  for (int r = 0; r < count; r++) {
+    const float* row = rows + (size_t)r * stride;
+    float acc = 0;
+    for (int x = 0; x < stride; x++) acc += (q[x] - row[x]) * (q[x] - row[x]);
+    out[r] = acc;
+  }
+}
+
+#ifdef KNN_X86
+__attribute__((target("sse2")))
+static float hsum_sse(__m128 v) {
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
+__attribute__((target("sse2")))
+static void distance_sse(const float* restrict q, const float* restrict rows, int stride, int count, float* restrict out) {
+  for (int r = 0; r < count; r++) {
+    const float* row = rows + (size_t)r * stride;
+    __m128 a0 = _mm_setzero_ps(), a1 = _mm_setzero_ps();
+    for (int x = 0; x < stride; x += 8) {
+      __m128 d0 = _mm_sub_ps(_mm_loadu_ps(q + x), _mm_loadu_ps(row + x));
+      __m128 d1 = _mm_sub_ps(_mm_loadu_ps(q + x + 4), _mm_loadu_ps(row + x + 4));
+      a0 = _mm_add_ps(a0, _mm_mul_ps(d0, d0));
+      a1 = _mm_add_ps(a1, _mm_mul_ps(d1, d1));
+    }
+    out[r] = hsum_sse(_mm_add_ps(a0, a1));
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx(__m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+// Four rows at a time share the loads of the query
+__attribute__((target("avx2,fma")))
+static void distance_avx2(const float* restrict q, const float* restrict rows, int stride, int count, float* restrict out) {
+  int r = 0;
+  for (; r + 4 <= count; r += 4) {
+    const float* row = rows + (size_t)r * stride;
+    __m256 a0 = _mm256_setzero_ps(), a1 = _mm256_setzero_ps();
+    __m256 a2 = _mm256_setzero_ps(), a3 = _mm256_setzero_ps();
+    for (int x = 0; x < stride; x += 8) {
+      __m256 qv = _mm256_loadu_ps(q + x);
+      __m256 d0 = _mm256_sub_ps(qv, _mm256_loadu_ps(row + x));
+      __m256 d1 = _mm256_sub_ps(qv, _mm256_loadu_ps(row + stride + x));
+      __m256 d2 = _mm256_sub_ps(qv, _mm256_loadu_ps(row + 2 * stride + x));
+      __m256 d3 = _mm256_sub_ps(qv, _mm256_loadu_ps(row + 3 * stride + x));
+      a0 = _mm256_fmadd_ps(d0, d0, a0);
+      a1 = _mm256_fmadd_ps(d1, d1, a1);
+      a2 = _mm256_fmadd_ps(d2, d2, a2);
+      a3 = _mm256_fmadd_ps(d3, d3, a3);
+    }
+    out[r] = hsum_avx(a0);
+    out[r + 1] = hsum_avx(a1);
+    out[r + 2] = hsum_avx(a2);
+    out[r + 3] = hsum_avx(a3);
+  }
+  for (; r < count; r++) {
+    const float* row = rows + (size_t)r * stride;
+    __m256 acc = _mm256_setzero_ps();
+    for (int x = 0; x < stride; x += 8) {
+      __m256 d = _mm256_sub_ps(_mm256_loadu_ps(q + x), _mm256_loadu_ps(row + x));
+      acc = _mm256_fmadd_ps(d, d, acc);
+    }
+    out[r] = hsum_avx(acc);
+  }
+}
+#endif
+
+static distance_fn distance = distance_scalar;
+static const char* backend = "scalar";
+
+// Pick the widest distance kernel the CPU supports, once, before main runs
+__attribute__((constructor))
+static void knn_select_backend(void) {
+#ifdef KNN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    distance = distance_avx2;
+    backend = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    distance = distance_sse;
+    backend = "sse";
+  }
+#endif
+}
+
+const char* knn_backend(void) {
+  return backend;
+}
+
+/* Matrix */
+
+KnnMatrix* knn_matrix_create(int rows, int dim) {
+  KnnMatrix* m = malloc(sizeof(KnnMatrix));
+  m->rows = rows;
+  m->dim = dim;
+  m->stride = (dim + KNN_LANES - 1) / KNN_LANES * KNN_LANES;
+  size_t bytes = sizeof(float) * m->stride * (rows > 0 ? rows : 1);
+  m->data = aligned_alloc(32, (bytes + 31) & ~(size_t)31);
+  memset(m->data, 0, bytes);
+  return m;
+}
+
+void knn_matrix_free(KnnMatrix* m) {
+  if (!m) return;
+  free(m->data);
+  free(m);
+}
+
+// Row `row`: dim floats followed by zero padding up to stride
+float* knn_row(const KnnMatrix* m, int row) {
+  return m->data + (size_t)row * m->stride;
+}
+
+/* Top-k: max-heap on (distance, row), the worst hit kept so far on top */
+
+static int worse(const KnnHit* a, const KnnHit* b) {
+  return a->distance > b->distance || (a->distance == b->distance && a->row > b->row);
+}
+
+static void heap_offer(KnnHit* heap, int* n, int k, KnnHit hit) {
+  int i;
+  if (*n < k) {
+    i = (*n)++;
+    while (i > 0 && worse(&hit, &heap[(i - 1) / 2])) {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = hit;
+    return;
+  }
+  if (!worse(&heap[0], &hit)) return;
+
+  // Replace the top and sift it down
+  i = 0;
+  for (;;) {
+    int c = 2 * i + 1;
+    if (c >= k) break;
+    if (c + 1 < k && worse(&heap[c + 1], &heap[c])) c++;
+    if (!worse(&heap[c], &hit)) break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = hit;
+}
+
+// Heap to hits sorted nearest first, in place
+static void heap_sort(KnnHit* heap, int n) {
+  for (int end = n - 1; end > 0; end--) {
+    KnnHit top = heap[0];
+    KnnHit last = heap[end];
+    int i = 0;
+    for (;;) {
+      int c = 2 * i + 1;
+      if (c >= end) break;
+      if (c + 1 < end && worse(&heap[c + 1], &heap[c])) c++;
+      if (!worse(&heap[c], &last)) break;
+      heap[i] = heap[c];
+      i = c;
+    }
+    heap[i] = last;
+    heap[end] = top;
+  }
+}
+
+// The k rows of m nearest to `query` (m->stride floats, zero padded),
+// nearest first, into hits[]. Rows are scored KNN_BLOCK at a time by the
+// distance kernel, then offered to a heap of the k best. Returns the
+// number of hits, min(k, rows).
+int knn_search(const KnnMatrix* m, const float* query, int k, KnnHit* hits) {
+  float d[KNN_BLOCK];
+  int n = 0;
+  if (k <= 0) return 0;
+
+  for (int r = 0; r < m->rows; r += KNN_BLOCK) {
+    int count = m->rows - r < KNN_BLOCK ? m->rows - r : KNN_BLOCK;
+    distance(query, knn_row(m, r), m->stride, count, d);
+    for (int i = 0; i < count; i++) heap_offer(hits, &n, k, (KnnHit){ r + i, d[i] });
+  }
+
+  heap_sort(hits, n);
+  return n;
+}
+
+/* Vantage-point tree */
+
+typedef struct knn_item {
+  int row;
+  float distance;
+} KnnItem;
+
+static int compare_items(const void* a, const void* b) {
+  const KnnItem* x = a;
+  const KnnItem* y = b;
+  if (x->distance != y->distance) return x->distance < y->distance ? -1 : 1;
+  return x->row - y->row;
+}
+
+// Subtree of items[0, n): the first item is the vantage point, the others
+// are split at their median distance to it
+static int tree_build(KnnTree* t, KnnItem* items, int n, int* next) {
+  if (n == 0) return -1;
+
+  int node = (*next)++;
+  KnnNode* p = &t->nodes[node];
+  p->vantage = items[0].row;
+  p->radius = 0;
+
+  const float* v = knn_row(t->m, p->vantage);
+  for (int i = 1; i < n; i++) {
+    distance(v, knn_row(t->m, items[i].row), t->m->stride, 1, &items[i].distance);
+    items[i].distance = sqrtf(items[i].distance);
+  }
+  qsort(items + 1, n - 1, sizeof(KnnItem), compare_items);
+
+  int inside = (n - 1) / 2;
+  if (inside > 0) p->radius = items[inside].distance;
+  p->inside = tree_build(t, items + 1, inside, next);
+  p->outside = tree_build(t, items + 1 + inside, n - 1 - inside, next);
+  return node;
+}
+
+KnnTree* knn_tree_build(const KnnMatrix* m) {
+  KnnTree* t = malloc(sizeof(KnnTree));
+  t->m = m;
+  t->nodes = malloc(sizeof(KnnNode) * (m->rows > 0 ? m->rows : 1));
+
+  KnnItem* items = malloc(sizeof(KnnItem) * (m->rows > 0 ? m->rows : 1));
+  for (int i = 0; i < m->rows; i++) items[i] = (KnnItem){ i, 0 };
+  int next = 0;
+  t->root = tree_build(t, items, m->rows, &next);
+  free(items);
+  return t;
+}
+
+void knn_tree_free(KnnTree* t) {
+  if (!t) return;
+  free(t->nodes);
+  free(t);
+}
+
+// Radius of the ball around the query that can still hold a better hit
+static inline float tau(const KnnHit* heap, int n, int k) {
+  return n < k ? INFINITY : sqrtf(heap[0].distance);
+}
+
+static void tree_search(const KnnTree* t, int node, const float* query, int k, KnnHit* heap, int* n) {
+  if (node < 0) return;
+  const KnnNode* p = &t->nodes[node];
+
+  float d2;
+  distance(query, knn_row(t->m, p->vantage), t->m->stride, 1, &d2);
+  heap_offer(heap, n, k, (KnnHit){ p->vantage, d2 });
+  float d = sqrtf(d2);
+
+  // Nearer side first; the other one only if the ball crosses the radius
+  if (d <= p->radius) {
+    tree_search(t, p->inside, query, k, heap, n);
+    if (d + tau(heap, *n, k) >= p->radius) tree_search(t, p->outside, query, k, heap, n);
+  } else {
+    tree_search(t, p->outside, query, k, heap, n);
+    if (d - tau(heap, *n, k) <= p->radius) tree_search(t, p->inside, query, k, heap, n);
+  }
+}
+
+// Same as knn_search, visiting only the subtrees of t that can hold one
+// of the k nearest rows
+int knn_tree_search(const KnnTree* t, const float* query, int k, KnnHit* hits) {
+  int n = 0;
+  if (k <= 0) return 0;
+  tree_search(t, t->root, query, k, hits, &n);
+  heap_sort(hits, n);
+  return n;
+}
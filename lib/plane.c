@@ -0,0 +1,141 @@
+#include "plane.h"
+#include <math.h>
+
+// Round n up to the next multiple of `align` (a power of two).
+static size_t align_up(size_t n, size_t align) {
+  return (n + align - 1) & ~(align - 1);
+}
+
+Plane8* plane8_create(int width, int height) {
+  return plane8_create_in(NULL, width, height);
+}
+
+// Plane allocated in `arena` (struct and samples), or on the heap when
+// arena is NULL. Arena planes are released with the arena, *_free ignores them.
+Plane8* plane8_create_in(Arena* arena, int width, int height) {
+  int stride = (int)align_up(width, PLANE_ALIGN);
+  size_t size = align_up((size_t)stride * height, PLANE_ALIGN) + PLANE_ALIGN;
+
+  Plane8* p = arena ? arena_alloc(arena, sizeof(Plane8)) : malloc(sizeof(Plane8));
+  if (!p) return NULL;
+
+  p->width = width;
+  p->height = height;
+  p->stride = stride;
+  p->owned = arena ? PLANE_ARENA : PLANE_OWNED;
+  p->data = arena_alloc(arena, size);
+  if (!p->data) {
+    if (!arena) free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+Plane8* plane8_wrap(uint8_t* data, int width, int height, int stride) {
+  Plane8* p = malloc(sizeof(Plane8));
+  if (!p) return NULL;
+
+  p->width = width;
+  p->height = height;
+  p->stride = stride;
+  p->owned = PLANE_BORROWED;
+  p->data = data;
+
+  return p;
+}
+
+void plane8_free(Plane8* p) {
+  if (!p || p->owned == PLANE_ARENA) return;
+  if (p->owned == PLANE_OWNED) free(p->data);
+  free(p);
+}
+
+PlaneF* planef_create(int width, int height) {
+  return planef_create_in(NULL, width, height);
+}
+
+PlaneF* planef_create_in(Arena* arena, int width, int height) {
+  size_t per_align = PLANE_ALIGN / sizeof(float);
+  int stride = (int)align_up(width, per_align);
+  size_t size = align_up(sizeof(float) * stride * height, PLANE_ALIGN) + PLANE_ALIGN;
+
+  PlaneF* p = arena ? arena_alloc(arena, sizeof(PlaneF)) : malloc(sizeof(PlaneF));
+  if (!p) return NULL;
+
+  p->width = width;
+  p->height = height;
+  p->stride = stride;
+  p->owned = arena ? PLANE_ARENA : PLANE_OWNED;
+  p->data = arena_alloc(arena, size);
+  if (!p->data) {
+    if (!arena) free(p);
+    return NULL;
+  }
+
+  return p;
+}
+
+PlaneF* planef_wrap(float* data, int width, int height, int stride) {
+  PlaneF* p = malloc(sizeof(PlaneF));
+  if (!p) return NULL;
+
+  p->width = width;
+  p->height = height;
+  p->stride = stride;
+  p->owned = PLANE_BORROWED;
+  p->data = data;
+
+  return p;
+}
+
+void planef_free(PlaneF* p) {
+  if (!p || p->owned == PLANE_ARENA) return;
+  if (p->owned == PLANE_OWNED) free(p->data);
+  free(p);
+}
+
+PlaneF* plane8_to_f(const Plane8* p) {
+  return plane8_to_f_in(NULL, p);
+}
+
+PlaneF* plane8_to_f_in(Arena* arena, const Plane8* p) {
+  PlaneF* res = planef_create_in(arena, p->width, p->height);
+  if (!res) return NULL;
+
+  for (int y = 0; y < p->height; y++) {
+    const uint8_t* src = plane8_row(p, y);
+    float* dst = planef_row(res, y);
+    for (int x = 0; x < p->width; x++) dst[x] = src[x];
+  }
+
+  return res;
+}
+
+Plane8* planef_to_8(const PlaneF* p) {
+  return planef_to_8_in(NULL, p);
+}
+
+// Stretch a float plane linearly so that its range maps onto 0-255
+Plane8* planef_to_8_in(Arena* arena, const PlaneF* p) {
+  Plane8* res = plane8_create_in(arena, p->width, p->height);
+  if (!res) return NULL;
+
+  float min = INFINITY, max = -INFINITY;
+  for (int y = 0; y < p->height; y++) {
+    const float* src = planef_row(p, y);
+    for (int x = 0; x < p->width; x++) {
+      if (src[x] < min) min = src[x];
+      if (src[x] > max) max = src[x];
+    }
+  }
+
+  float scale = max > min ? 255.0f / (max - min) : 0.0f;
+  for (int y = 0; y < p->height; y++) {
+    const float* src = planef_row(p, y);
+    uint8_t* dst = plane8_row(res, y);
+    for (int x = 0; x < p->width; x++) dst[x] = (uint8_t)((src[x] - min) * scale + 0.5f);
+  }
+
+  return res;
+}
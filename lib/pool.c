@@ -0,0 +1,182 @@
+#include "pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static inline uint64_t pack(uint32_t lo, uint32_t hi) {
+  return (uint64_t)hi << 32 | lo;
+}
+
+static inline uint32_t range_lo(uint64_t r) {
+  return (uint32_t)r;
+}
+
+static inline uint32_t range_hi(uint64_t r) {
+  return (uint32_t)(r >> 32);
+}
+
+// Take the first index of our own range, -1 when it is empty
+static int pop_own(PoolDeque* d) {
+  uint64_t r = atomic_load(&d->range);
+  while (range_lo(r) < range_hi(r)) {
+    if (atomic_compare_exchange_weak(&d->range, &r, pack(range_lo(r) + 1, range_hi(r)))) {
+      return range_lo(r);
+    }
+  }
+  return -1;
+}
+
+// Steal the back half of another worker's range. The first stolen index
+// is returned, the rest becomes our own (empty) range.
+static int steal(Pool* pool, int self) {
+  for (int i = 1; i < pool->threads; i++) {
+    PoolDeque* victim = &pool->deques[(self + i) % pool->threads];
+    uint64_t r = atomic_load(&victim->range);
+
+    while (range_lo(r) < range_hi(r)) {
+      uint32_t lo = range_lo(r), hi = range_hi(r);
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (atomic_compare_exchange_weak(&victim->range, &r, pack(lo, mid))) {
+        atomic_store(&pool->deques[self].range, pack(mid + 1, hi));
+        return mid;
+      }
+    }
+  }
+  return -1;
+}
+
+static void run_share(Pool* pool, int self) {
+  for (;;) {
+    int index = pop_own(&pool->deques[self]);
+    if (index < 0) index = steal(pool, self);
+    if (index < 0) return;
+    pool->task(pool->ctx, index, self);
+  }
+}
+
+static void* worker_main(void* arg) {
+  Pool* pool = ((void**)arg)[0];
+  int self = (int)(intptr_t)((void**)arg)[1];
+  free(arg);
+
+  unsigned long seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->generation == seen) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->shutdown) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_share(pool, self);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) pthread_cond_signal(&pool->idle);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// threads <= 1 gives a pool without helper threads: loops run inline
+Pool* pool_create(int threads) {
+  Pool* pool = malloc(sizeof(Pool));
+  if (!pool) return NULL;
+
+  pool->threads = threads < 1 ? 1 : threads;
+  pool->handles = malloc(sizeof(pthread_t) * pool->threads);
+  pool->deques = aligned_alloc(64, sizeof(PoolDeque) * pool->threads);
+  pool->generation = 0;
+  pool->busy = 0;
+  pool->shutdown = 0;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+
+  pool->scratch = malloc(sizeof(Arena*) * pool->threads);
+  for (int i = 0; i < pool->threads; i++) {
+    atomic_init(&pool->deques[i].range, 0);
+    pool->scratch[i] = arena_create(0);
+  }
+
+  for (int i = 1; i < pool->threads; i++) {
+    void** arg = malloc(2 * sizeof(void*));
+    arg[0] = pool;
+    arg[1] = (void*)(intptr_t)i;
+    if (pthread_create(&pool->handles[i], NULL, worker_main, arg) != 0) {
+      fprintf(stderr, "Error: could only start %d threads\n", i);
+      free(arg);
+      for (int j = i; j < pool->threads; j++) arena_free(pool->scratch[j]);
+      pool->threads = i;
+      break;
+    }
+  }
+
+  return pool;
+}
+
+void pool_free(Pool* pool) {
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 1; i < pool->threads; i++) pthread_join(pool->handles[i], NULL);
+  for (int i = 0; i < pool->threads; i++) arena_free(pool->scratch[i]);
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->idle);
+  free(pool->handles);
+  free(pool->deques);
+  free(pool->scratch);
+  free(pool);
+}
+
+int pool_threads(const Pool* pool) {
+  return pool ? pool->threads : 1;
+}
+
+// Scratch arena of `worker`, only ever used by that worker's thread.
+// Tasks take a mark on entry and rewind to it before returning, so the
+// arena stays at the size of the largest task. NULL without a pool: the
+// arena functions then fall back on the heap.
+Arena* pool_scratch(const Pool* pool, int worker) {
+  return pool ? pool->scratch[worker] : NULL;
+}
+
+// Call task(ctx, i, worker) for every i in [0, count) and return once all
+// calls are done. A NULL pool runs the loop on the calling thread.
+// Tasks must write disjoint outputs; the result then does not depend on
+// the number of threads or on the order in which indices are run.
+void pool_run(Pool* pool, int count, PoolTask task, void* ctx) {
+  if (count <= 0) return;
+
+  if (!pool || pool->threads == 1 || count == 1) {
+    for (int i = 0; i < count; i++) task(ctx, i, 0);
+    return;
+  }
+
+  pool->task = task;
+  pool->ctx = ctx;
+  for (int i = 0; i < pool->threads; i++) {
+    uint32_t lo = (uint64_t)count * i / pool->threads;
+    uint32_t hi = (uint64_t)count * (i + 1) / pool->threads;
+    atomic_store(&pool->deques[i].range, pack(lo, hi));
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->busy = pool->threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  run_share(pool, 0);
+
+  // Workers only go idle once every range is empty, and stolen indices
+  // are run by the thief before it goes idle
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) pthread_cond_wait(&pool->idle, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
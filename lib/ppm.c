@@ -1,4 +1,10 @@
 #include "ppm.h"
+#include "convolve.h"
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Image* ppm_create(int width, int height) {
   Image* im = malloc(sizeof(Image));
@@ -19,50 +25,185 @@ void ppm_free(Image* im) {
   free(im);
 }
 
-Image* ppm_open(char* filename) {
-    FILE* f = fopen(filename, "rb");
-    if (!f) {
-        perror("Error opening file");
-        return NULL;
+// Skip whitespace and '#' comments, then read one decimal token.
+// Returns the position just after the token, or 0 on failure.
+static size_t header_int(const unsigned char* buf, size_t len, size_t pos, int* value) {
+  while (pos < len) {
+    if (buf[pos] == '#') {
+      while (pos < len && buf[pos] != '\n') pos++;
+    } else if (buf[pos] == ' ' || buf[pos] == '\t' || buf[pos] == '\n' || buf[pos] == '\r') {
+      pos++;
+    } else {
+      break;
     }
+  }
 
-    char buff[16];
-    if (fgets(buff, sizeof(buff), f) == NULL || (buff[0] != 'P' || buff[1] != '6')) {
-        fprintf(stderr, "Invalid PPM file format\n");
-        fclose(f);
-        return NULL;
-    }
+  long v = 0;
+  size_t start = pos;
+  while (pos < len && buf[pos] >= '0' && buf[pos] <= '9') {
+    v = v * 10 + (buf[pos] - '0');
+    if (v > 1 << 30) return 0;
+    pos++;
+  }
+  if (pos == start) return 0;
 
-    int width, height, maxval;
-    if (fscanf(f, "%d %d", &width, &height) != 2) {
-        fprintf(stderr, "Error reading image dimensions\n");
-        fclose(f);
-        return NULL;
-    }
+  *value = (int)v;
+  return pos;
+}
 
-    if (fscanf(f, "%d", &maxval) != 1 || maxval != 255) {
-        fprintf(stderr, "Unsupported maxval or error reading maxval\n");
-        fclose(f);
-        return NULL;
+// Parse a P5/P6 header held in buf[0..len).
+// Returns 0 on success, 1 if more bytes are needed, -1 if the file is invalid.
+static int parse_header(const unsigned char* buf, size_t len, PpmHeader* h) {
+  if (len < 2) return 1;
+  if (buf[0] != 'P' || (buf[1] != '5' && buf[1] != '6')) return -1;
+  h->channels = buf[1] == '6' ? 3 : 1;
+
+  size_t pos = 2;
+  if (!(pos = header_int(buf, len, pos, &h->width))) return 1;
+  if (!(pos = header_int(buf, len, pos, &h->height))) return 1;
+  if (!(pos = header_int(buf, len, pos, &h->maxval))) return 1;
+  // A single whitespace character separates maxval from the payload
+  if (pos >= len) return 1;
+
+  if (h->width <= 0 || h->height <= 0 || h->maxval <= 0 || h->maxval > 65535) return -1;
+  h->sample_size = h->maxval > 255 ? 2 : 1;
+  h->offset = pos + 1;
+  return 0;
+}
+
+// Fill `header` from the start of the file without reading pixel data.
+// Returns 0 on success, -1 on error.
+int ppm_probe(const char* filename, PpmHeader* header) {
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  // Headers are tiny unless they carry long comments; grow the buffer
+  // until the parser is satisfied.
+  size_t cap = 512, len = 0;
+  unsigned char* buf = malloc(cap);
+  int status = 1;
+  while (status == 1 && buf) {
+    size_t n = fread(buf + len, 1, cap - len, f);
+    len += n;
+    status = parse_header(buf, len, header);
+    if (status == 1 && n == 0) status = -1; // truncated header
+    if (status == 1 && len == cap) {
+      if (cap >= (1 << 20)) {
+        status = -1;
+      } else {
+        cap *= 2;
+        unsigned char* tmp = realloc(buf, cap);
+        if (!tmp) status = -1;
+        else buf = tmp;
+      }
     }
-    fgetc(f); // Consommer le saut de ligne après maxval
+  }
+
+  free(buf);
+  fclose(f);
+  if (status != 0) {
+    fprintf(stderr, "Invalid PPM file format\n");
+    return -1;
+  }
+  return 0;
+}
+
+PpmMap* ppm_map(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("Error opening file");
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "Error reading file size\n");
+    close(fd);
+    return NULL;
+  }
+
+  // Private writable mapping: pages are copy-on-write, so the borrowed
+  // plane may be modified without touching the file.
+  size_t length = st.st_size;
+  void* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("Error mapping file");
+    return NULL;
+  }
+  madvise(base, length, MADV_SEQUENTIAL);
+
+  PpmHeader h;
+  if (parse_header(base, length, &h) != 0) {
+    fprintf(stderr, "Invalid PPM file format\n");
+    munmap(base, length);
+    return NULL;
+  }
+
+  size_t row_bytes = (size_t)h.width * h.channels * h.sample_size;
+  if (h.offset + row_bytes * h.height > length) {
+    fprintf(stderr, "Truncated PPM pixel data\n");
+    munmap(base, length);
+    return NULL;
+  }
+
+  PpmMap* map = malloc(sizeof(PpmMap));
+  if (!map) {
+    munmap(base, length);
+    return NULL;
+  }
+
+  map->header = h;
+  map->base = base;
+  map->length = length;
+  map->raw.width = row_bytes;
+  map->raw.height = h.height;
+  map->raw.stride = row_bytes;
+  map->raw.owned = PLANE_BORROWED;
+  map->raw.data = (uint8_t*)base + h.offset;
+
+  return map;
+}
+
+void ppm_unmap(PpmMap* map) {
+  if (!map) return;
+  munmap(map->base, map->length);
+  free(map);
+}
 
-    Image* im = ppm_create(width, height);
+Image* ppm_open(char* filename) {
+    PpmMap* map = ppm_map(filename);
+    if (!map) return NULL;
+
+    PpmHeader* h = &map->header;
+    Image* im = ppm_create(h->width, h->height);
     if (!im) {
         fprintf(stderr, "Error creating image\n");
-        fclose(f);
+        ppm_unmap(map);
         return NULL;
     }
 
     for (int j = 0; j < im->height; j++) {
+        const uint8_t* src = plane8_row(&map->raw, j);
         for (int i = 0; i < im->width; i++) {
-            fread(&(im->p[j][i].r), 1, 1, f);
-            fread(&(im->p[j][i].g), 1, 1, f);
-            fread(&(im->p[j][i].b), 1, 1, f);
+            int v[3];
+            for (int c = 0; c < h->channels; c++) {
+                int s = h->sample_size == 2 ? (src[0] << 8 | src[1]) : src[0];
+                if (s > h->maxval) s = h->maxval;  // as ppm_decode_grey
+                v[c] = h->maxval == 255 ? s : s * 255 / h->maxval;
+                src += h->sample_size;
+            }
+            // Greyscale (P5) samples are replicated on the three channels
+            im->p[j][i].r = v[0];
+            im->p[j][i].g = v[h->channels == 3 ? 1 : 0];
+            im->p[j][i].b = v[h->channels == 3 ? 2 : 0];
         }
     }
 
-    fclose(f);
+    ppm_unmap(map);
     return im;
 }
 
@@ -88,9 +229,29 @@ int ppm_save(Image* im, char* filename) {
     return 0; // Success
 }
 
-Image* ppm_convolution(Image* im, int* kernel, int size) {
-    int min(int a, int b) { return a < b ? a : b;}
+// Write a greyscale plane as a binary PGM (P5) file
+int pgm_save(const Plane8* im, const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    fprintf(f, "P5\n%d %d\n255\n", im->width, im->height);
+    for (int j = 0; j < im->height; j++) {
+        fwrite(plane8_row(im, j), 1, im->width, f);
+    }
+
+    fclose(f);
+    return 0;
+}
 
+// Pointer to channel c (0: r, 1: g, 2: b) of a pixel
+static int* pixel_channel(Pixel* p, int c) {
+  return c == 0 ? &p->r : c == 1 ? &p->g : &p->b;
+}
+
+Image* ppm_convolution(Image* im, int* kernel, int size) {
     if (!im || !kernel || size <= 0 || size > im->width || size > im->height) {
         return NULL; // Invalid inputs
     }
@@ -99,42 +260,104 @@ Image* ppm_convolution(Image* im, int* kernel, int size) {
     int new_height = im->height - size + 1;
 
     Image* result = ppm_create(new_width, new_height);
+    Kernel* k = kernel_from_int(kernel, size);
+    PlaneF* channel = planef_create(im->width, im->height);
 
-    for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-            int sum_r = 0, sum_g = 0, sum_b = 0;
-
-            for (int j = 0; j < size; j++) {
-                for (int i = 0; i < size; i++) {
-                    int img_x = x + i;
-                    int img_y = y + j;
+    // Each channel goes through the convolution engine as its own plane
+    for (int c = 0; c < 3; c++) {
+        for (int y = 0; y < im->height; y++) {
+            float* row = planef_row(channel, y);
+            for (int x = 0; x < im->width; x++) row[x] = *pixel_channel(&im->p[y][x], c);
+        }
 
-                    sum_r += kernel[j * size + i] * im->p[img_y][img_x].r;
-                    sum_g += kernel[j * size + i] * im->p[img_y][img_x].g;
-                    sum_b += kernel[j * size + i] * im->p[img_y][img_x].b;
-                }
+        PlaneF* out = convolve(channel, k, BORDER_VALID, NULL, NULL);
+        for (int y = 0; y < new_height; y++) {
+            const float* row = planef_row(out, y);
+            for (int x = 0; x < new_width; x++) {
+                int v = lrintf(row[x]);
+                *pixel_channel(&result->p[y][x], c) = v < 0 ? 0 : v > 255 ? 255 : v;
             }
-
-            result->p[y][x].r = sum_r < 0 ? 0 : min(sum_r, 255);
-            result->p[y][x].g = sum_g < 0 ? 0 : min(sum_g, 255);
-            result->p[y][x].b = sum_b < 0 ? 0 : min(sum_b, 255);
         }
+        planef_free(out);
     }
 
+    planef_free(channel);
+    kernel_free(k);
     return result;
 }
 
-Image* grey_scale(Image* im) {
-  Image* res = ppm_create(im -> width, im -> height);
+// Fixed-point luminance, exact for 8-bit inputs: (s * 21846) >> 16 equals
+// s / 3 for every s <= 765, and the BT.601 weights add up to 256.
+static inline uint8_t luma(int r, int g, int b, GreyWeights weights) {
+  if (weights == GREY_BT601) return (77 * r + 150 * g + 29 * b + 128) >> 8;
+  return ((r + g + b) * 21846) >> 16;
+}
+
+Plane8* grey_scale(Image* im) {
+  Plane8* res = plane8_create(im -> width, im -> height);
 
   for (int j = 0; j < (im -> height); j++) {
+    uint8_t* row = plane8_row(res, j);
     for (int i = 0; i < (im -> width); i++) {
-      int mean = ((im -> p)[j][i].r + (im -> p)[j][i].g + (im -> p)[j][i].b) / 3;
-      (res -> p)[j][i].r = mean;
-      (res -> p)[j][i].g = mean;
-      (res -> p)[j][i].b = mean;
+      row[i] = luma((im -> p)[j][i].r, (im -> p)[j][i].g, (im -> p)[j][i].b, GREY_MEAN);
     }
   }
 
   return res;
 }
+
+// Convert the payload of a mapped P6/P5 file to greyscale into `dst`,
+// which must have the image size (e.g. a buffer reused between images).
+// Rows are converted one at a time, so the RGB image is never built.
+void ppm_decode_grey(const PpmMap* map, GreyWeights weights, Plane8* dst) {
+  const PpmHeader* h = &map->header;
+
+  // Samples that are not already 0-255 go through a rescaling table
+  uint8_t* lut = NULL;
+  if (h->maxval != 255) {
+    lut = malloc(h->maxval + 1);
+    for (int v = 0; v <= h->maxval; v++) lut[v] = v * 255 / h->maxval;
+  }
+
+  for (int j = 0; j < h->height; j++) {
+    const uint8_t* src = plane8_row(&map->raw, j);
+    uint8_t* out = plane8_row(dst, j);
+
+    if (!lut && h->channels == 1) {
+      memcpy(out, src, h->width);
+    } else if (!lut) {
+      for (int i = 0; i < h->width; i++, src += 3) {
+        out[i] = luma(src[0], src[1], src[2], weights);
+      }
+    } else {
+      for (int i = 0; i < h->width; i++) {
+        int v[3];
+        for (int c = 0; c < h->channels; c++) {
+          int s = h->sample_size == 2 ? (src[0] << 8 | src[1]) : src[0];
+          v[c] = lut[s > h->maxval ? h->maxval : s];
+          src += h->sample_size;
+        }
+        out[i] = h->channels == 3 ? luma(v[0], v[1], v[2], weights) : v[0];
+      }
+    }
+  }
+
+  free(lut);
+}
+
+// Decode a P6/P5 file straight to a greyscale plane
+Plane8* ppm_open_grey(const char* filename, GreyWeights weights) {
+  PpmMap* map = ppm_map(filename);
+  if (!map) return NULL;
+
+  Plane8* res = plane8_create(map->header.width, map->header.height);
+  if (!res) {
+    fprintf(stderr, "Error creating image\n");
+    ppm_unmap(map);
+    return NULL;
+  }
+
+  ppm_decode_grey(map, weights, res);
+  ppm_unmap(map);
+  return res;
+}
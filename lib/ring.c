@@ -0,0 +1,95 @@
+#include "ring.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Capacity is rounded up to a power of two, at least 2
+Ring* ring_create(size_t capacity) {
+  size_t n = 2;
+  while (n < capacity) n *= 2;
+
+  Ring* r = aligned_alloc(64, sizeof(Ring));
+  r->mask = n - 1;
+  r->slots = malloc(sizeof(RingSlot) * n);
+  for (size_t i = 0; i < n; i++) atomic_init(&r->slots[i].sequence, i);
+  atomic_init(&r->tail, 0);
+  atomic_init(&r->head, 0);
+  return r;
+}
+
+void ring_free(Ring* r) {
+  if (!r) return;
+  free(r->slots);
+  free(r);
+}
+
+// Returns 0, or -1 when the ring is full
+int ring_try_push(Ring* r, void* item) {
+  size_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  for (;;) {
+    RingSlot* slot = &r->slots[pos & r->mask];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    ptrdiff_t dif = (ptrdiff_t)(seq - pos);
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        slot->item = item;
+        atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+        return 0;
+      }
+    } else if (dif < 0) {
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    }
+  }
+}
+
+// Returns 0 and the oldest item, or -1 when the ring is empty
+int ring_try_pop(Ring* r, void** item) {
+  size_t pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+  for (;;) {
+    RingSlot* slot = &r->slots[pos & r->mask];
+    size_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+    ptrdiff_t dif = (ptrdiff_t)(seq - (pos + 1));
+    if (dif == 0) {
+      if (atomic_compare_exchange_weak_explicit(&r->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        *item = slot->item;
+        atomic_store_explicit(&slot->sequence, pos + r->mask + 1, memory_order_release);
+        return 0;
+      }
+    } else if (dif < 0) {
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&r->head, memory_order_relaxed);
+    }
+  }
+}
+
+// Wait for the other side: spin briefly (it is usually a few hundred
+// cycles away), then give the core away, then sleep so that a stage
+// waiting on a slow disk does not take CPU time from the others
+static void backoff(int* round) {
+  int n = (*round)++;
+  if (n < 64) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else if (n < 128) {
+    sched_yield();
+  } else {
+    struct timespec ts = { 0, 50000 };
+    nanosleep(&ts, NULL);
+  }
+}
+
+void ring_push(Ring* r, void* item) {
+  int round = 0;
+  while (ring_try_push(r, item) != 0) backoff(&round);
+}
+
+void* ring_pop(Ring* r) {
+  void* item;
+  int round = 0;
+  while (ring_try_pop(r, &item) != 0) backoff(&round);
+  return item;
+}
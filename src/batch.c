@@ -0,0 +1,411 @@
+#include "batch.h"
+#include "ring.h"
+#include "skeleton.h"
+#include "template.h"
+#include <dirent.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define BATCH_PATH_MAX 4096
+
+// Capacity of each of the rings between the stages: how far the reader
+// may run ahead of the compute workers, and they ahead of the writer
+#define BATCH_QUEUE 8
+
+// What a worker keeps from one image to the next: the arena every
+// allocation of an image goes to, reset after each image, and a pool of
+// one thread (no helper threads) providing the stages' scratch arena
+typedef struct batch_worker {
+  Arena* arena;
+  Pool* serial;
+} BatchWorker;
+
+// One image on its way through the stages. The reader fills the image,
+// a compute worker the outputs, the writer saves and frees them. Buffers
+// that cross a stage are on the heap: the worker arenas are reset as soon
+// as the image leaves them.
+typedef struct batch_item {
+  int index;
+  int status;          // < 0 once a stage failed
+  Plane8* image;
+  Fingerprint* fp;
+  Plane8* enhanced;
+  Plane8* skeleton;
+  void* template;
+  size_t size;
+  double seconds;      // read + compute + write, queues excluded
+} BatchItem;
+
+typedef struct batch_job {
+  const Pipeline* pl;
+  char* const* inputs;
+  int count;
+  const char* out_dir;
+  int threads;
+  BatchWorker* workers;
+  Ring* decoded;       // reader -> compute workers
+  Ring* computed;      // compute workers -> writer
+  double* seconds;     // per image, < 0 when it failed
+  int* pixels;
+  double read;         // time each stage spent working
+  double* compute;     // per worker
+  double* starved;     // per worker, waiting for the reader
+  double write;
+} BatchJob;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static int is_pnm(const char* name) {
+  const char* dot = strrchr(name, '.');
+  return dot && (strcmp(dot, ".ppm") == 0 || strcmp(dot, ".pgm") == 0 || strcmp(dot, ".pnm") == 0);
+}
+
+static int is_template(const char* name) {
+  const char* dot = strrchr(name, '.');
+  return dot && strcmp(dot, ".fpt") == 0;
+}
+
+static int compare_path(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+static void push_input(char*** inputs, int* count, int* size, char* path) {
+  if (*count == *size) {
+    *size = *size ? 2 * *size : 64;
+    *inputs = realloc(*inputs, sizeof(char*) * *size);
+  }
+  (*inputs)[(*count)++] = path;
+}
+
+// The files of a directory that `accept` (sorted by name), or the paths
+// listed one per line in a manifest file (blank lines and lines starting
+// with '#' are skipped). Returns NULL on error.
+static char** list_files(const char* path, int (*accept)(const char*), int* count) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return NULL;
+  }
+
+  char** inputs = NULL;
+  int size = 0;
+  *count = 0;
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR* dir = opendir(path);
+    if (!dir) {
+      perror(path);
+      return NULL;
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir))) {
+      if (!accept(entry->d_name)) continue;
+      char* file = malloc(strlen(path) + strlen(entry->d_name) + 2);
+      sprintf(file, "%s/%s", path, entry->d_name);
+      push_input(&inputs, count, &size, file);
+    }
+    closedir(dir);
+    if (*count > 0) qsort(inputs, *count, sizeof(char*), compare_path);
+  } else {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+      perror(path);
+      return NULL;
+    }
+    char* line = NULL;
+    size_t n = 0;
+    while (getline(&line, &n, f) != -1) {
+      size_t len = strcspn(line, "\r\n");
+      line[len] = '\0';
+      if (len == 0 || line[0] == '#') continue;
+      push_input(&inputs, count, &size, strdup(line));
+    }
+    free(line);
+    fclose(f);
+  }
+
+  if (!inputs) inputs = malloc(sizeof(char*));
+  return inputs;
+}
+
+// Images to enroll: the PNM files of a directory, or a manifest
+char** batch_inputs(const char* path, int* count) {
+  return list_files(path, is_pnm, count);
+}
+
+// Templates of a gallery: the .fpt files of a directory, or a manifest
+char** batch_templates(const char* path, int* count) {
+  return list_files(path, is_template, count);
+}
+
+void batch_inputs_free(char** inputs, int count) {
+  if (!inputs) return;
+  for (int i = 0; i < count; i++) free(inputs[i]);
+  free(inputs);
+}
+
+// "<out_dir>/<name without directory and extension><suffix>"
+static void output_path(char* dst, const char* out_dir, const char* input, const char* suffix) {
+  const char* name = strrchr(input, '/');
+  name = name ? name + 1 : input;
+  const char* dot = strrchr(name, '.');
+  int len = dot ? (int)(dot - name) : (int)strlen(name);
+  snprintf(dst, BATCH_PATH_MAX, "%s/%.*s%s", out_dir, len, name, suffix);
+}
+
+// Heap copy of a fingerprint of the worker arena
+static Fingerprint* copy_fingerprint(const Fingerprint* fp) {
+  Fingerprint* res = create_fingerprint(fp->width, fp->height);
+  for (int j = 0; j < fp->height; j++) memcpy(res->ridges[j], fp->ridges[j], sizeof(Ridge) * fp->width);
+  return res;
+}
+
+// Stage 1: map and decode the inputs in order, ahead of the compute
+// workers by up to the capacity of the ring, then one end marker (NULL)
+// per compute worker
+static void* batch_reader(void* arg) {
+  BatchJob* job = arg;
+  for (int i = 0; i < job->count; i++) {
+    double start = now();
+    BatchItem* item = calloc(1, sizeof(BatchItem));
+    item->index = i;
+    item->status = -1;
+    job->pixels[i] = 0;
+
+    PpmMap* map = ppm_map(job->inputs[i]);
+    if (map) {
+      item->image = plane8_create(map->header.width, map->header.height);
+      if (item->image) {
+        ppm_decode_grey(map, GREY_MEAN, item->image);
+        job->pixels[i] = item->image->width * item->image->height;
+        item->status = 0;
+      }
+      ppm_unmap(map);
+    }
+    item->seconds = now() - start;
+    job->read += item->seconds;
+    ring_push(job->decoded, item);
+  }
+  for (int i = 0; i < job->threads; i++) ring_push(job->decoded, NULL);
+  return NULL;
+}
+
+// Outputs of one image, from the worker arena to the heap
+static int enroll_one(const BatchJob* job, BatchWorker* w, BatchItem* item) {
+  Enrollment res;
+  if (pipeline_run(job->pl, item->image, w->serial, w->arena, &res) != 0) return -1;
+
+  if (job->out_dir) {
+    item->fp = copy_fingerprint(res.fp);
+    item->enhanced = planef_to_8_in(NULL, res.enhanced);
+    item->skeleton = skeleton_to_plane8(res.skeleton, NULL);
+    item->template = template_build(&res, 1, &item->size, NULL);
+  }
+
+  enrollment_free(&res);
+  return 0;
+}
+
+// Stage 2, one loop per worker of the pool: enroll decoded images until
+// an end marker, then pass it on to the writer. Nothing here touches the
+// disk, so the workers only wait when the reader falls behind.
+static void batch_compute(void* ctx, int index, int worker) {
+  BatchJob* job = ctx;
+  BatchWorker* w = &job->workers[worker];
+  (void)index;
+
+  for (;;) {
+    double wait = now();
+    BatchItem* item = ring_pop(job->decoded);
+    double start = now();
+    job->starved[worker] += start - wait;
+    if (!item) break;
+
+    if (item->status == 0) {
+      item->status = enroll_one(job, w, item);
+      arena_reset(w->arena);
+    }
+    plane8_free(item->image);
+    item->image = NULL;
+
+    double elapsed = now() - start;
+    item->seconds += elapsed;
+    job->compute[worker] += elapsed;
+    ring_push(job->computed, item);
+  }
+  ring_push(job->computed, NULL);
+}
+
+static int write_one(const BatchJob* job, const BatchItem* item) {
+  const char* input = job->inputs[item->index];
+  char path[BATCH_PATH_MAX];
+  output_path(path, job->out_dir, input, ".svg");
+  int status = draw_svg(item->fp, path);
+
+  output_path(path, job->out_dir, input, "_enhanced.pgm");
+  if (status == 0) status = pgm_save(item->enhanced, path);
+
+  output_path(path, job->out_dir, input, "_skeleton.pgm");
+  if (status == 0) status = pgm_save(item->skeleton, path);
+
+  output_path(path, job->out_dir, input, ".fpt");
+  if (status == 0) status = template_save(item->template, item->size, path);
+  return status;
+}
+
+// Stage 3: save the outputs of the images in the order they are done,
+// until every compute worker has sent its end marker
+static void* batch_writer(void* arg) {
+  BatchJob* job = arg;
+  int running = job->threads;
+  while (running > 0) {
+    BatchItem* item = ring_pop(job->computed);
+    if (!item) {
+      running--;
+      continue;
+    }
+
+    double start = now();
+    const char* input = job->inputs[item->index];
+    if (item->status == 0 && job->out_dir) item->status = write_one(job, item);
+    if (item->fp) free_fingerprint(item->fp);
+    plane8_free(item->enhanced);
+    plane8_free(item->skeleton);
+    free(item->template);
+    double elapsed = now() - start;
+    job->write += elapsed;
+    item->seconds += elapsed;
+
+    job->seconds[item->index] = item->status == 0 ? item->seconds : -1;
+    if (item->status == 0) {
+      printf("%s: %d pixels in %.2f ms\n", input, job->pixels[item->index], item->seconds * 1E3);
+    } else {
+      fprintf(stderr, "%s: enrollment failed\n", input);
+    }
+    free(item);
+  }
+  return NULL;
+}
+
+// Enroll every input through three stages connected by lock-free rings:
+// a reader thread maps and decodes the images, the workers of `pool`
+// enroll them, and a writer thread saves the outputs (to out_dir, when it
+// is not NULL). Disk reads and writes thus overlap the enrollment of
+// other images, and the rings bound the images in memory to about
+// 2 * BATCH_QUEUE + pool_threads(). Each worker reuses its own arenas for
+// all its images, so after the first few images enrollment no longer
+// allocates; the pipeline (kernels, filter bank) is shared.
+// Returns the number of failed images, or -1 if out_dir is not a
+// directory or the stages could not be started (every image then counts
+// as failed).
+int batch_run(const Pipeline* pl, char* const* inputs, int count, const char* out_dir, Pool* pool, BatchStats* stats) {
+  memset(stats, 0, sizeof(BatchStats));
+  stats->images = count;
+
+  struct stat st;
+  if (out_dir && stat(out_dir, &st) != 0) {
+    perror(out_dir);
+    stats->failed = count;
+    return -1;
+  }
+  if (out_dir && !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "%s: Not a directory\n", out_dir);
+    stats->failed = count;
+    return -1;
+  }
+
+  int threads = pool_threads(pool);
+  BatchJob job = { 0 };
+  job.pl = pl;
+  job.inputs = inputs;
+  job.count = count;
+  job.out_dir = out_dir;
+  job.threads = threads;
+  job.workers = malloc(sizeof(BatchWorker) * threads);
+  for (int i = 0; i < threads; i++) {
+    job.workers[i].arena = arena_create(0);
+    job.workers[i].serial = pool_create(1);
+  }
+  job.decoded = ring_create(BATCH_QUEUE);
+  job.computed = ring_create(BATCH_QUEUE);
+  job.seconds = malloc(sizeof(double) * (count > 0 ? count : 1));
+  job.pixels = malloc(sizeof(int) * (count > 0 ? count : 1));
+  job.compute = calloc(threads, sizeof(double));
+  job.starved = calloc(threads, sizeof(double));
+
+  // The writer starts first: if the reader cannot, the end markers of the
+  // compute stage are all the writer needs to stop
+  double start = now();
+  pthread_t reader, writer;
+  int status = 0;
+  int err = pthread_create(&writer, NULL, batch_writer, &job);
+  if (err == 0) {
+    err = pthread_create(&reader, NULL, batch_reader, &job);
+    if (err == 0) {
+      pool_run(pool, threads, batch_compute, &job);
+      pthread_join(reader, NULL);
+    } else {
+      for (int i = 0; i < threads; i++) ring_push(job.computed, NULL);
+    }
+    pthread_join(writer, NULL);
+  }
+  if (err != 0) {
+    fprintf(stderr, "Error starting batch stages: %s\n", strerror(err));
+    for (int i = 0; i < count; i++) job.seconds[i] = -1;
+    status = -1;
+  }
+
+  stats->failed = 0;
+  stats->pixels = 0;
+  stats->seconds = now() - start;
+  stats->busy = 0;
+  stats->max_latency = 0;
+  stats->read = job.read;
+  stats->compute = 0;
+  stats->starved = 0;
+  stats->write = job.write;
+  for (int i = 0; i < threads; i++) {
+    stats->compute += job.compute[i];
+    stats->starved += job.starved[i];
+  }
+  for (int i = 0; i < count; i++) {
+    if (job.seconds[i] < 0) {
+      stats->failed++;
+      continue;
+    }
+    stats->pixels += job.pixels[i];
+    stats->busy += job.seconds[i];
+    if (job.seconds[i] > stats->max_latency) stats->max_latency = job.seconds[i];
+  }
+
+  for (int i = 0; i < threads; i++) {
+    arena_free(job.workers[i].arena);
+    pool_free(job.workers[i].serial);
+  }
+  ring_free(job.decoded);
+  ring_free(job.computed);
+  free(job.workers);
+  free(job.seconds);
+  free(job.pixels);
+  free(job.compute);
+  free(job.starved);
+  return status < 0 ? status : stats->failed;
+}
+
+void batch_print_stats(const BatchStats* stats, int threads) {
+  int done = stats->images - stats->failed;
+  double seconds = stats->seconds > 0 ? stats->seconds : 1E-9;
+
+  printf("Enrolled %d/%d images in %.3f s on %d threads\n", done, stats->images, stats->seconds, threads);
+  printf("  throughput: %.1f images/s, %.2f Mpixel/s\n", done / seconds, stats->pixels / seconds * 1E-6);
+  printf("  stages: read %.3f s, compute %.3f s, write %.3f s, compute starved %.3f s\n",
+         stats->read, stats->compute, stats->write, stats->starved);
+  if (done > 0) {
+    printf("  latency: mean %.2f ms, max %.2f ms\n", stats->busy / done * 1E3, stats->max_latency * 1E3);
+  }
+}
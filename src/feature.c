@@ -0,0 +1,131 @@
+#include "feature.h"
+#include <math.h>
+#include <string.h>
+
+// Reference point of the fixed-length vectors: the largest core, or the
+// centroid of the foreground without one
+static void reference_point(const Enrollment* res, float* x, float* y) {
+  const Singularities* s = res->singular;
+  int core = -1;
+  for (int k = 0; k < s->count; k++) {
+    if (s->points[k].type != SINGULAR_CORE) continue;
+    if (core < 0 || s->points[k].cells > s->points[core].cells) core = k;
+  }
+  if (core >= 0) {
+    *x = s->points[core].x;
+    *y = s->points[core].y;
+    return;
+  }
+
+  const Fingerprint* fp = res->fp;
+  double sx = 0, sy = 0;
+  int n = 0;
+  for (int j = 0; j < fp->height; j++) {
+    for (int i = 0; i < fp->width; i++) {
+      if (!mask_get(res->mask, i, j)) continue;
+      sx += i;
+      sy += j;
+      n++;
+    }
+  }
+  *x = n > 0 ? (sx / n) * res->grid + res->grid / 2.0f : fp->width * res->grid / 2.0f;
+  *y = n > 0 ? (sy / n) * res->grid + res->grid / 2.0f : fp->height * res->grid / 2.0f;
+}
+
+// Foreground area of the enrollment in units of 10^3 pixels
+static float foreground_area(const Enrollment* res) {
+  const Fingerprint* fp = res->fp;
+  int cells = 0;
+  for (int j = 0; j < fp->height; j++) {
+    for (int i = 0; i < fp->width; i++) cells += mask_get(res->mask, i, j);
+  }
+  return cells * (float)res->grid * res->grid * 1E-3f;
+}
+
+// Full fixed-length vector of an enrollment, FEATURE_DIM floats (see
+// feature.h). Cells and minutiae are placed relative to the reference
+// point, so the vector does not depend on where the finger lies in the
+// image; it does depend on its rotation.
+void feature_extract(const Enrollment* res, float* out) {
+  const Fingerprint* fp = res->fp;
+  float cx, cy;
+  reference_point(res, &cx, &cy);
+  memset(out, 0, sizeof(float) * FEATURE_DIM);
+
+  // Orientation: mean doubled-angle vector of the ridges in each cell
+  float* orientation = out;
+  int count[FEATURE_GRID * FEATURE_GRID] = { 0 };
+  float origin = FEATURE_GRID * FEATURE_CELL / 2.0f;
+  for (int j = 0; j < fp->height; j++) {
+    for (int i = 0; i < fp->width; i++) {
+      if (!mask_get(res->mask, i, j)) continue;
+      float x = i * res->grid + res->grid / 2.0f - cx + origin;
+      float y = j * res->grid + res->grid / 2.0f - cy + origin;
+      if (x < 0 || y < 0) continue;
+      int u = (int)(x / FEATURE_CELL), v = (int)(y / FEATURE_CELL);
+      if (u >= FEATURE_GRID || v >= FEATURE_GRID) continue;
+
+      const Ridge* ridge = &(fp->ridges)[j][i];
+      int c = v * FEATURE_GRID + u;
+      orientation[2 * c] += ridge->coherence * cosf(2 * ridge->angle);
+      orientation[2 * c + 1] += ridge->coherence * sinf(2 * ridge->angle);
+      count[c]++;
+    }
+  }
+  for (int c = 0; c < FEATURE_GRID * FEATURE_GRID; c++) {
+    if (count[c] == 0) continue;
+    orientation[2 * c] /= count[c];
+    orientation[2 * c + 1] /= count[c];
+  }
+
+  // Minutiae
+  const Minutiae* m = res->minutiae;
+  float* density = out + 2 * FEATURE_GRID * FEATURE_GRID;
+  float* directions = density + 2;
+  float* rings = directions + FEATURE_DIRECTIONS;
+  float area = foreground_area(res);
+  for (int k = 0; k < m->count; k++) {
+    const Minutia* p = &m->points[k];
+    density[p->type == MINUTIA_ENDING ? 0 : 1] += 1;
+
+    int d = (int)(p->angle / (2 * PI) * FEATURE_DIRECTIONS);
+    directions[d < FEATURE_DIRECTIONS ? d : FEATURE_DIRECTIONS - 1] += 1;
+
+    float r = sqrtf((p->x - cx) * (p->x - cx) + (p->y - cy) * (p->y - cy));
+    int ring = (int)(r / FEATURE_RING);
+    rings[ring < FEATURE_RINGS ? ring : FEATURE_RINGS - 1] += 1;
+  }
+  if (area > 0) {
+    density[0] /= area;
+    density[1] /= area;
+  }
+  if (m->count > 0) {
+    for (int k = 0; k < FEATURE_DIRECTIONS; k++) directions[k] /= m->count;
+    for (int k = 0; k < FEATURE_RINGS; k++) rings[k] /= m->count;
+  }
+}
+
+// Compact vector of an enrollment, FEATURE_COMPACT_DIM floats
+void feature_compact(const Enrollment* res, float* out) {
+  const Fingerprint* fp = res->fp;
+  const Minutiae* m = res->minutiae;
+  float area = foreground_area(res);
+  int endings = 0;
+  for (int k = 0; k < m->count; k++) endings += m->points[k].type == MINUTIA_ENDING;
+
+  double period = 0;
+  int known = 0;
+  for (int c = 0; c < fp->width * fp->height; c++) {
+    if (res->frequency[c] <= 0 || !mask_get(res->mask, c % fp->width, c / fp->width)) continue;
+    period += 1 / res->frequency[c];
+    known++;
+  }
+
+  int cores = 0;
+  for (int k = 0; k < res->singular->count; k++) cores += res->singular->points[k].type == SINGULAR_CORE;
+
+  out[0] = area > 0 ? endings / area : 0;
+  out[1] = area > 0 ? (m->count - endings) / area : 0;
+  out[2] = known > 0 ? period / known / 10 : 0;
+  out[3] = (cores < 2 ? cores : 2) / 2.0f;
+}
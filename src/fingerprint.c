@@ -0,0 +1,426 @@
+#include "fingerprint.h"
+#include "csvg.h"
+#include "orientation.h"
+#include "frequency.h"
+#include "segment.h"
+#include "skeleton.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#define EPSILON 1E-6
+
+Fingerprint* create_fingerprint(int width, int height) {
+  return create_fingerprint_in(NULL, width, height);
+}
+
+// In an arena the rows share one block and are released with the arena
+// (do not pass the result to free_fingerprint)
+Fingerprint* create_fingerprint_in(Arena* arena, int width, int height) {
+  if (arena) {
+    Fingerprint* res = arena_alloc(arena, sizeof(Fingerprint));
+    Ridge* rows = arena_alloc(arena, sizeof(Ridge) * width * height);
+    res -> width = width;
+    res -> height = height;
+    res -> ridges = arena_alloc(arena, sizeof(Ridge*) * height);
+    for (int j = 0; j < height; j++) {
+      (res -> ridges)[j] = rows + (size_t)j * width;
+    }
+    return res;
+  }
+
+  Fingerprint* res = malloc(sizeof(Fingerprint));
+  res -> width = width;
+  res -> height = height;
+  res -> ridges = malloc(sizeof(Ridge*) * height);
+
+  for (int j = 0; j < height; j++) {
+    (res -> ridges)[j] = malloc(sizeof(Ridge) * width);
+  }
+
+  return res;
+}
+
+void free_fingerprint(Fingerprint* fp) {
+
+  for (int j = 0; j < (fp -> height); j++) {
+    free((fp -> ridges)[j]);
+  }
+  free(fp -> ridges);
+  free(fp);
+}
+
+// Scale the coherence of the foreground blocks (all of them when mask is
+// NULL) so that the largest is 1
+void normalize_coherence(Fingerprint* fp, const BlockMask* mask) {
+  float max = 0;
+  for (int i = 0; i < (fp -> width); i++) {
+    for (int j = 0; j < (fp -> height); j++) {
+      if (!mask_get(mask, i, j)) continue;
+      float tmp = (fp -> ridges)[j][i].coherence;
+      if (tmp > max) {
+        max = tmp;
+      }
+    }
+  }
+
+  // Prevent division by zero
+  if (fabs(max) < EPSILON) {
+    return;
+  }
+
+  for (int i = 0; i < (fp -> width); i++) {
+    for (int j = 0; j < (fp -> height); j++) {
+      if (!mask_get(mask, i, j)) continue;
+      float tmp = (fp -> ridges)[j][i].coherence;
+      (fp -> ridges)[j][i].coherence = tmp / max;
+    }
+  }
+}
+
+void generate_sobel_kernels(int size, int** sobel_x, int** sobel_y) {
+  // TODO : find a general formula
+  *sobel_x = malloc(sizeof(int) * size * size);
+  *sobel_y = malloc(sizeof(int) * size * size);
+  
+  if (size == 3) {
+    int x_values[9] = {1, 0, -1, 2, 0, -2, 1, 0, -1};
+    int y_values[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
+    for (int i = 0; i < 9; i++) {
+      (*sobel_x)[i] = x_values[i];
+      (*sobel_y)[i] = y_values[i];
+    }
+  } else if (size == 5) {
+    int x_values[25] = {
+      2, 1, 0, -1, -2,
+      3, 2, 0, -2, -3,
+      4, 3, 0, -3, -4,
+      3, 2, 0, -2, -3,
+      2, 1, 0, -1, -2
+    };
+    int y_values[25] = {
+      2, 3, 4, 3, 2,
+      1, 2, 3, 2, 1,
+      0, 0, 0, 0, 0,
+      -1, -2, -3, -2, -1,
+      -2, -3, -4, -3, -2
+    };
+    for (int i = 0; i < 25; i++) {
+      (*sobel_x)[i] = x_values[i];
+      (*sobel_y)[i] = y_values[i];
+    }
+  } else if (size == 7) {
+    int x_values[49] = {
+      3, 2, 1, 0, -1, -2, -3,
+      4, 3, 2, 0, -2, -3, -4,
+      5, 4, 3, 0, -3, -4, -5,
+      6, 5, 4, 0, -4, -5, -6,
+      5, 4, 3, 0, -3, -4, -5,
+      4, 3, 2, 0, -2, -3, -4,
+      3, 2, 1, 0, -1, -2, -3
+    };
+    int y_values[49] = {
+      3, 4, 5, 6, 5, 4, 3,
+      2, 3, 4, 5, 4, 3, 2,
+      1, 2, 3, 4, 3, 2, 1,
+      0, 0, 0, 0, 0, 0, 0,
+      -1, -2, -3, -4, -3, -2, -1,
+      -2, -3, -4, -5, -4, -3, -2,
+      -3, -4, -5, -6, -5, -4, -3
+    };
+    for (int i = 0; i < 49; i++) {
+      (*sobel_x)[i] = x_values[i];
+      (*sobel_y)[i] = y_values[i];
+    }
+  }
+}
+
+// Grid of the orientation field of `im`: side of a cell in pixels and
+// number of cells (non-overlapping blocks, or dense samples every step)
+void pipeline_grid(const Pipeline* pl, const Plane8* im, int* grid, int* width, int* height) {
+  if (pl->step > 0) {
+    *grid = pl->step;
+    *width = (im->width + pl->step - 1) / pl->step;
+    *height = (im->height + pl->step - 1) / pl->step;
+    return;
+  }
+
+  // Calculate the number of blocks in the image dimensions
+  *grid = pl->block_size;
+  *width = im->width / pl->block_size;
+  *height = im->height / pl->block_size;
+
+  // Ensure we have at least one block
+  if (*width < 1) *width = 1;
+  if (*height < 1) *height = 1;
+}
+
+typedef struct gradient_job {
+  const Pipeline* pl;
+  const PlaneF* src;
+  const BlockMask* mask;
+  int grid;
+  int margin; // pixels read around a cell by the orientation stage
+  PlaneF* grad_x;
+  PlaneF* grad_y;
+  Pool* pool;
+} GradientJob;
+
+// Pixel rows of mask row j (the last row also takes whatever is left of
+// the image), over the columns the foreground cells of this row and of
+// the rows within reach of the margin read
+static void gradient_block_row(void* ctx, int j, int worker) {
+  const GradientJob* job = ctx;
+  const BlockMask* mask = job->mask;
+  int width = job->src->width, height = job->src->height;
+  int grid = job->grid;
+
+  int y0 = j * grid;
+  int y1 = j == mask->height - 1 ? height : y0 + grid;
+  if (y1 > height) y1 = height;
+  if (y0 >= y1) return;
+
+  int reach = (job->margin + grid - 1) / grid;
+  int first = INT_MAX, last = -1;
+  for (int v = j - reach; v <= j + reach; v++) {
+    if (v < 0 || v >= mask->height) continue;
+    for (int i = 0; i < mask->width; i++) {
+      if (!mask_get(mask, i, v)) continue;
+      if (i < first) first = i;
+      if (i > last) last = i;
+    }
+  }
+  if (last < 0) return;
+
+  int x0 = first * grid - job->margin;
+  int x1 = last == mask->width - 1 ? width : (last + 1) * grid + job->margin;
+  if (x0 < 0) x0 = 0;
+  if (x1 > width) x1 = width;
+
+  Arena* scratch = pool_scratch(job->pool, worker);
+  PlaneF gx = { x1 - x0, y1 - y0, job->grad_x->stride, 0, planef_row(job->grad_x, y0) + x0 };
+  PlaneF gy = { x1 - x0, y1 - y0, job->grad_y->stride, 0, planef_row(job->grad_y, y0) + x0 };
+  convolve_region(job->src, job->pl->sobel_x, BORDER_REPLICATE, x0, y0, &gx, scratch);
+  convolve_region(job->src, job->pl->sobel_y, BORDER_REPLICATE, x0, y0, &gy, scratch);
+}
+
+// Sobel gradients of the image, kernel size tied to the block size.
+// Borders are replicated so the gradients keep the image size and stay
+// aligned with the block grid. With a mask, only the pixels that the
+// foreground cells read are computed; the rest of the planes is 0.
+void compute_gradients(const Pipeline* pl, const Plane8* im, const BlockMask* mask, PlaneF** grad_x, PlaneF** grad_y, Pool* pool, Arena* arena) {
+  if (!mask) {
+    *grad_x = convolve_plane8(im, pl->sobel_x, BORDER_REPLICATE, pool, arena);
+    *grad_y = convolve_plane8(im, pl->sobel_y, BORDER_REPLICATE, pool, arena);
+    return;
+  }
+
+  *grad_x = planef_create_in(arena, im->width, im->height);
+  *grad_y = planef_create_in(arena, im->width, im->height);
+  memset((*grad_x)->data, 0, sizeof(float) * (*grad_x)->stride * im->height);
+  memset((*grad_y)->data, 0, sizeof(float) * (*grad_y)->stride * im->height);
+
+  ArenaMark mark = arena_mark(arena);
+  PlaneF* src = plane8_to_f_in(arena, im);
+
+  int grid, width, height;
+  pipeline_grid(pl, im, &grid, &width, &height);
+  int margin = pl->step > 0 && pl->window > pl->step ? (pl->window - pl->step) / 2 + 1 : 0;
+  GradientJob job = { pl, src, mask, grid, margin, *grad_x, *grad_y, pool };
+  pool_run(pool, mask->height, gradient_block_row, &job);
+
+  planef_free(src);
+  arena_rewind(arena, mark);
+}
+
+// Block orientation field, computed for the foreground blocks of `mask`
+// (every block when NULL). With an arena only the result stays allocated
+// in it: the gradients are dropped before returning.
+Fingerprint* compute_fingerprint(const Pipeline* pl, const Plane8* im, const BlockMask* mask, Pool* pool, Arena* arena) {
+  int block_size = pl->block_size;
+  int grid, x_blocks, y_blocks;
+  pipeline_grid(pl, im, &grid, &x_blocks, &y_blocks);
+
+  // Create fingerprint with the correct dimensions
+  Fingerprint* fp = create_fingerprint_in(arena, x_blocks, y_blocks);
+
+  ArenaMark mark = arena_mark(arena);
+  PlaneF* grad_x;
+  PlaneF* grad_y;
+  compute_gradients(pl, im, mask, &grad_x, &grad_y, pool, arena);
+
+  // Gxx, Gxy and Gyy of every block in one pass over the gradients
+  structure_tensor_field(grad_x, grad_y, block_size, fp, mask, pool);
+
+  // Clean up resources
+  planef_free(grad_x);
+  planef_free(grad_y);
+  arena_rewind(arena, mark);
+
+  // Normalize the coherence values
+  normalize_coherence(fp, mask);
+
+  return fp;
+}
+
+// Orientation field sampled every `step` pixels with a sliding window of
+// `window` pixels. Summed-area tables make each sample O(1), so the cost
+// does not depend on the window size.
+Fingerprint* compute_dense_fingerprint(const Pipeline* pl, const Plane8* im, const BlockMask* mask, Pool* pool, Arena* arena) {
+  int window = pl->window, step = pl->step;
+  int grid, x_cells, y_cells;
+  pipeline_grid(pl, im, &grid, &x_cells, &y_cells);
+  Fingerprint* fp = create_fingerprint_in(arena, x_cells, y_cells);
+
+  ArenaMark mark = arena_mark(arena);
+  PlaneF* grad_x;
+  PlaneF* grad_y;
+  compute_gradients(pl, im, mask, &grad_x, &grad_y, pool, arena);
+
+  TensorSat* sat = tensor_sat_create(grad_x, grad_y, arena);
+  planef_free(grad_x);
+  planef_free(grad_y);
+
+  dense_orientation_field(sat, window, step, fp, mask, pool);
+  if (!arena) tensor_sat_free(sat);
+  arena_rewind(arena, mark);
+
+  normalize_coherence(fp, mask);
+
+  return fp;
+}
+
+// Orientation field as an SVG file. Returns 0, or -1 if the file could
+// not be created.
+int draw_svg(const Fingerprint* fp, const char* filename) {
+  int spacing = 20;
+  SVG* svg = svg_init(filename, spacing * (fp -> width), spacing * (fp -> height));
+  if (!svg) return -1;
+
+  for (int i = 0; i < (fp -> width); i++) {
+    for (int j = 0; j < (fp -> height); j++) {
+      float coherence = (fp -> ridges)[j][i].coherence;
+      //if (coherence < 0.2) continue;  // Skip low coherence blocks
+      
+      int color_value = (int)round(coherence * 255);
+      unsigned int color = (color_value << 16) | (color_value << 8) | color_value;
+      
+      float angle = (fp -> ridges)[j][i].angle + M_PI / 2.;
+      // Draw line centered at block center
+      int center_x = i * spacing + spacing/2;
+      int center_y = j * spacing + spacing/2;
+      int line_length = spacing/2;
+      
+      svg_line(svg, 
+               center_x - line_length * cos(angle),
+               center_y - line_length * sin(angle),
+               center_x + line_length * cos(angle),
+               center_y + line_length * sin(angle),
+               2, color);
+    }
+  }
+
+  svg_close(svg);
+  return 0;
+}
+
+// Everything that only depends on the settings is built once here and
+// shared, read-only, by every image run through the pipeline.
+Pipeline* pipeline_create(int block_size, int step, int window, float smooth, const GaborBank* bank) {
+  if (block_size != 3 && block_size != 5 && block_size != 7) {
+    fprintf(stderr, "Unsupported block size %d\n", block_size);
+    return NULL;
+  }
+
+  Pipeline* pl = malloc(sizeof(Pipeline));
+  pl->block_size = block_size;
+  pl->step = step;
+  pl->window = window > 0 ? window : block_size;
+  pl->smooth = smooth;
+  pl->bank = bank;
+
+  int* sobel_x;
+  int* sobel_y;
+  generate_sobel_kernels(block_size, &sobel_x, &sobel_y);
+  pl->sobel_x = kernel_from_int(sobel_x, block_size);
+  pl->sobel_y = kernel_from_int(sobel_y, block_size);
+  free(sobel_x);
+  free(sobel_y);
+
+  return pl;
+}
+
+void pipeline_free(Pipeline* pl) {
+  if (!pl) return;
+  kernel_free(pl->sobel_x);
+  kernel_free(pl->sobel_y);
+  free(pl);
+}
+
+// Foreground mask, orientation field and its singular points, block
+// frequencies, enhanced image, ridge skeleton and minutiae of `im`.
+// Background blocks are skipped by every stage after the segmentation.
+// Stages split their work over `pool` (may be NULL). Results are
+// allocated in `arena` when it is not NULL, and then live until its next
+// reset: intermediate planes are dropped as soon as a stage is done, so
+// the arena only grows by the size of the results plus the largest stage.
+// Returns 0, or -1 with `res` left empty.
+int pipeline_run(const Pipeline* pl, const Plane8* im, Pool* pool, Arena* arena, Enrollment* res) {
+  res->mask = NULL;
+  res->fp = NULL;
+  res->singular = NULL;
+  res->frequency = NULL;
+  res->enhanced = NULL;
+  res->skeleton = NULL;
+  res->minutiae = NULL;
+  res->grid = 0;
+  res->arena = arena;
+  if (!pl || !im) return -1;
+
+  int grid, width, height;
+  pipeline_grid(pl, im, &grid, &width, &height);
+  res->grid = grid;
+  res->mask = segment_image(im, grid, width, height, pool, arena);
+
+  if (pl->step > 0) {
+    res->fp = compute_dense_fingerprint(pl, im, res->mask, pool, arena);
+  } else {
+    res->fp = compute_fingerprint(pl, im, res->mask, pool, arena);
+  }
+  segment_refine(res->mask, res->fp, grid, arena);
+  orientation_smooth(res->fp, res->mask, pl->smooth / grid, pool, arena);
+  res->singular = singularities_detect(res->fp, res->mask, grid, arena);
+
+  res->frequency = frequency_map(im, res->fp, grid, res->mask, pool, arena);
+  frequency_interpolate(res->frequency, width, height, res->mask, arena);
+  res->enhanced = gabor_enhance(im, res->fp, res->frequency, grid, res->mask, pl->bank, pool, arena);
+  if (!res->enhanced) {
+    enrollment_free(res);
+    return -1;
+  }
+
+  res->skeleton = binarize(res->enhanced, res->mask, grid, pool, arena);
+  thin(res->skeleton, arena);
+  res->minutiae = minutiae_extract(res->skeleton, res->fp, res->mask, grid, arena);
+  return 0;
+}
+
+// Heap results are freed; arena results stay until the arena is reset
+void enrollment_free(Enrollment* res) {
+  if (!res->arena) {
+    mask_free(res->mask);
+    if (res->fp) free_fingerprint(res->fp);
+    singularities_free(res->singular);
+    free(res->frequency);
+    planef_free(res->enhanced);
+    mask_free(res->skeleton);
+    minutiae_free(res->minutiae);
+  }
+  res->mask = NULL;
+  res->fp = NULL;
+  res->singular = NULL;
+  res->frequency = NULL;
+  res->enhanced = NULL;
+  res->skeleton = NULL;
+  res->minutiae = NULL;
+}
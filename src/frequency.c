@@ -0,0 +1,228 @@
+#include "frequency.h"
+#include "fingerprint.h"
+#include <math.h>
+#include <string.h>
+
+// Signatures whose standard deviation (grey levels) is below this are
+// taken as background or smudge, not ridges
+#define FREQUENCY_MIN_CONTRAST 2.0f
+
+// Where the oriented window of one quantized orientation samples the image.
+// Sample d of line k across the ridges is at offsets[k * FREQUENCY_ALONG + d]
+// bytes from the window centre; the min/max fields give the extent of the
+// window around its centre, to check that it fits in the image.
+typedef struct window_layout {
+  int offsets[FREQUENCY_WINDOW * FREQUENCY_ALONG];
+  int min_x, max_x;
+  int min_y, max_y;
+} WindowLayout;
+
+typedef struct frequency_job {
+  const Plane8* im;
+  const Fingerprint* fp;
+  int block_size;
+  const BlockMask* mask;
+  const WindowLayout* layouts;
+  float* frequency;
+} FrequencyJob;
+
+// Layouts for FREQUENCY_ANGLES ridge orientations over [0, PI), for the
+// stride of `im`: the trigonometry is done once per image, not per block
+static WindowLayout* window_layouts(const Plane8* im, Arena* arena) {
+  WindowLayout* layouts = arena_alloc(arena, sizeof(WindowLayout) * FREQUENCY_ANGLES);
+
+  for (int q = 0; q < FREQUENCY_ANGLES; q++) {
+    WindowLayout* l = &layouts[q];
+    float angle = q * PI / FREQUENCY_ANGLES;
+    // Unit vectors across (normal) and along the ridges
+    float nx = cos(angle + PI / 2), ny = sin(angle + PI / 2);
+    float rx = cos(angle), ry = sin(angle);
+
+    l->min_x = l->max_x = l->min_y = l->max_y = 0;
+    for (int k = 0; k < FREQUENCY_WINDOW; k++) {
+      float a = k - FREQUENCY_WINDOW / 2;
+      for (int d = 0; d < FREQUENCY_ALONG; d++) {
+        float b = d - FREQUENCY_ALONG / 2;
+        int x = (int)lroundf(a * nx + b * rx);
+        int y = (int)lroundf(a * ny + b * ry);
+        l->offsets[k * FREQUENCY_ALONG + d] = y * im->stride + x;
+        if (x < l->min_x) l->min_x = x;
+        if (x > l->max_x) l->max_x = x;
+        if (y < l->min_y) l->min_y = y;
+        if (y > l->max_y) l->max_y = y;
+      }
+    }
+  }
+
+  return layouts;
+}
+
+// Frequency (cycles per pixel) of an x-signature: the mean grey level of
+// each line across the ridges. The ridge period is measured between the
+// first and last crossings of the signature mean, interpolated between
+// samples, which uses every ridge in the window and needs no peak
+// threshold. Returns 0 when the signature shows no plausible ridges.
+static float signature_frequency(const float* sig, int n) {
+  // Light [1 2 1] smoothing keeps noise from adding crossings
+  float s[n];
+  s[0] = sig[0];
+  s[n - 1] = sig[n - 1];
+  for (int k = 1; k < n - 1; k++) s[k] = 0.25f * (sig[k - 1] + 2 * sig[k] + sig[k + 1]);
+
+  float mean = 0, var = 0;
+  for (int k = 0; k < n; k++) mean += s[k];
+  mean /= n;
+  for (int k = 0; k < n; k++) var += (s[k] - mean) * (s[k] - mean);
+  if (var / n < FREQUENCY_MIN_CONTRAST * FREQUENCY_MIN_CONTRAST) return 0.0;
+
+  float first = 0, last = 0;
+  int crossings = 0;
+  for (int k = 1; k < n; k++) {
+    float a = s[k - 1] - mean, b = s[k] - mean;
+    if ((a < 0) != (b < 0)) {
+      float t = k - 1 + a / (a - b);
+      if (crossings == 0) first = t;
+      last = t;
+      crossings++;
+    }
+  }
+  if (crossings < 2) return 0.0;
+
+  // Consecutive crossings are half a period apart
+  float period = 2 * (last - first) / (crossings - 1);
+  if (period < FREQUENCY_MIN_PERIOD || period > FREQUENCY_MAX_PERIOD) return 0.0;
+  return 1.0 / period;
+}
+
+static void frequency_block_row(void* ctx, int j, int worker) {
+  const FrequencyJob* job = ctx;
+  const Plane8* im = job->im;
+  const Fingerprint* fp = job->fp;
+  int cy = j * job->block_size + job->block_size / 2;
+
+  for (int i = 0; i < fp->width; i++) {
+    int cx = i * job->block_size + job->block_size / 2;
+    float* res = &job->frequency[j * fp->width + i];
+    if (!mask_get(job->mask, i, j)) {
+      *res = 0.0;
+      continue;
+    }
+
+    float angle = (fp->ridges)[j][i].angle;
+    int q = (int)lroundf(angle / PI * FREQUENCY_ANGLES) % FREQUENCY_ANGLES;
+    if (q < 0) q += FREQUENCY_ANGLES;
+    const WindowLayout* l = &job->layouts[q];
+
+    // Windows that leave the image are filled in by interpolation
+    if (cx + l->min_x < 0 || cx + l->max_x >= im->width || cy + l->min_y < 0 || cy + l->max_y >= im->height) {
+      *res = 0.0;
+      continue;
+    }
+
+    const uint8_t* centre = plane8_row(im, cy) + cx;
+    float sig[FREQUENCY_WINDOW];
+    for (int k = 0; k < FREQUENCY_WINDOW; k++) {
+      const int* offsets = l->offsets + k * FREQUENCY_ALONG;
+      int sum = 0;
+      for (int d = 0; d < FREQUENCY_ALONG; d++) sum += centre[offsets[d]];
+      sig[k] = (float)sum / FREQUENCY_ALONG;
+    }
+
+    *res = signature_frequency(sig, FREQUENCY_WINDOW);
+  }
+}
+
+// Ridge frequency of every Ridge of fp (one per block of block_size
+// pixels), measured in a window oriented along the block's ridges.
+// Blocks without an estimate are 0: see frequency_interpolate. So are
+// the background blocks of `mask` (NULL: none), which are not measured.
+// Block rows run over `pool` (may be NULL); the map is allocated in `arena`
+// (heap when NULL).
+float* frequency_map(const Plane8* im, const Fingerprint* fp, int block_size, const BlockMask* mask, Pool* pool, Arena* arena) {
+  float* frequency = arena_alloc(arena, sizeof(float) * fp->width * fp->height);
+
+  ArenaMark mark = arena_mark(arena);
+  WindowLayout* layouts = window_layouts(im, arena);
+  FrequencyJob job = { im, fp, block_size, mask, layouts, frequency };
+
+  pool_run(pool, fp->height, frequency_block_row, &job);
+
+  arena_release(arena, layouts);
+  arena_rewind(arena, mark);
+  return frequency;
+}
+
+// Fill the blocks without an estimate (0) with the mean of their valid
+// 8-neighbours, one ring at a time, then smooth the whole map with a 3x3
+// mean. Background blocks of `mask` (NULL: none) are neither filled nor
+// used and stay 0. Returns the number of foreground blocks left without an
+// estimate: all of them when no block had one.
+int frequency_interpolate(float* frequency, int width, int height, const BlockMask* mask, Arena* scratch) {
+  size_t n = (size_t)width * height;
+  ArenaMark mark = arena_mark(scratch);
+  float* next = arena_alloc(scratch, sizeof(float) * n);
+
+  int missing;
+  for (;;) {
+    int filled = 0;
+    missing = 0;
+    memcpy(next, frequency, sizeof(float) * n);
+
+    for (int j = 0; j < height; j++) {
+      for (int i = 0; i < width; i++) {
+        if (frequency[j * width + i] > 0 || !mask_get(mask, i, j)) continue;
+
+        float sum = 0;
+        int count = 0;
+        for (int v = j - 1; v <= j + 1; v++) {
+          for (int u = i - 1; u <= i + 1; u++) {
+            if (u < 0 || v < 0 || u >= width || v >= height) continue;
+            float f = frequency[v * width + u];
+            if (f > 0) {
+              sum += f;
+              count++;
+            }
+          }
+        }
+
+        if (count > 0) {
+          next[j * width + i] = sum / count;
+          filled++;
+        } else {
+          missing++;
+        }
+      }
+    }
+
+    memcpy(frequency, next, sizeof(float) * n);
+    if (missing == 0 || filled == 0) break;
+  }
+
+  for (int j = 0; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      if (!mask_get(mask, i, j)) {
+        next[j * width + i] = 0;
+        continue;
+      }
+
+      float sum = 0;
+      int count = 0;
+      for (int v = j - 1; v <= j + 1; v++) {
+        for (int u = i - 1; u <= i + 1; u++) {
+          if (u < 0 || v < 0 || u >= width || v >= height) continue;
+          float f = frequency[v * width + u];
+          if (f > 0) {
+            sum += f;
+            count++;
+          }
+        }
+      }
+      next[j * width + i] = count > 0 ? sum / count : 0;
+    }
+  }
+  memcpy(frequency, next, sizeof(float) * n);
+
+  arena_release(scratch, next);
+  arena_rewind(scratch, mark);
+  return missing;
+}
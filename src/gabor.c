@@ -1,12 +1,44 @@
 #include "gabor.h"
+#include "fingerprint.h"
+#include "convolve.h"
 #include "ppm.h"
 #include <math.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define PI 3.141592
 #define EPSILON 1E-6
 
+// The isotropic envelope spans GABOR_SIGMA_PERIODS ridge periods (Hong et
+// al. use sigma = 4 px for ~8 px periods), capped at GABOR_MAX_SIGMA pixels;
+// kernels cover +/- 3 sigma.
+#define GABOR_SIGMA_PERIODS 0.5f
+#define GABOR_MAX_SIGMA 6.0f
+#define GABOR_DEFAULT_FREQ 0.1f
+
+// Blocks are filtered in tiles of GABOR_TILE x GABOR_TILE; the blocks of a
+// tile that share a kernel are filtered together when their bounding
+// rectangle is at most GABOR_GROUP_SPREAD times their area. Measured on
+// 3 px blocks, at 1x and 2x scale, these are 2.5 times faster than
+// filtering each block on its own; larger tiles give larger groups but
+// waste more of their rectangles.
+#ifndef GABOR_TILE
+#define GABOR_TILE 8
+#endif
+#ifndef GABOR_GROUP_SPREAD
+#define GABOR_GROUP_SPREAD 4
+#endif
+
+// Filter bank file: magic, then version, n_angles, n_freqs, min_freq,
+// max_freq, n_taps, sizes[n_freqs] and taps[n_taps] in native byte order
+#define GABOR_BANK_MAGIC "GBNK"
+#define GABOR_BANK_VERSION 1
+
+// Largest banks a file may describe, checked before anything is allocated
+#define GABOR_BANK_MAX_ANGLES 180
+#define GABOR_BANK_MAX_FREQS 64
+
 // Create a Gabor filter kernel
 float** create_gabor_kernel(int size, float angle, float frequency, float sigma_x, float sigma_y) {
     float** kernel = malloc(sizeof(float*) * size);
@@ -61,3 +93,434 @@ void free_gabor_kernel(float** kernel, int size) {
     }
     free(kernel);
 }
+
+static float gabor_sigma(float frequency) {
+    float sigma = GABOR_SIGMA_PERIODS / frequency;
+    return sigma > GABOR_MAX_SIGMA ? GABOR_MAX_SIGMA : sigma;
+}
+
+static int gabor_size(float frequency) {
+    return 2 * (int)ceil(3 * gabor_sigma(frequency)) + 1;
+}
+
+// Flattened, zero-mean Gabor kernel of gabor_size(frequency)^2 taps: flat
+// regions give no response, so the enhanced image is centred on 0 (ridges
+// and valleys have opposite signs). Taps are scaled so that positive and
+// negative lobes each sum to 1.
+static void gabor_taps(float angle, float frequency, float* taps) {
+    int size = gabor_size(frequency);
+    float sigma = gabor_sigma(frequency);
+    int n = size * size;
+
+    float** k2d = create_gabor_kernel(size, angle, frequency, sigma, sigma);
+    float mean = 0.0;
+
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            taps[y * size + x] = k2d[y][x];
+            mean += k2d[y][x];
+        }
+    }
+    free_gabor_kernel(k2d, size);
+    mean /= n;
+
+    float l1 = 0.0;
+    for (int i = 0; i < n; i++) {
+        taps[i] -= mean;
+        l1 += fabs(taps[i]);
+    }
+    if (l1 > EPSILON) {
+        for (int i = 0; i < n; i++) taps[i] *= 2.0 / l1;
+    }
+}
+
+// Replace a size x size kernel by its best rank-1 approximation (power
+// iteration for the leading singular pair) when that keeps at least
+// `energy` of its squared norm, so it runs as two 1D passes.
+static void separable_approximation(float* taps, int size, float energy) {
+    double total = 0;
+    for (int i = 0; i < size * size; i++) total += taps[i] * taps[i];
+    if (total < EPSILON) return;
+
+    double u[size], v[size];
+    for (int i = 0; i < size; i++) v[i] = 1.0 + 0.01 * i;
+
+    double sigma = 0;
+    for (int iter = 0; iter < 50; iter++) {
+        double norm = 0;
+        for (int j = 0; j < size; j++) {
+            u[j] = 0;
+            for (int i = 0; i < size; i++) u[j] += taps[j * size + i] * v[i];
+            norm += u[j] * u[j];
+        }
+        norm = sqrt(norm);
+        if (norm < EPSILON) return;
+        for (int j = 0; j < size; j++) u[j] /= norm;
+
+        sigma = 0;
+        for (int i = 0; i < size; i++) {
+            v[i] = 0;
+            for (int j = 0; j < size; j++) v[i] += taps[j * size + i] * u[j];
+            sigma += v[i] * v[i];
+        }
+        sigma = sqrt(sigma);
+        if (sigma < EPSILON) return;
+        for (int i = 0; i < size; i++) v[i] /= sigma;
+    }
+
+    if (sigma * sigma < energy * total) return;
+    for (int j = 0; j < size; j++) {
+        for (int i = 0; i < size; i++) taps[j * size + i] = sigma * u[j] * v[i];
+    }
+}
+
+// Frequency of bin f out of n_freqs evenly spaced in [min_freq, max_freq]
+static float frequency_bin(int n_freqs, float min_freq, float max_freq, int f) {
+    if (n_freqs == 1) return 0.5 * (min_freq + max_freq);
+    return min_freq + f * (max_freq - min_freq) / (n_freqs - 1);
+}
+
+static float bank_frequency(const GaborBank* bank, int f) {
+    return frequency_bin(bank->n_freqs, bank->min_freq, bank->max_freq, f);
+}
+
+// Allocate a bank and lay out its tap storage; taps are left uninitialised
+static GaborBank* bank_alloc(int n_angles, int n_freqs, float min_freq, float max_freq) {
+    GaborBank* bank = malloc(sizeof(GaborBank));
+    bank->n_angles = n_angles;
+    bank->n_freqs = n_freqs;
+    bank->min_freq = min_freq;
+    bank->max_freq = max_freq;
+    bank->sizes = malloc(sizeof(int) * n_freqs);
+    bank->offsets = malloc(sizeof(long) * n_freqs * n_angles);
+    bank->kernels = malloc(sizeof(Kernel) * n_freqs * n_angles);
+
+    long n_taps = 0, n_passes = 0;
+    for (int f = 0; f < n_freqs; f++) {
+        int size = gabor_size(bank_frequency(bank, f));
+        bank->sizes[f] = size;
+        for (int a = 0; a < n_angles; a++) {
+            bank->offsets[f * n_angles + a] = n_taps;
+            n_taps += size * size;
+            n_passes += 2 * size;
+        }
+    }
+
+    bank->n_taps = n_taps;
+    bank->taps = malloc(sizeof(float) * n_taps);
+    bank->passes = malloc(sizeof(float) * n_passes);
+    return bank;
+}
+
+// Build the kernel views once the taps are in place
+static void bank_link(GaborBank* bank) {
+    long pass = 0;
+    for (int f = 0; f < bank->n_freqs; f++) {
+        int size = bank->sizes[f];
+        for (int a = 0; a < bank->n_angles; a++) {
+            int idx = f * bank->n_angles + a;
+            float* row = bank->passes + pass;
+            float* col = row + size;
+            kernel_view(&bank->kernels[idx], bank->taps + bank->offsets[idx], size, size, row, col);
+            pass += 2 * size;
+        }
+    }
+}
+
+// Precompute the whole bank. With separable_energy in (0, 1], kernels whose
+// rank-1 approximation keeps that fraction of their energy are replaced by
+// it (0 keeps every kernel exact).
+GaborBank* gabor_bank_create(int n_angles, int n_freqs, float min_freq, float max_freq, float separable_energy) {
+    if (n_angles <= 0 || n_freqs <= 0 || min_freq <= 0 || max_freq < min_freq) return NULL;
+
+    GaborBank* bank = bank_alloc(n_angles, n_freqs, min_freq, max_freq);
+    for (int f = 0; f < n_freqs; f++) {
+        for (int a = 0; a < n_angles; a++) {
+            float* taps = bank->taps + bank->offsets[f * n_angles + a];
+            gabor_taps(a * PI / n_angles, bank_frequency(bank, f), taps);
+            if (separable_energy > 0) separable_approximation(taps, bank->sizes[f], separable_energy);
+        }
+    }
+
+    bank_link(bank);
+    return bank;
+}
+
+void gabor_bank_free(GaborBank* bank) {
+    if (!bank) return;
+    free(bank->sizes);
+    free(bank->offsets);
+    free(bank->taps);
+    free(bank->passes);
+    free(bank->kernels);
+    free(bank);
+}
+
+// Kernel of the nearest orientation (angle of the cosine wave, modulo PI)
+// and nearest frequency bin
+const Kernel* gabor_bank_lookup(const GaborBank* bank, float angle, float frequency) {
+    int a = (int)lroundf(angle * bank->n_angles / PI) % bank->n_angles;
+    if (a < 0) a += bank->n_angles;
+
+    int f = 0;
+    if (bank->n_freqs > 1) {
+        f = lroundf((frequency - bank->min_freq) * (bank->n_freqs - 1) / (bank->max_freq - bank->min_freq));
+        if (f < 0) f = 0;
+        if (f >= bank->n_freqs) f = bank->n_freqs - 1;
+    }
+
+    return &bank->kernels[f * bank->n_angles + a];
+}
+
+int gabor_bank_save(const GaborBank* bank, const char* filename) {
+    FILE* f = fopen(filename, "wb");
+    if (!f) {
+        perror("Error opening file");
+        return -1;
+    }
+
+    int32_t header[3] = { GABOR_BANK_VERSION, bank->n_angles, bank->n_freqs };
+    float range[2] = { bank->min_freq, bank->max_freq };
+    int64_t n_taps = bank->n_taps;
+
+    int ok = fwrite(GABOR_BANK_MAGIC, 1, 4, f) == 4
+        && fwrite(header, sizeof(header), 1, f) == 1
+        && fwrite(range, sizeof(range), 1, f) == 1
+        && fwrite(&n_taps, sizeof(n_taps), 1, f) == 1
+        && fwrite(bank->sizes, sizeof(int), bank->n_freqs, f) == (size_t)bank->n_freqs
+        && fwrite(bank->taps, sizeof(float), n_taps, f) == (size_t)n_taps;
+
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Error writing filter bank %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+// Load a bank written by gabor_bank_save; the kernels are not recomputed
+GaborBank* gabor_bank_load(const char* filename) {
+    FILE* f = fopen(filename, "rb");
+    if (!f) return NULL;
+
+    char magic[4];
+    int32_t header[3];
+    float range[2];
+    int64_t n_taps;
+    int sizes[GABOR_BANK_MAX_FREQS];
+    int stored[GABOR_BANK_MAX_FREQS];
+
+    int ok = fread(magic, 1, 4, f) == 4 && memcmp(magic, GABOR_BANK_MAGIC, 4) == 0
+        && fread(header, sizeof(header), 1, f) == 1 && header[0] == GABOR_BANK_VERSION
+        && header[1] > 0 && header[1] <= GABOR_BANK_MAX_ANGLES
+        && header[2] > 0 && header[2] <= GABOR_BANK_MAX_FREQS
+        && fread(range, sizeof(range), 1, f) == 1
+        && range[0] > 0 && range[0] <= range[1] && range[1] <= 0.5f
+        && fread(&n_taps, sizeof(n_taps), 1, f) == 1;
+
+    // Kernel sizes and tap count must match the ones this build would
+    // compute for that header
+    if (ok) {
+        int64_t expected = 0;
+        for (int k = 0; k < header[2]; k++) {
+            sizes[k] = gabor_size(frequency_bin(header[2], range[0], range[1], k));
+            expected += (int64_t)sizes[k] * sizes[k] * header[1];
+        }
+        ok = n_taps == expected
+            && fread(stored, sizeof(int), header[2], f) == (size_t)header[2]
+            && memcmp(stored, sizes, sizeof(int) * header[2]) == 0;
+    }
+
+    GaborBank* bank = NULL;
+    if (ok) {
+        bank = bank_alloc(header[1], header[2], range[0], range[1]);
+        ok = fread(bank->taps, sizeof(float), n_taps, f) == (size_t)n_taps;
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Invalid filter bank %s\n", filename);
+        gabor_bank_free(bank);
+        return NULL;
+    }
+
+    bank_link(bank);
+    return bank;
+}
+
+static int compare_float(const void* a, const void* b) {
+    float fa = *(const float*)a, fb = *(const float*)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// Median of the plausible block frequencies, used for blocks whose own
+// estimate failed
+static float median_frequency(const float* frequency, int n, Arena* arena) {
+    float* valid = arena_alloc(arena, sizeof(float) * n);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (frequency[i] >= GABOR_MIN_FREQ && frequency[i] <= GABOR_MAX_FREQ) valid[count++] = frequency[i];
+    }
+
+    float res = GABOR_DEFAULT_FREQ;
+    if (count > 0) {
+        qsort(valid, count, sizeof(float), compare_float);
+        res = valid[count / 2];
+    }
+    arena_release(arena, valid);
+    return res;
+}
+
+typedef struct enhance_job {
+    const PlaneF* src;
+    const Fingerprint* fp;
+    const float* frequency;
+    int block_size;
+    const BlockMask* mask;
+    const GaborBank* bank;
+    float fallback;
+    PlaneF* out;
+    Pool* pool;
+} EnhanceJob;
+
+// Pixels covered by block (i, j): the last row and column of blocks also
+// cover whatever the grid leaves over. Returns 0 when the block is empty.
+static int block_rect(const EnhanceJob* job, int i, int j, int* x0, int* y0, int* w, int* h) {
+    const Fingerprint* fp = job->fp;
+    const PlaneF* out = job->out;
+    int block_size = job->block_size;
+
+    *x0 = i * block_size;
+    *y0 = j * block_size;
+    if (*x0 >= out->width || *y0 >= out->height) return 0;
+    *w = (i == fp->width - 1) ? out->width - *x0 : block_size;
+    *h = (j == fp->height - 1) ? out->height - *y0 : block_size;
+    if (*x0 + *w > out->width) *w = out->width - *x0;
+    if (*y0 + *h > out->height) *h = out->height - *y0;
+    return 1;
+}
+
+typedef struct tile_block {
+    const Kernel* k;
+    int i, j;
+} TileBlock;
+
+static int compare_tile_block(const void* a, const void* b) {
+    const TileBlock* x = a;
+    const TileBlock* y = b;
+    if (x->k != y->k) return (uintptr_t)x->k < (uintptr_t)y->k ? -1 : 1;
+    if (x->j != y->j) return x->j - y->j;
+    return x->i - y->i;
+}
+
+// The n blocks of a tile that have the same kernel: their bounding
+// rectangle is filtered at once when it is mostly made of them, which
+// gives the convolution rows longer than one block; scattered blocks are
+// filtered one by one
+static void enhance_group(const EnhanceJob* job, const TileBlock* blocks, int n, Arena* scratch) {
+    PlaneF* out = job->out;
+    int bi0 = blocks[0].i, bi1 = blocks[0].i, bj0 = blocks[0].j, bj1 = blocks[0].j;
+    for (int b = 1; b < n; b++) {
+        if (blocks[b].i < bi0) bi0 = blocks[b].i;
+        if (blocks[b].i > bi1) bi1 = blocks[b].i;
+        if (blocks[b].j < bj0) bj0 = blocks[b].j;
+        if (blocks[b].j > bj1) bj1 = blocks[b].j;
+    }
+
+    int x0, y0, w, h;
+    if (n == 1 || (bi1 - bi0 + 1) * (bj1 - bj0 + 1) > GABOR_GROUP_SPREAD * n) {
+        for (int b = 0; b < n; b++) {
+            block_rect(job, blocks[b].i, blocks[b].j, &x0, &y0, &w, &h);
+            PlaneF dst = { w, h, out->stride, 0, planef_row(out, y0) + x0 };
+            convolve_region(job->src, blocks[b].k, BORDER_REPLICATE, x0, y0, &dst, scratch);
+        }
+        return;
+    }
+
+    int rx0, ry0, rx1, ry1;
+    block_rect(job, bi0, bj0, &rx0, &ry0, &w, &h);
+    block_rect(job, bi1, bj1, &x0, &y0, &w, &h);
+    rx1 = x0 + w;
+    ry1 = y0 + h;
+
+    ArenaMark mark = arena_mark(scratch);
+    PlaneF* region = planef_create_in(scratch, rx1 - rx0, ry1 - ry0);
+    convolve_region(job->src, blocks[0].k, BORDER_REPLICATE, rx0, ry0, region, scratch);
+    for (int b = 0; b < n; b++) {
+        block_rect(job, blocks[b].i, blocks[b].j, &x0, &y0, &w, &h);
+        for (int y = y0; y < y0 + h; y++) {
+            memcpy(planef_row(out, y) + x0, planef_row(region, y - ry0) + (x0 - rx0), sizeof(float) * w);
+        }
+    }
+    planef_free(region);
+    arena_rewind(scratch, mark);
+}
+
+// Row t of tiles of GABOR_TILE x GABOR_TILE blocks: every block writes its
+// own rectangle of the output, and reads its halo straight from the
+// shared source. Within a tile, blocks are grouped by bank kernel.
+static void enhance_tile_row(void* ctx, int t, int worker) {
+    const EnhanceJob* job = ctx;
+    const Fingerprint* fp = job->fp;
+    PlaneF* out = job->out;
+    Arena* scratch = pool_scratch(job->pool, worker);
+    TileBlock blocks[GABOR_TILE * GABOR_TILE];
+
+    int j0 = t * GABOR_TILE;
+    int j1 = j0 + GABOR_TILE < fp->height ? j0 + GABOR_TILE : fp->height;
+    for (int i0 = 0; i0 < fp->width; i0 += GABOR_TILE) {
+        int i1 = i0 + GABOR_TILE < fp->width ? i0 + GABOR_TILE : fp->width;
+        int n = 0;
+
+        for (int j = j0; j < j1; j++) {
+            for (int i = i0; i < i1; i++) {
+                int x0, y0, w, h;
+                if (!block_rect(job, i, j, &x0, &y0, &w, &h)) continue;
+                if (!mask_get(job->mask, i, j)) {
+                    for (int y = y0; y < y0 + h; y++) memset(planef_row(out, y) + x0, 0, sizeof(float) * w);
+                    continue;
+                }
+
+                float f = job->frequency[j * fp->width + i];
+                if (f < GABOR_MIN_FREQ || f > GABOR_MAX_FREQ) f = job->fallback;
+
+                // Ridge.angle follows the ridges; the kernel's cosine must
+                // vary across them
+                const Kernel* k = gabor_bank_lookup(job->bank, (fp->ridges)[j][i].angle - PI / 2.0, f);
+                blocks[n++] = (TileBlock){ k, i, j };
+            }
+        }
+
+        qsort(blocks, n, sizeof(TileBlock), compare_tile_block);
+        for (int b = 0, e; b < n; b = e) {
+            for (e = b + 1; e < n && blocks[e].k == blocks[b].k; e++) {}
+            enhance_group(job, blocks + b, e - b, scratch);
+        }
+    }
+}
+
+// Contextual filtering of the greyscale image: every block is filtered
+// with the bank kernel closest to its own ridge orientation (fp) and ridge
+// frequency (frequency[j * fp->width + i], 0 when unknown). Blocks are
+// block_size pixels wide; the last row and column of blocks also cover
+// whatever the grid leaves over. Kernels read across block borders, so
+// the output has no seams. Background blocks of `mask` (NULL: none) are
+// not filtered and come out as 0. Rows of tiles run over `pool` (may be
+// NULL); the output and the temporaries are allocated in `arena` (heap
+// when NULL).
+PlaneF* gabor_enhance(const Plane8* im, const Fingerprint* fp, const float* frequency, int block_size, const BlockMask* mask, const GaborBank* bank, Pool* pool, Arena* arena) {
+    if (!im || !fp || !frequency || !bank || block_size <= 0) {
+        return NULL;
+    }
+
+    PlaneF* out = planef_create_in(arena, im->width, im->height);
+    ArenaMark mark = arena_mark(arena);
+    PlaneF* src = plane8_to_f_in(arena, im);
+    EnhanceJob job = { src, fp, frequency, block_size, mask, bank, 0, out, pool };
+    job.fallback = median_frequency(frequency, fp->width * fp->height, arena);
+
+    pool_run(pool, (fp->height + GABOR_TILE - 1) / GABOR_TILE, enhance_tile_row, &job);
+
+    planef_free(src);
+    arena_rewind(arena, mark);
+    return out;
+}
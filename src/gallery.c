@@ -0,0 +1,166 @@
+#include "gallery.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct gallery_job {
+  const Gallery* g;
+  const MatchTemplate* probe;
+  Pool* pool;
+  const int* shortlist;
+  float* scores;
+} GalleryJob;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+static int count_cores(const TemplateView* t) {
+  int cores = 0;
+  for (int i = 0; i < t->header->singular; i++) cores += t->singular[i].type == SINGULAR_CORE;
+  return cores < 2 ? cores : 2;
+}
+
+// Coarse similarity: shared triplets over the geometric mean of their
+// numbers, 0 when the pattern classes are too far apart (an arch is never
+// a whorl, but one core may be missed)
+static float coarse_score(const GalleryKey* a, const GalleryKey* b, int votes) {
+  if (abs(a->cores - b->cores) > 1) return 0;
+  return votes / sqrtf((float)a->triplets * b->triplets);
+}
+
+// Gallery of the template files; files that cannot be read or fail their
+// checksum are reported and left out
+Gallery* gallery_load(char* const* files, int count) {
+  Gallery* g = malloc(sizeof(Gallery));
+  g->arena = arena_create(0);
+  g->names = malloc(sizeof(char*) * (count > 0 ? count : 1));
+  g->keys = arena_alloc(g->arena, sizeof(GalleryKey) * (count > 0 ? count : 1));
+  g->templates = arena_alloc(g->arena, sizeof(MatchTemplate*) * (count > 0 ? count : 1));
+  g->count = 0;
+
+  // (key, entry) pairs of the index
+  size_t n_pairs = 0, size = 0;
+  uint64_t* pairs = NULL;
+
+  for (int i = 0; i < count; i++) {
+    TemplateMap* map = template_map(files[i]);
+    if (!map) continue;
+    if (template_check(map->base, map->length) != 0) {
+      fprintf(stderr, "Corrupted template %s\n", files[i]);
+      template_unmap(map);
+      continue;
+    }
+
+    // Nothing refers to the file once the template is prepared
+    int e = g->count++;
+    g->names[e] = strdup(files[i]);
+    g->templates[e] = match_prepare(&map->view, g->arena);
+
+    uint32_t* keys = malloc(sizeof(uint32_t) * (triplet_max_keys(&map->view) + 1));
+    int n = triplet_keys(&map->view, keys, NULL);
+    g->keys[e].cores = count_cores(&map->view);
+    g->keys[e].triplets = n;
+    if (n_pairs + n > size) {
+      size = 2 * (n_pairs + n);
+      pairs = realloc(pairs, sizeof(uint64_t) * size);
+    }
+    for (int k = 0; k < n; k++) pairs[n_pairs++] = (uint64_t)keys[k] << 32 | e;
+    free(keys);
+    template_unmap(map);
+  }
+
+  g->index = triplet_index_build(pairs, n_pairs, g->arena);
+  free(pairs);
+  return g;
+}
+
+void gallery_free(Gallery* g) {
+  if (!g) return;
+  for (int i = 0; i < g->count; i++) free(g->names[i]);
+  free(g->names);
+  arena_free(g->arena);
+  free(g);
+}
+
+static void gallery_match(void* ctx, int index, int worker) {
+  GalleryJob* job = ctx;
+  const MatchTemplate* ref = job->g->templates[job->shortlist[index]];
+  job->scores[index] = match_score(job->probe, ref, pool_scratch(job->pool, worker));
+}
+
+static int compare_hits(const void* a, const void* b) {
+  const GalleryHit* ha = a;
+  const GalleryHit* hb = b;
+  if (ha->score != hb->score) return ha->score < hb->score ? 1 : -1;
+  return ha->entry - hb->entry;
+}
+
+// The k best matches of probe in the gallery, best first, into hits[];
+// returns how many there are (at most k). Entries get one vote per
+// triplet key they share with the probe, through the index, and the
+// GALLERY_SHORTLIST best voted go through the fine matcher, spread over
+// the workers of `pool`. Neither step depends on the size of the gallery.
+// Temporaries live in `scratch` (heap when NULL). Timings go to `query`
+// when not NULL.
+int gallery_identify(const Gallery* g, const TemplateView* probe, Pool* pool, Arena* scratch, GalleryHit* hits, int k, GalleryQuery* query) {
+  double start = now();
+  ArenaMark mark = arena_mark(scratch);
+  int* shortlist = arena_alloc(scratch, sizeof(int) * GALLERY_SHORTLIST);
+  float* coarse = arena_alloc(scratch, sizeof(float) * GALLERY_SHORTLIST);
+  float* scores = arena_alloc(scratch, sizeof(float) * GALLERY_SHORTLIST);
+  MatchTemplate* m = match_prepare(probe, scratch);
+
+  uint32_t* keys = arena_alloc(scratch, sizeof(uint32_t) * (triplet_max_keys(probe) + 1));
+  GalleryKey key = { count_cores(probe), triplet_keys(probe, keys, scratch) };
+  int voted;
+  TripletVote* votes = triplet_index_vote(g->index, keys, key.triplets, &voted, scratch);
+
+  // Best coarse scores so far, by insertion; ties keep gallery order
+  int n = 0;
+  for (int v = 0; v < voted; v++) {
+    int e = votes[v].entry;
+    float c = coarse_score(&key, &g->keys[e], votes[v].votes);
+    if (c <= 0 || (n == GALLERY_SHORTLIST && c <= coarse[n - 1])) continue;
+    int at = n < GALLERY_SHORTLIST ? n++ : n - 1;
+    while (at > 0 && coarse[at - 1] < c) {
+      coarse[at] = coarse[at - 1];
+      shortlist[at] = shortlist[at - 1];
+      at--;
+    }
+    coarse[at] = c;
+    shortlist[at] = e;
+  }
+  double ranked = now();
+  GalleryJob job = { g, m, pool, shortlist, scores };
+  pool_run(pool, n, gallery_match, &job);
+
+  int count = 0;
+  GalleryHit* all = arena_alloc(scratch, sizeof(GalleryHit) * (n > 0 ? n : 1));
+  for (int i = 0; i < n; i++) {
+    if (scores[i] > 0) all[count++] = (GalleryHit){ shortlist[i], scores[i] };
+  }
+  qsort(all, count, sizeof(GalleryHit), compare_hits);
+  if (count > k) count = k;
+  memcpy(hits, all, sizeof(GalleryHit) * count);
+
+  if (query) {
+    query->shortlisted = n;
+    query->coarse = ranked - start;
+    query->fine = now() - ranked;
+  }
+
+  arena_release(scratch, all);
+  arena_release(scratch, votes);
+  arena_release(scratch, keys);
+  if (!scratch) match_template_free(m);
+  arena_release(scratch, scores);
+  arena_release(scratch, coarse);
+  arena_release(scratch, shortlist);
+  arena_rewind(scratch, mark);
+  return count;
+}
@@ -1,490 +1,467 @@
 #include "ppm.h"
-#include "csvg.h"
 #include "gabor.h"
+#include "fingerprint.h"
+#include "orientation.h"
+#include "skeleton.h"
+#include "template.h"
+#include "match.h"
+#include "gallery.h"
+#include "feature.h"
+#include "knn.h"
+#include "service.h"
+#include "batch.h"
+#include "pool.h"
 #include <assert.h>
+#include <getopt.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
-#define PI 3.141592
-#define EPSILON 1E-6
+// Candidates printed for each probe of --identify
+#define IDENTIFY_CANDIDATES 5
 
-float squared_average_gradient(Image* grad_x, Image* grad_y, int block_size, int x, int y, int* directions) {
-  // Check if the block would go out of bounds
-  // (x,y) represents the top left of the moving window
-  if (((x + block_size) > (grad_x -> width)) || ((y + block_size) > (grad_y -> height))) {
-    return EPSILON;
+void print_fingerprint_angles(const Fingerprint* fp) {
+  printf("Fingerprint angles (degrees ):\n");
+  for (int i = 0; i < fp->height; i++) {
+    for (int j = 0; j < fp->width; j++) {
+      // Convert radians to degrees: degrees = radians * 180 / PI
+      float angle_degrees = (fp->ridges)[i][j].angle * 180 / M_PI;
+      printf("%03d ", (int)round(angle_degrees));
+    }
+    printf("\n");
   }
+}
 
-  float res = 0;
-  for (int i = 0; i < block_size; i++) {
-    for (int j = 0; j < block_size; j++) {
-      // Access the red channel for greyscale images
-      float tmp_x = (grad_x->p)[y + j][x + i].r;
-      float tmp_y = (grad_y->p)[y + j][x + i].r;
-
-      if (directions[0] == 1) { 
-        res += tmp_x * tmp_x; // Compute Gxx
-      }
-      if (directions[1] == 1) {
-        res += tmp_x * tmp_y; // Compute Gxy
-      }
-      if (directions[2] == 1) {
-        res += tmp_y * tmp_y; // Compute Gyy
-      }
-    }
+void print_minutiae(const Minutiae* m) {
+  int endings = 0;
+  for (int i = 0; i < m->count; i++) endings += m->points[i].type == MINUTIA_ENDING;
+  printf("Minutiae: %d endings, %d bifurcations (x y degrees type quality):\n", endings, m->count - endings);
+  for (int i = 0; i < m->count; i++) {
+    const Minutia* p = &m->points[i];
+    printf("%3d %3d %03d %s %3d\n", p->x, p->y, (int)round(p->angle * 180 / M_PI),
+           p->type == MINUTIA_ENDING ? "E" : "B", p->quality);
   }
+}
 
-  return res / (block_size * block_size + EPSILON);  // Corrected normalization
+void print_singularities(const Singularities* s) {
+  printf("Singular points (x y type cells):\n");
+  for (int i = 0; i < s->count; i++) {
+    const SingularPoint* p = &s->points[i];
+    printf("%5.1f %5.1f %s %d\n", p->x, p->y, p->type == SINGULAR_CORE ? "core" : "delta", p->cells);
+  }
 }
 
+// The filter bank only depends on constants: reuse the one saved in
+// `filename` when there is one, otherwise build it (and save it there)
+GaborBank* load_filter_bank(const char* filename) {
+  GaborBank* bank = filename ? gabor_bank_load(filename) : NULL;
+  if (bank) return bank;
 
-void ridge_valey_orientation(Image* grad_x, Image* grad_y, int block_size, int x, int y, float* angle, float* coherence) {
-  int dir1[3] = {1, 0, 0};
-  int dir2[3] = {0, 1, 0};
-  int dir3[3] = {0, 0, 1};
+  bank = gabor_bank_create(GABOR_BANK_ANGLES, GABOR_BANK_FREQS, GABOR_MIN_FREQ, GABOR_MAX_FREQ, 0);
+  if (filename && gabor_bank_save(bank, filename) == 0) {
+    printf("Saved filter bank to %s\n", filename);
+  }
+  return bank;
+}
 
-  float gxx = squared_average_gradient(grad_x, grad_y, block_size, x, y, dir1);
-  float gxy = squared_average_gradient(grad_x, grad_y, block_size, x, y, dir2);
-  float gyy = squared_average_gradient(grad_x, grad_y, block_size, x, y, dir3);
+void usage(const char* prog) {
+  printf("Usage: %s [options] <input_image> [output_prefix]\n", prog);
+  printf("       %s [options] --batch <directory|manifest> [output_directory]\n", prog);
+  printf("       %s --match <probe.fpt> <reference.fpt>\n", prog);
+  printf("       %s [options] --identify <gallery directory|manifest> <probe.fpt>...\n", prog);
+  printf("       %s [options] --knn K <gallery directory|manifest> <probe image>...\n", prog);
+  printf("       %s [options] --serve <socket|-> [--gallery <directory|manifest>]\n", prog);
+  printf("  --step N    sample the orientation field every N pixels (sliding window)\n");
+  printf("  --window N  sliding window size in pixels (default: block size)\n");
+  printf("  --smooth S  sigma of the orientation smoothing in pixels (default: %g, 0: off,\n"
+         "              at most %g)\n", ORIENTATION_SMOOTH_SIGMA, ORIENTATION_MAX_SMOOTH_SIGMA);
+  printf("  --bank FILE load the Gabor filter bank from FILE, or build and save it there\n");
+  printf("  --threads N worker threads (default: one per online CPU)\n");
+  printf("  --batch     enroll every image of a directory, or listed in a manifest file\n");
+  printf("  --match     print the similarity (0 to 1) of two templates\n");
+  printf("  --identify  search the templates of a gallery for the best matches of each probe\n");
+  printf("  --knn K     K nearest gallery images of each probe by feature vector\n");
+  printf("  --compact   use the compact feature vectors and a VP-tree for --knn\n");
+  printf("  --serve P   answer enroll/verify/identify requests, one per line, on the Unix\n");
+  printf("              socket P or on stdin/stdout when P is -\n");
+  printf("  --gallery G templates searched by identify requests\n");
+}
 
-  // Compute orientation angle
-  *angle = 0.5 * atan2(2.0 * gxy, gxx - gyy) + PI/2.0;
-  
-  // Compute coherence using the correct formula
-  float numerator = sqrt((gxx - gyy) * (gxx - gyy) + 4 * gxy * gxy);
-  float denominator = gxx + gyy;
-  
-  if (denominator > EPSILON) {
-    *coherence = numerator / denominator;
+// Long-running server: the filter bank, the pipeline and the gallery are
+// set up once for all requests
+int serve(const Pipeline* pl, const char* socket_path, const char* gallery_path, int threads) {
+  Gallery* g = NULL;
+  if (gallery_path) {
+    int files;
+    char** inputs = batch_templates(gallery_path, &files);
+    if (!inputs) return 1;
+    g = gallery_load(inputs, files);
+    batch_inputs_free(inputs, files);
+    fprintf(stderr, "Gallery: %d templates\n", g->count);
+  }
+
+  Service* s = service_create(pl, g, threads);
+  if (!s) {
+    gallery_free(g);
+    return 1;
+  }
+  int status = 0;
+  if (strcmp(socket_path, "-") == 0) {
+    status = service_run(s, stdin, stdout) < 0;
   } else {
-    *coherence = 0.0;
+    fprintf(stderr, "Listening on %s with %d workers\n", socket_path, threads);
+    status = service_listen(s, socket_path) != 0;
   }
+  service_free(s);
+  gallery_free(g);
+  return status;
 }
 
-Fingerprint* create_fingerprint(int width, int height) {
-  Fingerprint* res = malloc(sizeof(Fingerprint));
-  res -> width = width;
-  res -> height = height;
-  res -> ridges = malloc(sizeof(Ridge*) * height);
+// Two templates: print their similarity score
+int match_templates(const char* probe_file, const char* ref_file) {
+  TemplateMap* probe = template_map(probe_file);
+  TemplateMap* ref = probe ? template_map(ref_file) : NULL;
+  if (!ref) {
+    template_unmap(probe);
+    return 1;
+  }
 
-  for (int j = 0; j < height; j++) {
-    (res -> ridges)[j] = malloc(sizeof(Ridge) * width);
+  int status = 1;
+  if (template_check(probe->base, probe->length) != 0) {
+    printf("Error: Corrupted template %s\n", probe_file);
+  } else if (template_check(ref->base, ref->length) != 0) {
+    printf("Error: Corrupted template %s\n", ref_file);
+  } else {
+    Arena* arena = arena_create(0);
+    MatchTemplate* a = match_prepare(&probe->view, arena);
+    MatchTemplate* b = match_prepare(&ref->view, arena);
+    printf("Score: %.3f (%d and %d minutiae)\n", match_score(a, b, arena), a->count, b->count);
+    arena_free(arena);
+    status = 0;
   }
 
-  return res;
+  template_unmap(ref);
+  template_unmap(probe);
+  return status;
 }
 
-void free_fingerprint(Fingerprint* fp) {
+// Probes against a gallery of templates: print the best candidates of
+// each probe with the time of the query, then the throughput
+int identify_probes(const char* gallery_path, char* const* probes, int count, Pool* pool) {
+  int files;
+  char** inputs = batch_templates(gallery_path, &files);
+  if (!inputs) return 1;
+  Gallery* g = gallery_load(inputs, files);
+  batch_inputs_free(inputs, files);
+  printf("Gallery: %d templates\n", g->count);
+
+  GalleryHit hits[IDENTIFY_CANDIDATES];
+  Arena* scratch = arena_create(0);
+  int queries = 0, matches = 0;
+  double total = 0, slowest = 0;
+  for (int i = 0; i < count; i++) {
+    TemplateMap* map = template_map(probes[i]);
+    if (!map) continue;
+    if (template_check(map->base, map->length) != 0) {
+      printf("Error: Corrupted template %s\n", probes[i]);
+      template_unmap(map);
+      continue;
+    }
 
-  for (int j = 0; j < (fp -> height); j++) {
-    free((fp -> ridges)[j]);
+    GalleryQuery q;
+    int n = gallery_identify(g, &map->view, pool, scratch, hits, IDENTIFY_CANDIDATES, &q);
+    double seconds = q.coarse + q.fine;
+    printf("%s: %d/%d shortlisted, %.2f ms (coarse %.2f ms, fine %.2f ms)\n", probes[i],
+           q.shortlisted, g->count, seconds * 1E3, q.coarse * 1E3, q.fine * 1E3);
+    for (int k = 0; k < n; k++) printf("  %.3f %s\n", hits[k].score, g->names[hits[k].entry]);
+    if (n == 0) printf("  no match\n");
+
+    queries++;
+    matches += q.shortlisted;
+    total += seconds;
+    if (seconds > slowest) slowest = seconds;
+    template_unmap(map);
   }
-  free(fp -> ridges);
-  free(fp);
-}
 
-void normalize_coherence(Fingerprint* fp) {
-  float max = 0;
-  for (int i = 0; i < (fp -> width); i++) {
-    for (int j = 0; j < (fp -> height); j++) {
-      float tmp = (fp -> ridges)[j][i].coherence;
-      if (tmp > max) {
-        max = tmp;
-      }
-    }
+  if (queries > 0) {
+    double seconds = total > 0 ? total : 1E-9;
+    printf("Identified %d probes on %d threads\n", queries, pool_threads(pool));
+    printf("  throughput: %.1f queries/s, %.0f matches/s\n", queries / seconds, matches / seconds);
+    printf("  latency: mean %.2f ms, max %.2f ms\n", total / queries * 1E3, slowest * 1E3);
   }
 
-  // Prevent division by zero
-  if (fabs(max) < EPSILON) {
-    return;
+  arena_free(scratch);
+  gallery_free(g);
+  return queries < count;
+}
+
+// Feature vector of an image into out (padded as a matrix row); the
+// enrollment goes to `arena`, which is reset afterwards
+int image_features(const Pipeline* pl, const char* input, int compact, Pool* pool, Arena* arena, float* out) {
+  Plane8* im = ppm_open_grey(input, GREY_MEAN);
+  if (!im) {
+    printf("Error: Could not open image %s\n", input);
+    return -1;
   }
 
-  for (int i = 0; i < (fp -> width); i++) {
-    for (int j = 0; j < (fp -> height); j++) {
-      float tmp = (fp -> ridges)[j][i].coherence;
-      (fp -> ridges)[j][i].coherence = tmp / max;
+  Enrollment res;
+  int status = pipeline_run(pl, im, pool, arena, &res);
+  if (status == 0) {
+    if (compact) {
+      feature_compact(&res, out);
+    } else {
+      feature_extract(&res, out);
     }
+    enrollment_free(&res);
+  } else {
+    printf("Error: Could not process image %s\n", input);
   }
+
+  arena_reset(arena);
+  plane8_free(im);
+  return status;
 }
 
-void generate_sobel_kernels(int size, int** sobel_x, int** sobel_y) {
-  // TODO : find a general formula
-  *sobel_x = malloc(sizeof(int) * size * size);
-  *sobel_y = malloc(sizeof(int) * size * size);
-  
-  if (size == 3) {
-    int x_values[9] = {1, 0, -1, 2, 0, -2, 1, 0, -1};
-    int y_values[9] = {1, 2, 1, 0, 0, 0, -1, -2, -1};
-    for (int i = 0; i < 9; i++) {
-      (*sobel_x)[i] = x_values[i];
-      (*sobel_y)[i] = y_values[i];
-    }
-  } else if (size == 5) {
-    int x_values[25] = {
-      2, 1, 0, -1, -2,
-      3, 2, 0, -2, -3,
-      4, 3, 0, -3, -4,
-      3, 2, 0, -2, -3,
-      2, 1, 0, -1, -2
-    };
-    int y_values[25] = {
-      2, 3, 4, 3, 2,
-      1, 2, 3, 2, 1,
-      0, 0, 0, 0, 0,
-      -1, -2, -3, -2, -1,
-      -2, -3, -4, -3, -2
-    };
-    for (int i = 0; i < 25; i++) {
-      (*sobel_x)[i] = x_values[i];
-      (*sobel_y)[i] = y_values[i];
-    }
-  } else if (size == 7) {
-    int x_values[49] = {
-      3, 2, 1, 0, -1, -2, -3,
-      4, 3, 2, 0, -2, -3, -4,
-      5, 4, 3, 0, -3, -4, -5,
-      6, 5, 4, 0, -4, -5, -6,
-      5, 4, 3, 0, -3, -4, -5,
-      4, 3, 2, 0, -2, -3, -4,
-      3, 2, 1, 0, -1, -2, -3
-    };
-    int y_values[49] = {
-      3, 4, 5, 6, 5, 4, 3,
-      2, 3, 4, 5, 4, 3, 2,
-      1, 2, 3, 4, 3, 2, 1,
-      0, 0, 0, 0, 0, 0, 0,
-      -1, -2, -3, -4, -3, -2, -1,
-      -2, -3, -4, -5, -4, -3, -2,
-      -3, -4, -5, -6, -5, -4, -3
-    };
-    for (int i = 0; i < 49; i++) {
-      (*sobel_x)[i] = x_values[i];
-      (*sobel_y)[i] = y_values[i];
-    }
+// Probes against the feature vectors of a gallery of images: print the k
+// nearest gallery images of each probe with the time of the search
+int knn_probes(const Pipeline* pl, const char* gallery_path, char* const* probes, int count, int k, int compact, Pool* pool) {
+  int files;
+  char** inputs = batch_inputs(gallery_path, &files);
+  if (!inputs) return 1;
+
+  // Rows of the images that enrolled, in gallery order
+  int dim = compact ? FEATURE_COMPACT_DIM : FEATURE_DIM;
+  KnnMatrix* m = knn_matrix_create(files, dim);
+  int* image = malloc(sizeof(int) * (files > 0 ? files : 1));
+  Arena* arena = arena_create(0);
+  int rows = 0;
+  for (int i = 0; i < files; i++) {
+    if (image_features(pl, inputs[i], compact, pool, arena, knn_row(m, rows)) != 0) continue;
+    image[rows++] = i;
+  }
+  m->rows = rows;
+  KnnTree* tree = compact ? knn_tree_build(m) : NULL;
+  printf("Gallery: %d feature vectors of %d floats (%s kernel%s)\n", rows, dim, knn_backend(), tree ? ", VP-tree" : "");
+
+  KnnMatrix* query = knn_matrix_create(1, dim);
+  KnnHit* hits = malloc(sizeof(KnnHit) * k);
+  int queries = 0;
+  for (int i = 0; i < count; i++) {
+    if (image_features(pl, probes[i], compact, pool, arena, knn_row(query, 0)) != 0) continue;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int n = tree ? knn_tree_search(tree, knn_row(query, 0), k, hits) : knn_search(m, knn_row(query, 0), k, hits);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    double us = (t1.tv_sec - t0.tv_sec) * 1E6 + (t1.tv_nsec - t0.tv_nsec) * 1E-3;
+    printf("%s: %.1f us\n", probes[i], us);
+    for (int h = 0; h < n; h++) printf("  %.4f %s\n", sqrtf(hits[h].distance), inputs[image[hits[h].row]]);
+    queries++;
   }
-}
 
+  free(hits);
+  knn_matrix_free(query);
+  knn_tree_free(tree);
+  arena_free(arena);
+  free(image);
+  knn_matrix_free(m);
+  batch_inputs_free(inputs, files);
+  return queries < count;
+}
 
-Fingerprint* compute_fingerprint(Image* im, int block_size) {
-  // Generate the appropriate Sobel kernels
-  int* sobel_x;
-  int* sobel_y;
-  generate_sobel_kernels(block_size, &sobel_x, &sobel_y);
-  
-  // Apply convolution with the selected kernel size
-  Image* grad_x = ppm_convolution(im, sobel_x, block_size);
-  Image* grad_y = ppm_convolution(im, sobel_y, block_size);
+// Single image: print the orientation field, write the SVG and the
+// enhanced image next to output_prefix
+int enroll_image(const Pipeline* pl, const char* input, const char* output_prefix, Pool* pool) {
+  // Open the input image, every stage only needs its luminance
+  Plane8* im = ppm_open_grey(input, GREY_MEAN);
+  if (!im) {
+    printf("Error: Could not open image %s\n", input);
+    return 1;
+  }
 
-  // Calculate the number of blocks in the image dimensions
-  int x_blocks = im->width / block_size;
-  int y_blocks = im->height / block_size;
-  
-  // Ensure we have at least one block
-  if (x_blocks < 1) x_blocks = 1;
-  if (y_blocks < 1) y_blocks = 1;
-  
-  // Create fingerprint with the correct dimensions
-  Fingerprint* fp = create_fingerprint(x_blocks, y_blocks);
-
-  // Process each block
-  for (int i = 0; i < x_blocks; i++) {
-    for (int j = 0; j < y_blocks; j++) {
-      // Calculate the top-left corner of each block
-      int block_x = i * block_size;
-      int block_y = j * block_size;
-      
-      // Make sure the block is within bounds
-      if (block_x + block_size <= grad_x->width && block_y + block_size <= grad_y->height) {
-        // Calculate orientation for this block
-        ridge_valey_orientation(grad_x, grad_y, block_size, block_x, block_y, 
-                              &((fp->ridges)[j][i].angle), 
-                              &((fp->ridges)[j][i].coherence));
-      } else {
-        // Set default values for out-of-bounds blocks
-        (fp->ridges)[j][i].angle = 0.0;
-        (fp->ridges)[j][i].coherence = 0.0;
-      }
-    }
+  // Every allocation of the enrollment goes to one arena, released at once
+  Arena* arena = arena_create(0);
+  Enrollment res;
+  if (pipeline_run(pl, im, pool, arena, &res) != 0) {
+    printf("Error: Could not process image %s\n", input);
+    arena_free(arena);
+    plane8_free(im);
+    return 1;
   }
+  print_fingerprint_angles(res.fp);
+  print_singularities(res.singular);
+  print_minutiae(res.minutiae);
 
-  // Clean up resources
-  free(sobel_x);
-  free(sobel_y);
-  ppm_free(grad_x);
-  ppm_free(grad_y);
+  // Create output filenames
+  char svg_filename[256];
+  snprintf(svg_filename, sizeof(svg_filename), "%s.svg", output_prefix);
 
-  // Normalize the coherence values
-  normalize_coherence(fp);
+  // Draw orientation field as SVG
+  if (draw_svg(res.fp, svg_filename) == 0) printf("Saved orientation field to %s\n", svg_filename);
+
+  char enhanced_filename[256];
+  snprintf(enhanced_filename, sizeof(enhanced_filename), "%s_enhanced.pgm", output_prefix);
+  Plane8* enhanced8 = planef_to_8_in(arena, res.enhanced);
+  pgm_save(enhanced8, enhanced_filename);
+  printf("Saved enhanced image to %s\n", enhanced_filename);
+
+  char skeleton_filename[256];
+  snprintf(skeleton_filename, sizeof(skeleton_filename), "%s_skeleton.pgm", output_prefix);
+  Plane8* skeleton8 = skeleton_to_plane8(res.skeleton, arena);
+  pgm_save(skeleton8, skeleton_filename);
+  printf("Saved ridge skeleton to %s\n", skeleton_filename);
+
+  char template_filename[256];
+  snprintf(template_filename, sizeof(template_filename), "%s.fpt", output_prefix);
+  size_t template_bytes;
+  void* template = template_build(&res, 1, &template_bytes, arena);
+  if (template_save(template, template_bytes, template_filename) == 0) {
+    printf("Saved template to %s (%zu bytes)\n", template_filename, template_bytes);
+  }
 
-  return fp;
+  // Clean up
+  enrollment_free(&res);
+  arena_free(arena);
+  plane8_free(im);
+  return 0;
 }
 
-void draw_svg(Fingerprint* fp, const char* filename) {
-  int spacing = 20;
-  SVG* svg = svg_init(filename, spacing * (fp -> width), spacing * (fp -> height));
-
-  for (int i = 0; i < (fp -> width); i++) {
-    for (int j = 0; j < (fp -> height); j++) {
-      float coherence = (fp -> ridges)[j][i].coherence;
-      //if (coherence < 0.2) continue;  // Skip low coherence blocks
-      
-      int color_value = (int)round(coherence * 255);
-      unsigned int color = (color_value << 16) | (color_value << 8) | color_value;
-      
-      float angle = (fp -> ridges)[j][i].angle + M_PI / 2.;
-      // Draw line centered at block center
-      int center_x = i * spacing + spacing/2;
-      int center_y = j * spacing + spacing/2;
-      int line_length = spacing/2;
-      
-      svg_line(svg, 
-               center_x - line_length * cos(angle),
-               center_y - line_length * sin(angle),
-               center_x + line_length * cos(angle),
-               center_y + line_length * sin(angle),
-               2, color);
-    }
-  }
+// Directory or manifest: images are enrolled concurrently, one per thread
+int enroll_batch(const Pipeline* pl, const char* input, const char* out_dir, Pool* pool) {
+  int count;
+  char** inputs = batch_inputs(input, &count);
+  if (!inputs) return 1;
+
+  BatchStats stats;
+  batch_run(pl, inputs, count, out_dir, pool, &stats);
+  batch_print_stats(&stats, pool_threads(pool));
 
-  svg_close(svg);
+  batch_inputs_free(inputs, count);
+  return stats.failed > 0;
 }
 
-// Calculate local ridge frequency in a specific region
-float calculate_local_ridge_frequency(Image* im, int x, int y, float angle, int window_size) {
-  // Ensure window size is odd
-  if (window_size % 2 == 0) window_size++;
-  
-  // Half window size
-  int half_window = window_size / 2;
-  
-  // Make sure the window is within image bounds
-  if (x < half_window || y < half_window || 
-      x + half_window >= im->width || 
-      y + half_window >= im->height) {
-    return 0.0; // Return 0 for invalid regions
-  }
-  
-  // Create a projection along the direction perpendicular to ridge orientation
-  float* projection = malloc(sizeof(float) * window_size);
-  for (int i = 0; i < window_size; i++) {
-    projection[i] = 0.0;
-  }
-  
-  // Calculate the direction perpendicular to ridge orientation
-  float cos_angle = cos(angle + PI/2);
-  float sin_angle = sin(angle + PI/2);
-  
-  // Project the image along this direction
-  for (int i = -half_window; i <= half_window; i++) {
-    for (int j = -half_window; j <= half_window; j++) {
-      // Calculate the position in the projection
-      int proj_idx = (int)(i * cos_angle + j * sin_angle) + half_window;
-      
-      // Ensure the projection index is valid
-      if (proj_idx >= 0 && proj_idx < window_size) {
-        // Get the pixel value at (x+j, y+i)
-        int px = x + j;
-        int py = y + i;
-        
-        if (px >= 0 && px < im->width && py >= 0 && py < im->height) {
-          projection[proj_idx] += im->p[py][px].r;
-        }
-      }
+int main(int argc, char **argv) {
+  int block_size = 3;
+  int step = 0;   // 0: one Ridge per non-overlapping block
+  int window = 0;
+  float smooth = ORIENTATION_SMOOTH_SIGMA;
+  char* bank_file = NULL;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int batch = 0;
+  int match = 0;
+  int identify = 0;
+  int knn = 0;
+  int compact = 0;
+  char* serve_path = NULL;
+  char* gallery_path = NULL;
+
+  static struct option options[] = {
+    {"step",   required_argument, 0, 's'},
+    {"window", required_argument, 0, 'w'},
+    {"smooth", required_argument, 0, 'S'},
+    {"bank",   required_argument, 0, 'b'},
+    {"threads", required_argument, 0, 't'},
+    {"batch",  no_argument,       0, 'B'},
+    {"match",  no_argument,       0, 'M'},
+    {"identify", no_argument,     0, 'I'},
+    {"knn",    required_argument, 0, 'K'},
+    {"compact", no_argument,      0, 'C'},
+    {"serve",  required_argument, 0, 'V'},
+    {"gallery", required_argument, 0, 'G'},
+    {"help",   no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "s:w:b:t:h", options, NULL)) != -1) {
+    switch (opt) {
+      case 's': step = atoi(optarg); break;
+      case 'w': window = atoi(optarg); break;
+      case 'S': smooth = atof(optarg); break;
+      case 'b': bank_file = optarg; break;
+      case 't': threads = atoi(optarg); break;
+      case 'B': batch = 1; break;
+      case 'M': match = 1; break;
+      case 'I': identify = 1; break;
+      case 'K': knn = atoi(optarg); break;
+      case 'C': compact = 1; break;
+      case 'V': serve_path = optarg; break;
+      case 'G': gallery_path = optarg; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 1;
     }
   }
-  
-  // Normalize the projection
-  float min_val = 255.0;
-  float max_val = 0.0;
-  for (int i = 0; i < window_size; i++) {
-    if (projection[i] < min_val) min_val = projection[i];
-    if (projection[i] > max_val) max_val = projection[i];
-  }
-  
-  if (max_val - min_val < EPSILON) {
-    free(projection);
-    return 0.0; // No variation in projection
+
+  int smooth_ok = smooth >= 0 && smooth <= ORIENTATION_MAX_SMOOTH_SIGMA;
+  if (serve_path && step >= 0 && window >= 0 && smooth_ok && threads >= 1) {
+    GaborBank* bank = load_filter_bank(bank_file);
+    Pipeline* pl = pipeline_create(block_size, step, window, smooth, bank);
+    int status = serve(pl, serve_path, gallery_path, threads);
+    pipeline_free(pl);
+    gabor_bank_free(bank);
+    return status;
   }
-  
-  for (int i = 0; i < window_size; i++) {
-    projection[i] = (projection[i] - min_val) / (max_val - min_val);
+
+  if (optind >= argc || step < 0 || window < 0 || !smooth_ok || threads < 1 || knn < 0) {
+    usage(argv[0]);
+    return 1;
   }
   
-  // Find peaks in the projection
-  int* peaks = malloc(sizeof(int) * window_size);
-  int peak_count = 0;
-  
-  for (int i = 1; i < window_size - 1; i++) {
-    if (projection[i] > projection[i-1] && projection[i] > projection[i+1] && projection[i] > 0.7) {
-      peaks[peak_count++] = i;
+  char* input = argv[optind];
+
+  // Matching works on saved templates, nothing to set up
+  if (match) {
+    if (optind + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
     }
+    return match_templates(input, argv[optind + 1]);
   }
-  
-  // Calculate average distance between peaks
-  float avg_distance = 0.0;
-  if (peak_count >= 2) {
-    int total_distances = 0;
-    for (int i = 1; i < peak_count; i++) {
-      avg_distance += peaks[i] - peaks[i-1];
-      total_distances++;
-    }
-    
-    if (total_distances > 0) {
-      avg_distance /= total_distances;
-    } else {
-      avg_distance = 0.0;
+  if (identify) {
+    if (optind + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
     }
+    Pool* pool = pool_create(threads);
+    int status = identify_probes(input, argv + optind + 1, argc - optind - 1, pool);
+    pool_free(pool);
+    return status;
   }
-  
-  // Clean up
-  free(projection);
-  free(peaks);
-  
-  // Convert distance to frequency (cycles per pixel)
-  if (avg_distance > 2.0) { // Minimum reasonable ridge width
-    return 1.0 / avg_distance;
-  } else {
-    return 0.0; // Invalid frequency
+  if (knn > 0 && optind + 1 >= argc) {
+    usage(argv[0]);
+    return 1;
   }
-}
 
-void print_fingerprint_angles(Fingerprint* fp) {
-  printf("Fingerprint angles (degrees ):\n");
-  for (int i = 0; i < fp->height; i++) {
-    for (int j = 0; j < fp->width; j++) {
-      // Convert radians to degrees: degrees = radians * 180 / PI
-      float angle_degrees = (fp->ridges)[i][j].angle * 180 / M_PI;
-      printf("%03d ", (int)round(angle_degrees));
-    }
-    printf("\n");
+  // Default output prefix; batches only write images when given a directory
+  char* output = batch ? NULL : "fingerprint";
+  if (optind + 1 < argc) {
+    output = argv[optind + 1];
   }
-}
 
-// Convolution function for fingerprint images using a float kernel.
-// f: pointer to the input fingerprint image.
-// kernel: pointer to a 1D float array representing the kernel (row-major order).
-// block_size: the width and height of the (square) kernel.
-Fingerprint* fp_convolution(Fingerprint* f, float* kernel, int block_size) {
-    if (!f || !kernel || block_size <= 0 || block_size > f->width || block_size > f->height) {
-        return NULL; // Invalid inputs
-    }
-    
-    int new_width = f->width - block_size + 1;
-    int new_height = f->height - block_size + 1;
-    
-    // Create new fingerprint image of the resulting dimensions.
-    Fingerprint* result = create_fingerprint(new_width, new_height);
-    if (!result) {
-        fprintf(stderr, "Unable to allocate fingerprint image for convolution result.\n");
-        return NULL;
-    }
-    
-    for (int y = 0; y < new_height; y++) {
-        for (int x = 0; x < new_width; x++) {
-            float sum_angle = 0.0f;
-            float sum_coherence = 0.0f;
-            // Convolve the kernel over the image window.
-            for (int j = 0; j < block_size; j++) {
-                for (int i = 0; i < block_size; i++) {
-                    int img_x = x + i;
-                    int img_y = y + j;
-                    sum_angle += kernel[j * block_size + i] * f->ridges[img_y][img_x].angle;
-                    sum_coherence += kernel[j * block_size + i] * f->ridges[img_y][img_x].coherence;
-                }
-            }
-            // Round and clamp the values to 0-255.
-            int conv_val_angle = (int)round(sum_angle);
-            if (conv_val_angle < 0) conv_val_angle = 0;
-            if (conv_val_angle > 255) conv_val_angle = 255;
-            
-            int conv_val_coh = (int)round(sum_coherence);
-            if (conv_val_coh < 0) conv_val_coh = 0;
-            if (conv_val_coh > 255) conv_val_coh = 255;
-            
-            result->ridges[y][x].angle = conv_val_angle;
-            result->ridges[y][x].coherence = conv_val_coh;
-        }
-    }
-    
-    return result;
-}
+  // Kernels and filter bank are built once, whatever the number of images
+  GaborBank* bank = load_filter_bank(bank_file);
+  Pipeline* pl = pipeline_create(block_size, step, window, smooth, bank);
 
-// Apply a Gabor filter on the fingerprint image.
-// fingerprint: pointer to the input fingerprint image.
-// blocksize: the size of the (square) block/kernel to use for the Gabor filter.
-Fingerprint* apply_gabor_filter(Fingerprint* fingerprint, int blocksize) {
-    if (!fingerprint) {
-        return NULL;
-    }
-    
-    // --- Define your Gabor parameters. ---
-    // For a more adaptive solution you would compute these from the fingerprint's ridge information.
-    float angle     = PI / 4.0f;   // Example: 45 degrees in radians.
-    float frequency = 0.1f;        // Example: cycles per pixel.
-    float sigma_x   = 3.0f;
-    float sigma_y   = 3.0f;
-    
-    // --- Create the Gabor kernel as a 2D float array ---
-    float** gabor_kernel_2d = create_gabor_kernel(blocksize, angle, frequency, sigma_x, sigma_y);
-    if (!gabor_kernel_2d) {
-        fprintf(stderr, "Failed to create Gabor kernel.\n");
-        return NULL;
-    }
-    
-    // --- Convert the 2D kernel to a 1D array in row-major order ---
-    float* kernel_1d = malloc(sizeof(float) * blocksize * blocksize);
-    
-    for (int y = 0; y < blocksize; y++) {
-        for (int x = 0; x < blocksize; x++) {
-            kernel_1d[y * blocksize + x] = gabor_kernel_2d[y][x];
-        }
-    }
-    
-    // --- Apply convolution using the Gabor kernel ---
-    Fingerprint* filtered = fp_convolution(fingerprint, kernel_1d, blocksize);
-    
-    free(kernel_1d);
-    return filtered;
-}
+  // Every stage splits its work over the same threads; the output does
+  // not depend on how many there are
+  Pool* pool = pool_create(threads);
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("Usage: %s <input_image> [output_prefix]\n", argv[0]);
-    return 1;
-  }
-  
-  // Default output prefix
-  char* output_prefix = "fingerprint";
-  if (argc >= 3) {
-    output_prefix = argv[2];
-  }
-  
-  // Open the input image
-  Image* im = ppm_open(argv[1]);
-  if (!im) {
-    printf("Error: Could not open image %s\n", argv[1]);
-    return 1;
+  int status;
+  if (knn > 0) {
+    status = knn_probes(pl, input, argv + optind + 1, argc - optind - 1, knn, compact, pool);
+  } else if (batch) {
+    status = enroll_batch(pl, input, output, pool);
+  } else {
+    status = enroll_image(pl, input, output, pool);
   }
-  
-  int block_size = 3;
 
-  // Compute fingerprint orientation field
-  Fingerprint* fp = compute_fingerprint(im, block_size);
-  fp = apply_gabor_filter(fp, 3);
-  print_fingerprint_angles(fp);
-  
-  // Create output filenames
-  char svg_filename[256];
-  snprintf(svg_filename, sizeof(svg_filename), "%s.svg", output_prefix);
+  pool_free(pool);
+  pipeline_free(pl);
+  gabor_bank_free(bank);
 
-  // Draw orientation field as SVG
-  draw_svg(fp, svg_filename);
-  printf("Saved orientation field to %s\n", svg_filename);
-  
-  // Clean up
-  free_fingerprint(fp);
-  ppm_free(im);
-  
-  printf("Processing complete.\n");
-  return 0;
+  if (status == 0) printf("Processing complete.\n");
+  return status;
 }
@@ -0,0 +1,275 @@
+#include "match.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Candidate alignment: minutia `probe` of the probe onto `ref` of the
+// reference
+typedef struct match_pair {
+  int probe;
+  int ref;
+  int agree;  // neighbours the descriptors share
+  int cost;   // sum of their differences
+} MatchPair;
+
+// a - b folded into (-PI, PI], for a - b within (-3 PI, 3 PI]
+static inline float angle_diff(float a, float b) {
+  float d = a - b;
+  if (d > (float)PI) d -= (float)(2 * PI);
+  else if (d <= (float)-PI) d += (float)(2 * PI);
+  return d;
+}
+
+static uint8_t quantize_angle(float angle) {
+  return (uint8_t)((long)lroundf(angle / (2 * PI) * 256) & 255);
+}
+
+// Descriptors of the minutiae of t, whose angles are `angles`
+static void describe(MatchTemplate* t, const uint8_t* angles) {
+  const MatchMinutia* m = t->minutiae;
+  for (int i = 0; i < t->count; i++) {
+    int near[MATCH_NEIGHBOURS];
+    float dist[MATCH_NEIGHBOURS];
+    int n = 0;
+
+    for (int j = 0; j < t->count; j++) {
+      if (j == i) continue;
+      float dx = m[j].x - m[i].x, dy = m[j].y - m[i].y;
+      float d = sqrtf(dx * dx + dy * dy);
+      if (n == MATCH_NEIGHBOURS && d >= dist[n - 1]) continue;
+
+      // Insertion into the sorted list of the nearest so far
+      int k = n < MATCH_NEIGHBOURS ? n++ : n - 1;
+      while (k > 0 && dist[k - 1] > d) {
+        dist[k] = dist[k - 1];
+        near[k] = near[k - 1];
+        k--;
+      }
+      dist[k] = d;
+      near[k] = j;
+    }
+
+    // Far neighbours are clamped short of 255 so that they never agree
+    // with a missing one
+    for (int k = 0; k < n; k++) {
+      const MatchMinutia* q = &m[near[k]];
+      size_t at = (size_t)k * t->lanes + i;
+      t->distance[at] = dist[k] < 240 ? lroundf(dist[k]) : 240;
+      t->position[at] = quantize_angle(atan2f(q->y - m[i].y, q->x - m[i].x)) - angles[i];
+      t->direction[at] = angles[near[k]] - angles[i];
+    }
+  }
+}
+
+// Minutiae of `t` with their descriptors and grid, allocated in `arena`
+// (heap when NULL; only heap templates are passed to match_template_free)
+MatchTemplate* match_prepare(const TemplateView* t, Arena* arena) {
+  int count = t->header->minutiae;
+  MatchTemplate* res = arena_alloc(arena, sizeof(MatchTemplate));
+  res->count = count;
+  res->lanes = (count + MATCH_LANES - 1) / MATCH_LANES * MATCH_LANES;
+  res->minutiae = arena_alloc(arena, sizeof(MatchMinutia) * (count > 0 ? count : 1));
+
+  // Padding lanes and missing neighbours never agree
+  size_t n = (size_t)MATCH_NEIGHBOURS * (res->lanes > 0 ? res->lanes : 1);
+  res->distance = arena_alloc(arena, 3 * n);
+  res->position = res->distance + n;
+  res->direction = res->position + n;
+  memset(res->distance, 255, n);
+  memset(res->position, 0, 2 * n);
+
+  float min_x = INFINITY, min_y = INFINITY, max_x = -INFINITY, max_y = -INFINITY;
+  for (int i = 0; i < count; i++) {
+    MatchMinutia* m = &res->minutiae[i];
+    m->x = t->minutiae[i].x;
+    m->y = t->minutiae[i].y;
+    m->angle = template_minutia_angle(&t->minutiae[i]);
+    if (m->x < min_x) min_x = m->x;
+    if (m->y < min_y) min_y = m->y;
+    if (m->x > max_x) max_x = m->x;
+    if (m->y > max_y) max_y = m->y;
+  }
+
+  ArenaMark mark = arena_mark(arena);
+  uint8_t* angles = arena_alloc(arena, count > 0 ? count : 1);
+  for (int i = 0; i < count; i++) angles[i] = t->minutiae[i].angle;
+  describe(res, angles);
+  arena_release(arena, angles);
+  arena_rewind(arena, mark);
+
+  if (count == 0) min_x = min_y = max_x = max_y = 0;
+  res->origin_x = min_x;
+  res->origin_y = min_y;
+  res->grid_width = (int)((max_x - min_x) / MATCH_DISTANCE) + 1;
+  res->grid_height = (int)((max_y - min_y) / MATCH_DISTANCE) + 1;
+
+  // Counting sort of the minutiae by cell
+  int cells = res->grid_width * res->grid_height;
+  res->start = arena_calloc(arena, cells + 1, sizeof(int));
+  res->items = arena_alloc(arena, sizeof(int) * (count > 0 ? count : 1));
+  for (int i = 0; i < count; i++) {
+    int u = (int)((res->minutiae[i].x - min_x) / MATCH_DISTANCE);
+    int v = (int)((res->minutiae[i].y - min_y) / MATCH_DISTANCE);
+    res->start[v * res->grid_width + u + 1]++;
+  }
+  for (int c = 0; c < cells; c++) res->start[c + 1] += res->start[c];
+  mark = arena_mark(arena);
+  int* fill = arena_alloc(arena, sizeof(int) * cells);
+  memcpy(fill, res->start, sizeof(int) * cells);
+  for (int i = 0; i < count; i++) {
+    int u = (int)((res->minutiae[i].x - min_x) / MATCH_DISTANCE);
+    int v = (int)((res->minutiae[i].y - min_y) / MATCH_DISTANCE);
+    res->items[fill[v * res->grid_width + u]++] = i;
+  }
+  arena_release(arena, fill);
+  arena_rewind(arena, mark);
+
+  return res;
+}
+
+void match_template_free(MatchTemplate* t) {
+  if (!t) return;
+  free(t->minutiae);
+  free(t->distance);
+  free(t->start);
+  free(t->items);
+  free(t);
+}
+
+// One neighbour (d, p, t) of a probe minutia against the descriptors of
+// every reference minutia: agree[j] counts the neighbours that have a
+// match in descriptor j, cost[j] adds the difference of the closest one.
+// The loops run over whole rows of lanes and vectorize.
+static void neighbour_agreement(uint8_t* restrict agree, uint16_t* restrict cost, uint16_t* restrict best, const uint8_t* restrict distance, const uint8_t* restrict position, const uint8_t* restrict direction, int d, int p, int t, int lanes) {
+  for (int j = 0; j < lanes; j++) best[j] = UINT16_MAX;
+
+  for (int l = 0; l < MATCH_NEIGHBOURS; l++) {
+    const uint8_t* dl = distance + (size_t)l * lanes;
+    const uint8_t* pl = position + (size_t)l * lanes;
+    const uint8_t* tl = direction + (size_t)l * lanes;
+    for (int j = 0; j < lanes; j += MATCH_LANES) {
+      for (int x = 0; x < MATCH_LANES; x++) {
+        int dd = abs(dl[j + x] - d);
+        int dp = abs((int8_t)(pl[j + x] - p));
+        int dt = abs((int8_t)(tl[j + x] - t));
+        int ok = (dd < MATCH_NEIGHBOUR_DISTANCE) & (dp < MATCH_NEIGHBOUR_ANGLE) & (dt < MATCH_NEIGHBOUR_ANGLE);
+        int c = ok ? dd + dp + dt : UINT16_MAX;
+        best[j + x] = c < best[j + x] ? c : best[j + x];
+      }
+    }
+  }
+
+  for (int j = 0; j < lanes; j += MATCH_LANES) {
+    for (int x = 0; x < MATCH_LANES; x++) {
+      int found = best[j + x] != UINT16_MAX;
+      agree[j + x] += found;
+      cost[j + x] += found ? best[j + x] : 0;
+    }
+  }
+}
+
+static int compare_pairs(const void* a, const void* b) {
+  const MatchPair* pa = a;
+  const MatchPair* pb = b;
+  if (pa->agree != pb->agree) return pb->agree - pa->agree;
+  return pa->cost - pb->cost;
+}
+
+// Probe minutiae that land on a free reference minutia once the pair is
+// aligned (rotation and translation). used[] holds `stamp` for the
+// reference minutiae taken by this alignment. Gives up, returning at most
+// `bound`, once it cannot do better than `bound`.
+static int aligned_count(const MatchTemplate* probe, const MatchTemplate* ref, const MatchPair* pair, int* used, int stamp, int bound) {
+  const MatchMinutia* pa = &probe->minutiae[pair->probe];
+  const MatchMinutia* rb = &ref->minutiae[pair->ref];
+  float rotation = angle_diff(rb->angle, pa->angle);
+  float c = cosf(rotation), s = sinf(rotation);
+  float d2 = MATCH_DISTANCE * MATCH_DISTANCE;
+  int count = 0;
+
+  for (int i = 0; i < probe->count && count + probe->count - i > bound; i++) {
+    const MatchMinutia* m = &probe->minutiae[i];
+    float dx = m->x - pa->x, dy = m->y - pa->y;
+    float x = c * dx - s * dy + rb->x;
+    float y = s * dx + c * dy + rb->y;
+    float angle = m->angle + rotation;
+
+    int u = (int)floorf((x - ref->origin_x) / MATCH_DISTANCE);
+    int v = (int)floorf((y - ref->origin_y) / MATCH_DISTANCE);
+    int best = -1;
+    float best_d2 = d2;
+    for (int cv = v - 1; cv <= v + 1; cv++) {
+      if (cv < 0 || cv >= ref->grid_height) continue;
+      for (int cu = u - 1; cu <= u + 1; cu++) {
+        if (cu < 0 || cu >= ref->grid_width) continue;
+        int cell = cv * ref->grid_width + cu;
+        for (int k = ref->start[cell]; k < ref->start[cell + 1]; k++) {
+          int j = ref->items[k];
+          if (used[j] == stamp) continue;
+          const MatchMinutia* r = &ref->minutiae[j];
+          float ex = r->x - x, ey = r->y - y;
+          float e2 = ex * ex + ey * ey;
+          if (e2 >= best_d2 || fabsf(angle_diff(r->angle, angle)) >= MATCH_ANGLE) continue;
+          best_d2 = e2;
+          best = j;
+        }
+      }
+    }
+
+    if (best >= 0) {
+      used[best] = stamp;
+      count++;
+    }
+  }
+  return count;
+}
+
+// Similarity of two templates in [0, 1]: n² / (probe count * ref count)
+// for the largest number n of minutiae paired by one alignment. Only
+// alignments of pairs whose local descriptors agree are tried, the best
+// MATCH_MAX_PAIRS of them; after each alignment, reference minutiae are
+// looked up in the 3x3 grid cells around each moved probe minutia.
+// Temporaries live in `scratch` (heap when NULL).
+float match_score(const MatchTemplate* probe, const MatchTemplate* ref, Arena* scratch) {
+  if (probe->count == 0 || ref->count == 0) return 0;
+
+  ArenaMark mark = arena_mark(scratch);
+  int lanes = ref->lanes;
+  MatchPair* pairs = arena_alloc(scratch, sizeof(MatchPair) * probe->count * ref->count);
+  int* used = arena_calloc(scratch, ref->count, sizeof(int));
+  uint16_t* cost = arena_alloc(scratch, sizeof(uint16_t) * 2 * lanes);
+  uint16_t* closest = cost + lanes;
+  uint8_t* agree = arena_alloc(scratch, lanes);
+
+  int n_pairs = 0;
+  for (int i = 0; i < probe->count; i++) {
+    memset(agree, 0, lanes);
+    memset(cost, 0, sizeof(uint16_t) * lanes);
+    for (int k = 0; k < MATCH_NEIGHBOURS; k++) {
+      size_t at = (size_t)k * probe->lanes + i;
+      if (probe->distance[at] == 255) break;
+      neighbour_agreement(agree, cost, closest, ref->distance, ref->position, ref->direction,
+                          probe->distance[at], probe->position[at], probe->direction[at], lanes);
+    }
+
+    for (int j = 0; j < ref->count; j++) {
+      if (agree[j] < MATCH_MIN_NEIGHBOURS) continue;
+      pairs[n_pairs++] = (MatchPair){ i, j, agree[j], cost[j] };
+    }
+  }
+  qsort(pairs, n_pairs, sizeof(MatchPair), compare_pairs);
+  if (n_pairs > MATCH_MAX_PAIRS) n_pairs = MATCH_MAX_PAIRS;
+
+  int best = 0;
+  for (int k = 0; k < n_pairs; k++) {
+    int count = aligned_count(probe, ref, &pairs[k], used, k + 1, best);
+    if (count > best) best = count;
+  }
+
+  arena_release(scratch, agree);
+  arena_release(scratch, cost);
+  arena_release(scratch, used);
+  arena_release(scratch, pairs);
+  arena_rewind(scratch, mark);
+  return (float)best * best / ((float)probe->count * ref->count);
+}
@@ -0,0 +1,223 @@
+#include "minutiae.h"
+#include "fingerprint.h"
+#include "skeleton.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The 8 neighbours of a pixel, as bits of a ring code (see ring_code):
+// NW, N, NE, W, E, SW, S, SE
+static const int ring_dx[8] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+static const int ring_dy[8] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+
+// Ring bits in clockwise order, starting north
+static const int ring_order[8] = { 1, 2, 4, 7, 6, 5, 3, 0 };
+
+// Crossing number of every ring code: the number of background to ridge
+// transitions met when going once around the pixel
+static uint8_t crossing_number[256];
+
+__attribute__((constructor))
+static void minutiae_build_tables(void) {
+  for (int ring = 0; ring < 256; ring++) {
+    int cn = 0;
+    for (int k = 0; k < 8; k++) {
+      int a = ring >> ring_order[k] & 1;
+      int b = ring >> ring_order[(k + 1) % 8] & 1;
+      cn += !a && b;
+    }
+    crossing_number[ring] = cn;
+  }
+}
+
+// The 8 neighbours of a ridge_neighbourhood code, centre bit dropped
+static inline unsigned ring_code(unsigned code) {
+  return (code & 0xf) | (code >> 5) << 4;
+}
+
+static inline int is_near(int ax, int ay, int bx, int by) {
+  return abs(ax - bx) <= 1 && abs(ay - by) <= 1;
+}
+
+// Follow the skeleton from (x, y) through its neighbour (nx, ny) for up to
+// MINUTIAE_TRACE pixels. Stops early at a line end, a fork or the frame.
+// Returns the vector from (x, y) to the last pixel reached.
+static void trace(const BlockMask* sk, int x, int y, int nx, int ny, float* vx, float* vy) {
+  int px = x, py = y, cx = nx, cy = ny;
+
+  for (int k = 1; k < MINUTIAE_TRACE; k++) {
+    if (cx < 1 || cy < 1 || cx >= sk->width - 1 || cy >= sk->height - 1) break;
+    unsigned ring = ring_code(ridge_neighbourhood(sk, cx, cy));
+
+    // Next pixel: a neighbour that does not touch the previous one, or
+    // failing that any neighbour other than the previous two pixels
+    int next = -1, loose = -1, forks = 0;
+    for (int b = 0; b < 8; b++) {
+      if (!(ring >> b & 1)) continue;
+      int qx = cx + ring_dx[b], qy = cy + ring_dy[b];
+      if ((qx == px && qy == py) || (qx == x && qy == y)) continue;
+      if (!is_near(qx, qy, px, py)) {
+        if (next < 0) next = b;
+        forks++;
+      } else if (loose < 0) {
+        loose = b;
+      }
+    }
+    if (forks > 1) break;
+    if (next < 0) next = loose;
+    if (next < 0) break;
+
+    px = cx;
+    py = cy;
+    cx += ring_dx[next];
+    cy += ring_dy[next];
+  }
+
+  *vx = cx - x;
+  *vy = cy - y;
+}
+
+// Orientation of the block, turned to point the same way as (vx, vy)
+static float minutia_angle(float ridge_angle, float vx, float vy) {
+  float angle = ridge_angle;
+  if (cosf(angle) * vx + sinf(angle) * vy < 0) angle += PI;
+  if (angle >= 2 * PI) angle -= 2 * PI;
+  if (angle < 0) angle += 2 * PI;
+  return angle;
+}
+
+// Ending: the ridge leaves the pixel through its only neighbour run, the
+// direction points from the ridge out of the ending. Bifurcation: the
+// direction points from the stem into the opening between the two arms,
+// the arms being the two branches closest in angle.
+static float minutia_direction(const BlockMask* sk, int x, int y, unsigned ring, int type, float ridge_angle) {
+  float bx[3], by[3];
+  int branches = 0;
+  for (int k = 0; k < 8 && branches < 3; k++) {
+    int a = ring >> ring_order[k] & 1;
+    int b = ring >> ring_order[(k + 1) % 8] & 1;
+    if (a || !b) continue;
+    int bit = ring_order[(k + 1) % 8];
+    trace(sk, x, y, x + ring_dx[bit], y + ring_dy[bit], &bx[branches], &by[branches]);
+    float len = sqrtf(bx[branches] * bx[branches] + by[branches] * by[branches]);
+    bx[branches] /= len;
+    by[branches] /= len;
+    branches++;
+  }
+
+  if (type == MINUTIA_ENDING) return minutia_angle(ridge_angle, -bx[0], -by[0]);
+
+  // The stem is the branch left out of the closest pair
+  int stem = 0;
+  float best = -2;
+  for (int k = 0; k < 3; k++) {
+    int a = (k + 1) % 3, b = (k + 2) % 3;
+    float dot = bx[a] * bx[b] + by[a] * by[b];
+    if (dot > best) {
+      best = dot;
+      stem = k;
+    }
+  }
+  return minutia_angle(ridge_angle, -bx[stem], -by[stem]);
+}
+
+// Foreground block of the pixel whose 8 neighbours are foreground too,
+// so that the skeleton around it is not cut by the segmentation
+static int interior(const BlockMask* mask, int i, int j) {
+  if (!mask) return 1;
+  for (int v = j - 1; v <= j + 1; v++) {
+    for (int u = i - 1; u <= i + 1; u++) {
+      if (u < 0 || v < 0 || u >= mask->width || v >= mask->height) continue;
+      if (!mask_get(mask, u, v)) return 0;
+    }
+  }
+  return 1;
+}
+
+// One scan of the skeleton, 64 pixels at a time: returns the number of
+// candidate minutiae and, when `out` is not NULL, stores them there
+static int scan(const BlockMask* sk, const Fingerprint* fp, const BlockMask* mask, int block_size, Minutia* out) {
+  int count = 0;
+
+  for (int y = MINUTIAE_BORDER; y < sk->height - MINUTIAE_BORDER; y++) {
+    int j = y / block_size;
+    if (j >= fp->height) j = fp->height - 1;
+    const uint64_t* row = sk->bits + (size_t)y * sk->words;
+
+    for (int w = 0; w < sk->words; w++) {
+      uint64_t bits = row[w];
+      while (bits) {
+        int x = w * 64 + __builtin_ctzll(bits);
+        bits &= bits - 1;
+        if (x < MINUTIAE_BORDER || x >= sk->width - MINUTIAE_BORDER) continue;
+
+        unsigned ring = ring_code(ridge_neighbourhood(sk, x, y));
+        int type = crossing_number[ring];
+        if (type != MINUTIA_ENDING && type != MINUTIA_BIFURCATION) continue;
+
+        int i = x / block_size;
+        if (i >= fp->width) i = fp->width - 1;
+        if (!interior(mask, i, j)) continue;
+
+        const Ridge* ridge = &(fp->ridges)[j][i];
+        int quality = (int)lroundf(ridge->coherence * 255);
+        if (quality > 255) quality = 255;
+        if (quality < MINUTIAE_MIN_QUALITY) continue;
+
+        if (out) {
+          Minutia* m = &out[count];
+          m->x = x;
+          m->y = y;
+          m->type = type;
+          m->quality = quality;
+          m->angle = minutia_direction(sk, x, y, ring, type, ridge->angle);
+        }
+        count++;
+      }
+    }
+  }
+
+  return count;
+}
+
+// Ridge endings and bifurcations of a one pixel wide skeleton, found with
+// a crossing number table over the packed rows. Minutiae near the image
+// border, near the background of `mask` (NULL: none) or in blocks of low
+// coherence are skipped; pairs closer than MINUTIAE_MIN_DISTANCE are
+// dropped. Blocks of fp are block_size pixels wide, its last row and
+// column also cover what the grid leaves over. The result is allocated in
+// `arena` (heap when NULL; only heap results are passed to minutiae_free).
+Minutiae* minutiae_extract(const BlockMask* skeleton, const Fingerprint* fp, const BlockMask* mask, int block_size, Arena* arena) {
+  Minutiae* res = arena_alloc(arena, sizeof(Minutiae));
+  int n = scan(skeleton, fp, mask, block_size, NULL);
+  res->points = arena_alloc(arena, sizeof(Minutia) * (n > 0 ? n : 1));
+  scan(skeleton, fp, mask, block_size, res->points);
+
+  // Points come in scan order, so close pairs are found by sweeping down
+  // the rows
+  ArenaMark mark = arena_mark(arena);
+  uint8_t* drop = arena_calloc(arena, n > 0 ? n : 1, 1);
+  int d2 = MINUTIAE_MIN_DISTANCE * MINUTIAE_MIN_DISTANCE;
+  for (int a = 0; a < n; a++) {
+    const Minutia* p = &res->points[a];
+    for (int b = a + 1; b < n && res->points[b].y - p->y < MINUTIAE_MIN_DISTANCE; b++) {
+      int dx = res->points[b].x - p->x, dy = res->points[b].y - p->y;
+      if (dx * dx + dy * dy < d2) drop[a] = drop[b] = 1;
+    }
+  }
+
+  res->count = 0;
+  for (int a = 0; a < n; a++) {
+    if (!drop[a]) res->points[res->count++] = res->points[a];
+  }
+
+  arena_release(arena, drop);
+  arena_rewind(arena, mark);
+  return res;
+}
+
+void minutiae_free(Minutiae* m) {
+  if (!m) return;
+  free(m->points);
+  free(m);
+}
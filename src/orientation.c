@@ -0,0 +1,298 @@
+#include "orientation.h"
+#include "fingerprint.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EPSILON 1E-6
+
+// Ridge orientation and coherence from the averaged structure tensor
+// [gxx gxy; gxy gyy] of a window.
+void tensor_orientation(float gxx, float gxy, float gyy, float* angle, float* coherence) {
+  // The dominant gradient direction is orthogonal to the ridges
+  *angle = 0.5 * atan2(2.0 * gxy, gxx - gyy) + PI/2.0;
+
+  float numerator = sqrt((gxx - gyy) * (gxx - gyy) + 4 * gxy * gxy);
+  float denominator = gxx + gyy;
+
+  if (denominator > EPSILON) {
+    *coherence = numerator / denominator;
+  } else {
+    *coherence = 0.0;
+  }
+}
+
+typedef struct tensor_job {
+  const PlaneF* grad_x;
+  const PlaneF* grad_y;
+  int block_size;
+  Fingerprint* fp;
+  const BlockMask* mask;
+  Pool* pool;
+} TensorJob;
+
+// Block row j of the field
+static void tensor_block_row(void* ctx, int j, int worker) {
+  const TensorJob* job = ctx;
+  const PlaneF* grad_x = job->grad_x;
+  const PlaneF* grad_y = job->grad_y;
+  int block_size = job->block_size;
+  int width = grad_x->width;
+  float norm = 1.0 / (block_size * block_size + EPSILON);
+
+  // Columns of the foreground blocks of this row
+  int first = job->fp->width, last = -1;
+  for (int i = 0; i < job->fp->width; i++) {
+    if (!mask_get(job->mask, i, j)) continue;
+    if (i < first) first = i;
+    last = i;
+  }
+  int x0 = first * block_size;
+  int x1 = (last + 1) * block_size;
+  if (x1 > width) x1 = width;
+
+  int block_y = j * block_size;
+  int rows_fit = last >= 0 && block_y + block_size <= grad_y->height;
+
+  Arena* scratch = pool_scratch(job->pool, worker);
+  ArenaMark mark = arena_mark(scratch);
+  float* col_xx = arena_alloc(scratch, sizeof(float) * 3 * width);
+  float* col_xy = col_xx + width;
+  float* col_yy = col_xy + width;
+
+  if (rows_fit) {
+    memset(col_xx, 0, sizeof(float) * width);
+    memset(col_xy, 0, sizeof(float) * width);
+    memset(col_yy, 0, sizeof(float) * width);
+
+    for (int r = 0; r < block_size; r++) {
+      const float* restrict gx = planef_row(grad_x, block_y + r);
+      const float* restrict gy = planef_row(grad_y, block_y + r);
+      float* restrict xx = col_xx;
+      float* restrict xy = col_xy;
+      float* restrict yy = col_yy;
+      for (int x = x0; x < x1; x++) {
+        xx[x] += gx[x] * gx[x];
+        xy[x] += gx[x] * gy[x];
+        yy[x] += gy[x] * gy[x];
+      }
+    }
+  }
+
+  for (int i = 0; i < job->fp->width; i++) {
+    int block_x = i * block_size;
+    Ridge* ridge = &(job->fp->ridges)[j][i];
+
+    if (!rows_fit || block_x + block_size > width || !mask_get(job->mask, i, j)) {
+      ridge->angle = 0.0;
+      ridge->coherence = 0.0;
+      continue;
+    }
+
+    float gxx = 0, gxy = 0, gyy = 0;
+    for (int x = block_x; x < block_x + block_size; x++) {
+      gxx += col_xx[x];
+      gxy += col_xy[x];
+      gyy += col_yy[x];
+    }
+
+    tensor_orientation(gxx * norm, gxy * norm, gyy * norm, &ridge->angle, &ridge->coherence);
+  }
+
+  arena_release(scratch, col_xx);
+  arena_rewind(scratch, mark);
+}
+
+// Fill the whole orientation field of `fp` (one Ridge per non-overlapping
+// block of block_size pixels) in a single pass over the gradients.
+// Gxx, Gxy and Gyy are accumulated together: each row of a block row adds
+// its products into per-column sums (a contiguous, branch-free loop the
+// compiler vectorizes), then each block reduces its own columns.
+// Block rows are independent and run over `pool` (may be NULL).
+// Blocks that do not fit in the gradient planes, and background blocks of
+// `mask` (NULL: none), get a zero Ridge; only foreground columns are summed.
+void structure_tensor_field(const PlaneF* grad_x, const PlaneF* grad_y, int block_size, Fingerprint* fp, const BlockMask* mask, Pool* pool) {
+  TensorJob job = { grad_x, grad_y, block_size, fp, mask, pool };
+  pool_run(pool, fp->height, tensor_block_row, &job);
+}
+
+// The tables are allocated in `arena`, or on the heap when it is NULL
+// (only heap tables are passed to tensor_sat_free)
+TensorSat* tensor_sat_create(const PlaneF* grad_x, const PlaneF* grad_y, Arena* arena) {
+  TensorSat* sat = arena_alloc(arena, sizeof(TensorSat));
+  sat->width = grad_x->width;
+  sat->height = grad_x->height;
+
+  size_t cols = sat->width + 1;
+  size_t n = cols * (sat->height + 1);
+  sat->xx = arena_alloc(arena, sizeof(double) * n);
+  sat->xy = arena_alloc(arena, sizeof(double) * n);
+  sat->yy = arena_alloc(arena, sizeof(double) * n);
+
+  // First row and column are zero so windows touching the border need
+  // no special case
+  memset(sat->xx, 0, sizeof(double) * cols);
+  memset(sat->xy, 0, sizeof(double) * cols);
+  memset(sat->yy, 0, sizeof(double) * cols);
+
+  for (int y = 0; y < sat->height; y++) {
+    const float* gx = planef_row(grad_x, y);
+    const float* gy = planef_row(grad_y, y);
+    double* above_xx = sat->xx + y * cols;
+    double* above_xy = sat->xy + y * cols;
+    double* above_yy = sat->yy + y * cols;
+    double* xx = above_xx + cols;
+    double* xy = above_xy + cols;
+    double* yy = above_yy + cols;
+
+    // Running row sums plus the table entry just above
+    double run_xx = 0, run_xy = 0, run_yy = 0;
+    xx[0] = xy[0] = yy[0] = 0;
+    for (int x = 0; x < sat->width; x++) {
+      run_xx += gx[x] * gx[x];
+      run_xy += gx[x] * gy[x];
+      run_yy += gy[x] * gy[x];
+      xx[x + 1] = above_xx[x + 1] + run_xx;
+      xy[x + 1] = above_xy[x + 1] + run_xy;
+      yy[x + 1] = above_yy[x + 1] + run_yy;
+    }
+  }
+
+  return sat;
+}
+
+void tensor_sat_free(TensorSat* sat) {
+  if (!sat) return;
+  free(sat->xx);
+  free(sat->xy);
+  free(sat->yy);
+  free(sat);
+}
+
+// Average tensor over the window [x0, x1) x [y0, y1), clipped to the
+// table, in O(1) whatever the window size.
+void tensor_sat_window(const TensorSat* sat, int x0, int y0, int x1, int y1, float* gxx, float* gxy, float* gyy) {
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > sat->width) x1 = sat->width;
+  if (y1 > sat->height) y1 = sat->height;
+
+  if (x1 <= x0 || y1 <= y0) {
+    *gxx = *gxy = *gyy = 0;
+    return;
+  }
+
+  size_t cols = sat->width + 1;
+  size_t a = y0 * cols + x0, b = y0 * cols + x1;
+  size_t c = y1 * cols + x0, d = y1 * cols + x1;
+  double norm = 1.0 / ((double)(x1 - x0) * (y1 - y0) + EPSILON);
+
+  *gxx = (sat->xx[d] - sat->xx[b] - sat->xx[c] + sat->xx[a]) * norm;
+  *gxy = (sat->xy[d] - sat->xy[b] - sat->xy[c] + sat->xy[a]) * norm;
+  *gyy = (sat->yy[d] - sat->yy[b] - sat->yy[c] + sat->yy[a]) * norm;
+}
+
+typedef struct dense_job {
+  const TensorSat* sat;
+  int window;
+  int step;
+  Fingerprint* fp;
+  const BlockMask* mask;
+} DenseJob;
+
+static void dense_row(void* ctx, int j, int worker) {
+  const DenseJob* job = ctx;
+  int half = job->window / 2, step = job->step;
+  int y0 = j * step + step / 2 - half;
+
+  for (int i = 0; i < job->fp->width; i++) {
+    Ridge* ridge = &(job->fp->ridges)[j][i];
+    if (!mask_get(job->mask, i, j)) {
+      ridge->angle = 0.0;
+      ridge->coherence = 0.0;
+      continue;
+    }
+
+    int x0 = i * step + step / 2 - half;
+    float gxx, gxy, gyy;
+    tensor_sat_window(job->sat, x0, y0, x0 + job->window, y0 + job->window, &gxx, &gxy, &gyy);
+    tensor_orientation(gxx, gxy, gyy, &ridge->angle, &ridge->coherence);
+  }
+}
+
+// Sliding-window orientation field: Ridge (i, j) describes the window of
+// `window` pixels centred on pixel (i * step + step / 2, j * step + step / 2).
+// step = 1 gives a per-pixel field; step = window gives back the block grid.
+// Windows are clipped at the image border instead of being dropped.
+// Background cells of `mask` (NULL: none) get a zero Ridge.
+void dense_orientation_field(const TensorSat* sat, int window, int step, Fingerprint* fp, const BlockMask* mask, Pool* pool) {
+  DenseJob job = { sat, window, step, fp, mask };
+  pool_run(pool, fp->height, dense_row, &job);
+}
+
+// Gaussian smoothing of the orientation field, sigma in cells. Angles wrap
+// at PI, so they cannot be averaged directly: each Ridge becomes the
+// vector (cos 2a, sin 2a) weighted by its coherence, both components go
+// through a separable Gaussian (the convolve engine and its vector row
+// kernels), and the smoothed angle is read back from their direction.
+// Background cells of `mask` (NULL: none) have no weight and keep their
+// zero Ridge; coherence is left as it was. The temporaries live in
+// `arena` (heap when NULL).
+void orientation_smooth(Fingerprint* fp, const BlockMask* mask, float sigma, Pool* pool, Arena* arena) {
+  if (!(sigma > 0)) return;
+
+  // Taps beyond the field only ever meet its zero border
+  int extent = fp->width > fp->height ? fp->width : fp->height;
+  if (sigma > extent) sigma = extent;
+  int radius = (int)ceilf(3 * sigma);
+  if (radius > extent) radius = extent;
+  int size = 2 * radius + 1;
+
+  ArenaMark mark = arena_mark(arena);
+  float* taps = arena_alloc(arena, sizeof(float) * size);
+  float sum = 0;
+  for (int k = 0; k < size; k++) {
+    taps[k] = expf(-(k - radius) * (k - radius) / (2 * sigma * sigma));
+    sum += taps[k];
+  }
+  for (int k = 0; k < size; k++) taps[k] /= sum;
+
+  PlaneF* vx = planef_create_in(arena, fp->width, fp->height);
+  PlaneF* vy = planef_create_in(arena, fp->width, fp->height);
+  for (int j = 0; j < fp->height; j++) {
+    float* x = planef_row(vx, j);
+    float* y = planef_row(vy, j);
+    for (int i = 0; i < fp->width; i++) {
+      const Ridge* ridge = &(fp->ridges)[j][i];
+      float w = mask_get(mask, i, j) ? ridge->coherence : 0;
+      x[i] = w * cosf(2 * ridge->angle);
+      y[i] = w * sinf(2 * ridge->angle);
+    }
+  }
+
+  // Zero border: cells outside the field have no weight either
+  Kernel* gauss = kernel_separable(taps, size, taps, size);
+  PlaneF* sx = convolve(vx, gauss, BORDER_ZERO, pool, arena);
+  PlaneF* sy = convolve(vy, gauss, BORDER_ZERO, pool, arena);
+  kernel_free(gauss);
+
+  for (int j = 0; j < fp->height; j++) {
+    const float* x = planef_row(sx, j);
+    const float* y = planef_row(sy, j);
+    for (int i = 0; i < fp->width; i++) {
+      if (!mask_get(mask, i, j)) continue;
+      // Cells without any coherent neighbour keep their own angle
+      if (x[i] * x[i] + y[i] * y[i] < EPSILON * EPSILON) continue;
+
+      float angle = 0.5f * atan2f(y[i], x[i]);
+      (fp->ridges)[j][i].angle = angle < 0 ? angle + PI : angle;
+    }
+  }
+
+  planef_free(sy);
+  planef_free(sx);
+  planef_free(vy);
+  planef_free(vx);
+  arena_release(arena, taps);
+  arena_rewind(arena, mark);
+}
@@ -0,0 +1,220 @@
+#include "segment.h"
+#include <math.h>
+#include <string.h>
+
+#define EPSILON 1E-6
+
+// Valid bits of the last word of a row
+static uint64_t last_word_mask(const BlockMask* m) {
+  int rest = m->width & 63;
+  return rest ? ((uint64_t)1 << rest) - 1 : ~(uint64_t)0;
+}
+
+static void clear_padding(BlockMask* m) {
+  uint64_t keep = last_word_mask(m);
+  for (int j = 0; j < m->height; j++) m->bits[(size_t)j * m->words + m->words - 1] &= keep;
+}
+
+// Empty mask of width x height blocks, in `arena` (heap when NULL; only
+// heap masks are passed to mask_free)
+BlockMask* mask_create_in(Arena* arena, int width, int height) {
+  BlockMask* m = arena_alloc(arena, sizeof(BlockMask));
+  m->width = width;
+  m->height = height;
+  m->words = (width + 63) / 64;
+  m->bits = arena_calloc(arena, (size_t)m->words * height, sizeof(uint64_t));
+  return m;
+}
+
+void mask_free(BlockMask* m) {
+  if (!m) return;
+  free(m->bits);
+  free(m);
+}
+
+int mask_count(const BlockMask* m) {
+  int count = 0;
+  for (size_t w = 0; w < (size_t)m->words * m->height; w++) count += __builtin_popcountll(m->bits[w]);
+  return count;
+}
+
+// 3x3 dilation, 64 blocks at a time: each row is ORed with itself shifted
+// by one block either way (carrying across words), then with the rows
+// above and below
+void mask_dilate(BlockMask* m, Arena* scratch) {
+  size_t n = (size_t)m->words * m->height;
+  ArenaMark mark = arena_mark(scratch);
+  uint64_t* rows = arena_alloc(scratch, sizeof(uint64_t) * n);
+
+  for (int j = 0; j < m->height; j++) {
+    const uint64_t* src = m->bits + (size_t)j * m->words;
+    uint64_t* dst = rows + (size_t)j * m->words;
+    for (int w = 0; w < m->words; w++) {
+      uint64_t x = src[w];
+      uint64_t carry_in = w > 0 ? src[w - 1] >> 63 : 0;
+      uint64_t carry_out = w + 1 < m->words ? src[w + 1] << 63 : 0;
+      dst[w] = x | (x << 1) | carry_in | (x >> 1) | carry_out;
+    }
+  }
+
+  for (int j = 0; j < m->height; j++) {
+    uint64_t* dst = m->bits + (size_t)j * m->words;
+    const uint64_t* row = rows + (size_t)j * m->words;
+    for (int w = 0; w < m->words; w++) {
+      uint64_t x = row[w];
+      if (j > 0) x |= row[w - m->words];
+      if (j + 1 < m->height) x |= row[w + m->words];
+      dst[w] = x;
+    }
+  }
+  clear_padding(m);
+
+  arena_release(scratch, rows);
+  arena_rewind(scratch, mark);
+}
+
+// 3x3 erosion, as the dilation of the background. Outside the grid counts
+// as foreground, so blocks on the image border are not eroded away.
+void mask_erode(BlockMask* m, Arena* scratch) {
+  size_t n = (size_t)m->words * m->height;
+  for (size_t w = 0; w < n; w++) m->bits[w] = ~m->bits[w];
+  clear_padding(m);
+  mask_dilate(m, scratch);
+  for (size_t w = 0; w < n; w++) m->bits[w] = ~m->bits[w];
+  clear_padding(m);
+}
+
+typedef struct segment_job {
+  const uint64_t* sum;   // summed-area tables of I and I^2,
+  const uint64_t* sq;    // (width + 1) x (height + 1)
+  int image_width;
+  int image_height;
+  int block_size;
+  double min_variance;
+  BlockMask* mask;
+} SegmentJob;
+
+// Block row j; rows of the mask never share a word, so tasks do not
+// write to the same memory
+static void segment_block_row(void* ctx, int j, int worker) {
+  const SegmentJob* job = ctx;
+  size_t cols = job->image_width + 1;
+  int cy = j * job->block_size + job->block_size / 2;
+  int y0 = cy - SEGMENT_WINDOW / 2, y1 = y0 + SEGMENT_WINDOW;
+  if (y0 < 0) y0 = 0;
+  if (y1 > job->image_height) y1 = job->image_height;
+
+  for (int i = 0; i < job->mask->width; i++) {
+    int cx = i * job->block_size + job->block_size / 2;
+    int x0 = cx - SEGMENT_WINDOW / 2, x1 = x0 + SEGMENT_WINDOW;
+    if (x0 < 0) x0 = 0;
+    if (x1 > job->image_width) x1 = job->image_width;
+    if (x1 <= x0 || y1 <= y0) continue;
+
+    size_t a = y0 * cols + x0, b = y0 * cols + x1;
+    size_t c = y1 * cols + x0, d = y1 * cols + x1;
+    double n = (double)(x1 - x0) * (y1 - y0);
+    double mean = (job->sum[d] - job->sum[b] - job->sum[c] + job->sum[a]) / n;
+    double variance = (job->sq[d] - job->sq[b] - job->sq[c] + job->sq[a]) / n - mean * mean;
+
+    if (variance >= job->min_variance) mask_set(job->mask, i, j, 1);
+  }
+}
+
+// Foreground blocks of a grid of width x height blocks of block_size
+// pixels: those whose SEGMENT_WINDOW window around the block centre has a
+// grey level variance of at least SEGMENT_MIN_VARIANCE times the image
+// variance. Holes are closed so that the later stages still compute
+// ridges there (see segment_refine). The mask is allocated in `arena`.
+BlockMask* segment_image(const Plane8* im, int block_size, int width, int height, Pool* pool, Arena* arena) {
+  BlockMask* mask = mask_create_in(arena, width, height);
+
+  ArenaMark mark = arena_mark(arena);
+  size_t cols = im->width + 1;
+  size_t n = cols * (im->height + 1);
+  uint64_t* sum = arena_alloc(arena, sizeof(uint64_t) * n);
+  uint64_t* sq = arena_alloc(arena, sizeof(uint64_t) * n);
+
+  memset(sum, 0, sizeof(uint64_t) * cols);
+  memset(sq, 0, sizeof(uint64_t) * cols);
+  for (int y = 0; y < im->height; y++) {
+    const uint8_t* row = plane8_row(im, y);
+    uint64_t run = 0, run_sq = 0;
+    sum[(y + 1) * cols] = sq[(y + 1) * cols] = 0;
+    for (int x = 0; x < im->width; x++) {
+      run += row[x];
+      run_sq += row[x] * row[x];
+      sum[(y + 1) * cols + x + 1] = sum[y * cols + x + 1] + run;
+      sq[(y + 1) * cols + x + 1] = sq[y * cols + x + 1] + run_sq;
+    }
+  }
+
+  double total = (double)im->width * im->height;
+  double mean = sum[n - 1] / total;
+  double variance = sq[n - 1] / total - mean * mean;
+
+  SegmentJob job = { sum, sq, im->width, im->height, block_size, SEGMENT_MIN_VARIANCE * variance, mask };
+  pool_run(pool, height, segment_block_row, &job);
+
+  arena_release(arena, sum);
+  arena_release(arena, sq);
+  arena_rewind(arena, mark);
+
+  mask_dilate(mask, arena);
+  mask_erode(mask, arena);
+  return mask;
+}
+
+// Second pass once the orientation field is known: drop the blocks whose
+// neighbourhood (about SEGMENT_WINDOW pixels) has no consistent ridge
+// orientation, then clean up with an opening (isolated blocks) and a
+// closing (holes, e.g. around singular points, whose orientation is
+// inconsistent by nature). Ridges of the blocks left out are cleared.
+void segment_refine(BlockMask* m, Fingerprint* fp, int block_size, Arena* scratch) {
+  int r = SEGMENT_WINDOW / (2 * block_size);
+  if (r < 1) r = 1;
+
+  // Decisions are taken on the mask as it was, not as it is being updated
+  ArenaMark mark = arena_mark(scratch);
+  size_t n = (size_t)m->words * m->height;
+  BlockMask before = *m;
+  before.bits = arena_alloc(scratch, sizeof(uint64_t) * n);
+  memcpy(before.bits, m->bits, sizeof(uint64_t) * n);
+
+  for (int j = 0; j < m->height; j++) {
+    for (int i = 0; i < m->width; i++) {
+      if (!mask_get(&before, i, j)) continue;
+
+      // Coherence-weighted mean of the doubled angles: its length is 1
+      // when every ridge around is parallel, about 0 when they are random
+      double c2 = 0, s2 = 0, weight = 0;
+      for (int v = j - r; v <= j + r; v++) {
+        for (int u = i - r; u <= i + r; u++) {
+          if (u < 0 || v < 0 || u >= m->width || v >= m->height || !mask_get(&before, u, v)) continue;
+          const Ridge* ridge = &(fp->ridges)[v][u];
+          c2 += ridge->coherence * cos(2 * ridge->angle);
+          s2 += ridge->coherence * sin(2 * ridge->angle);
+          weight += ridge->coherence;
+        }
+      }
+
+      if (weight < EPSILON || sqrt(c2 * c2 + s2 * s2) < SEGMENT_MIN_CONSISTENCY * weight) mask_set(m, i, j, 0);
+    }
+  }
+
+  mask_erode(m, scratch);
+  mask_dilate(m, scratch);
+  mask_dilate(m, scratch);
+  mask_erode(m, scratch);
+
+  // The closing must not bring back blocks whose ridges were never computed
+  for (size_t w = 0; w < n; w++) m->bits[w] &= before.bits[w];
+  arena_release(scratch, before.bits);
+  arena_rewind(scratch, mark);
+
+  for (int j = 0; j < fp->height; j++) {
+    for (int i = 0; i < fp->width; i++) {
+      if (!mask_get(m, i, j)) (fp->ridges)[j][i] = (Ridge){ 0.0, 0.0 };
+    }
+  }
+}
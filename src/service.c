@@ -0,0 +1,572 @@
+#include "service.h"
+#include "template.h"
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Connection accepted by service_listen
+typedef struct service_client {
+  Service* s;
+  FILE* in;
+  FILE* out;
+  int fd;
+} ServiceClient;
+
+typedef struct service_thread {
+  Service* s;
+  int worker;
+} ServiceThread;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+// enroll <image> [template]: run the pipeline, save the template if asked
+static void serve_enroll(Service* s, ServiceWorker* w, char** args, int n, char* reply) {
+  if (n < 1) {
+    snprintf(reply, SERVICE_LINE, "error usage: enroll <image> [template]");
+    return;
+  }
+
+  PpmMap* map = ppm_map(args[0]);
+  if (!map) {
+    snprintf(reply, SERVICE_LINE, "error cannot open %s", args[0]);
+    return;
+  }
+  Plane8* im = plane8_create_in(w->arena, map->header.width, map->header.height);
+  if (!im) {
+    ppm_unmap(map);
+    snprintf(reply, SERVICE_LINE, "error cannot decode %s", args[0]);
+    return;
+  }
+  ppm_decode_grey(map, GREY_MEAN, im);
+  ppm_unmap(map);
+
+  Enrollment res;
+  if (pipeline_run(s->pl, im, w->serial, w->arena, &res) != 0) {
+    snprintf(reply, SERVICE_LINE, "error cannot process %s", args[0]);
+    return;
+  }
+
+  size_t size;
+  void* template = template_build(&res, 1, &size, w->arena);
+  if (n > 1 && template_save(template, size, args[1]) != 0) {
+    snprintf(reply, SERVICE_LINE, "error cannot write %s", args[1]);
+    return;
+  }
+
+  int endings = 0;
+  for (int k = 0; k < res.minutiae->count; k++) endings += res.minutiae->points[k].type == MINUTIA_ENDING;
+  snprintf(reply, SERVICE_LINE, "ok minutiae=%d endings=%d singular=%d bytes=%zu",
+           res.minutiae->count, endings, res.singular->count, size);
+}
+
+// Template file, mapped and checked
+static TemplateMap* open_template(const char* path, char* reply) {
+  TemplateMap* map = template_map(path);
+  if (!map) {
+    snprintf(reply, SERVICE_LINE, "error cannot open %s", path);
+    return NULL;
+  }
+  if (template_check(map->base, map->length) != 0) {
+    snprintf(reply, SERVICE_LINE, "error corrupted template %s", path);
+    template_unmap(map);
+    return NULL;
+  }
+  return map;
+}
+
+// verify <probe.fpt> <reference.fpt>: similarity of two templates
+static void serve_verify(ServiceWorker* w, char** args, int n, char* reply) {
+  if (n < 2) {
+    snprintf(reply, SERVICE_LINE, "error usage: verify <probe.fpt> <reference.fpt>");
+    return;
+  }
+
+  TemplateMap* probe = open_template(args[0], reply);
+  TemplateMap* ref = probe ? open_template(args[1], reply) : NULL;
+  if (ref) {
+    MatchTemplate* a = match_prepare(&probe->view, w->arena);
+    MatchTemplate* b = match_prepare(&ref->view, w->arena);
+    snprintf(reply, SERVICE_LINE, "ok score=%.4f", match_score(a, b, w->arena));
+  }
+  template_unmap(ref);
+  template_unmap(probe);
+}
+
+// identify <probe.fpt> [k]: best candidates of the gallery
+static void serve_identify(Service* s, ServiceWorker* w, char** args, int n, char* reply) {
+  if (n < 1) {
+    snprintf(reply, SERVICE_LINE, "error usage: identify <probe.fpt> [k]");
+    return;
+  }
+  if (!s->gallery) {
+    snprintf(reply, SERVICE_LINE, "error no gallery loaded");
+    return;
+  }
+
+  int k = n > 1 ? atoi(args[1]) : SERVICE_CANDIDATES;
+  if (k < 1) k = 1;
+  TemplateMap* probe = open_template(args[0], reply);
+  if (!probe) return;
+
+  GalleryHit* hits = arena_alloc(w->arena, sizeof(GalleryHit) * k);
+  GalleryQuery q;
+  int found = gallery_identify(s->gallery, &probe->view, w->serial, w->arena, hits, k, &q);
+  int len = snprintf(reply, SERVICE_LINE, "ok candidates=%d shortlisted=%d", found, q.shortlisted);
+  for (int i = 0; i < found && len < SERVICE_LINE; i++) {
+    len += snprintf(reply + len, SERVICE_LINE - len, " %s=%.4f", s->gallery->names[hits[i].entry], hits[i].score);
+  }
+  template_unmap(probe);
+}
+
+// Reply to one request line. Every reply is one line: "ok ..." or
+// "error ...", ending with the time spent on the request.
+static void serve(Service* s, ServiceWorker* w, ServiceRequest* r) {
+  double start = now();
+  char line[SERVICE_LINE];
+  memcpy(line, r->line, SERVICE_LINE);
+
+  char* args[8];
+  int n = 0;
+  char* save;
+  for (char* t = strtok_r(line, " \t", &save); t && n < 8; t = strtok_r(NULL, " \t", &save)) args[n++] = t;
+
+  if (r->too_long) {
+    snprintf(r->reply, SERVICE_LINE, "error request too long");
+  } else if (n == 0) {
+    snprintf(r->reply, SERVICE_LINE, "error empty request");
+  } else if (strcmp(args[0], "ping") == 0) {
+    snprintf(r->reply, SERVICE_LINE, "ok pong");
+  } else if (strcmp(args[0], "enroll") == 0) {
+    serve_enroll(s, w, args + 1, n - 1, r->reply);
+  } else if (strcmp(args[0], "verify") == 0) {
+    serve_verify(w, args + 1, n - 1, r->reply);
+  } else if (strcmp(args[0], "identify") == 0) {
+    serve_identify(s, w, args + 1, n - 1, r->reply);
+  } else {
+    snprintf(r->reply, SERVICE_LINE, "error unknown request %.64s", args[0]);
+  }
+  arena_reset(w->arena);
+
+  size_t len = strlen(r->reply);
+  if (len + 32 < SERVICE_LINE) snprintf(r->reply + len, SERVICE_LINE - len, " ms=%.2f", (now() - start) * 1E3);
+}
+
+// Files the request reads and writes, found by their position in its line
+static void request_files(ServiceRequest* r) {
+  int at[4], len[4];
+  int n = 0;
+  r->n_files = 0;
+  if (r->too_long) return;
+
+  for (int i = 0; r->line[i] && n < 4;) {
+    i += strspn(r->line + i, " \t");
+    if (!r->line[i]) break;
+    at[n] = i;
+    len[n] = strcspn(r->line + i, " \t");
+    i += len[n++];
+  }
+  if (n < 2) return;
+
+  const char* name = r->line + at[0];
+  int reads = 0, writes = 0;
+  if (len[0] == 6 && strncmp(name, "enroll", 6) == 0) {
+    reads = 1;
+    writes = n > 2;
+  } else if (len[0] == 6 && strncmp(name, "verify", 6) == 0) {
+    reads = n > 2 ? 2 : 1;
+  } else if (len[0] == 8 && strncmp(name, "identify", 8) == 0) {
+    reads = 1;
+  }
+  for (int k = 1; k <= reads + writes; k++) {
+    r->files[r->n_files++] = (ServiceFile){ at[k], len[k], k > reads };
+  }
+}
+
+// Whether `later` must wait for `earlier`: they name the same file and
+// at least one of them writes it
+static int depends(const ServiceRequest* later, const ServiceRequest* earlier) {
+  for (int a = 0; a < later->n_files; a++) {
+    const ServiceFile* f = &later->files[a];
+    for (int b = 0; b < earlier->n_files; b++) {
+      const ServiceFile* g = &earlier->files[b];
+      if (!f->written && !g->written) continue;
+      if (f->len == g->len && memcmp(later->line + f->at, earlier->line + g->at, f->len) == 0) return 1;
+    }
+  }
+  return 0;
+}
+
+// Whether a request still being processed comes before slot `pos` of its
+// stream and must finish first. Those before `next` have all been taken
+// by a worker, so waiting on them cannot deadlock.
+static int blocked(const ServiceStream* c, unsigned long pos) {
+  const ServiceRequest* r = &c->slots[pos % SERVICE_QUEUE];
+  if (r->n_files == 0) return 0;
+  for (unsigned long p = c->head; p < pos; p++) {
+    const ServiceRequest* q = &c->slots[p % SERVICE_QUEUE];
+    if (!q->done && depends(r, q)) return 1;
+  }
+  return 0;
+}
+
+// Stream with a request no worker has taken, looking first after the one
+// served last so that a busy client does not hold up the others
+static ServiceStream* pending(Service* s) {
+  ServiceStream* first = s->cursor ? s->cursor : s->streams;
+  ServiceStream* c = first;
+  while (c) {
+    if (c->next != c->tail) {
+      s->cursor = c->link;
+      return c;
+    }
+    c = c->link ? c->link : s->streams;
+    if (c == first) break;
+  }
+  return NULL;
+}
+
+// Worker: take the oldest waiting request of a stream, wait for the
+// earlier ones it depends on, answer it, repeat
+static void* service_worker(void* arg) {
+  ServiceThread* t = arg;
+  Service* s = t->s;
+  ServiceWorker* w = &s->workers[t->worker];
+  free(t);
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    ServiceStream* c = NULL;
+    while (!s->stop && !(c = pending(s))) pthread_cond_wait(&s->queued, &s->lock);
+    if (s->stop) break;
+    unsigned long pos = c->next++;
+    ServiceRequest* r = &c->slots[pos % SERVICE_QUEUE];
+    while (blocked(c, pos)) pthread_cond_wait(&c->done, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+
+    serve(s, w, r);
+
+    pthread_mutex_lock(&s->lock);
+    r->done = 1;
+    pthread_cond_broadcast(&c->done);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+// Writer of a stream: replies in request order, as soon as they are ready
+static void* service_writer(void* arg) {
+  ServiceStream* c = arg;
+  Service* s = c->s;
+
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    while (c->head != c->tail && !c->slots[c->head % SERVICE_QUEUE].done) pthread_cond_wait(&c->done, &s->lock);
+    if (c->head == c->tail) {
+      if (c->closing) break;
+      pthread_cond_wait(&c->done, &s->lock);
+      continue;
+    }
+    ServiceRequest* r = &c->slots[c->head % SERVICE_QUEUE];
+    pthread_mutex_unlock(&s->lock);
+
+    fprintf(c->out, "%s\n", r->reply);
+    fflush(c->out);
+
+    pthread_mutex_lock(&s->lock);
+    r->done = 0;
+    c->head++;
+    pthread_cond_signal(&c->space);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+Service* service_create(const Pipeline* pl, const Gallery* gallery, int threads) {
+  Service* s = calloc(1, sizeof(Service));
+  s->pl = pl;
+  s->gallery = gallery;
+  s->threads = threads;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->queued, NULL);
+  pthread_cond_init(&s->left, NULL);
+  s->listener = -1;
+
+  s->workers = malloc(sizeof(ServiceWorker) * threads);
+  s->handles = malloc(sizeof(pthread_t) * threads);
+  for (int i = 0; i < threads; i++) {
+    s->workers[i].arena = arena_create(0);
+    s->workers[i].serial = pool_create(1);
+    ServiceThread* t = malloc(sizeof(ServiceThread));
+    t->s = s;
+    t->worker = i;
+    int err = pthread_create(&s->handles[i], NULL, service_worker, t);
+    if (err != 0) {
+      fprintf(stderr, "Error starting service worker: %s\n", strerror(err));
+      free(t);
+      arena_free(s->workers[i].arena);
+      pool_free(s->workers[i].serial);
+      s->threads = i;
+      service_free(s);
+      return NULL;
+    }
+  }
+  return s;
+}
+
+void service_free(Service* s) {
+  if (!s) return;
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->queued);
+  pthread_mutex_unlock(&s->lock);
+
+  for (int i = 0; i < s->threads; i++) {
+    pthread_join(s->handles[i], NULL);
+    arena_free(s->workers[i].arena);
+    pool_free(s->workers[i].serial);
+  }
+  pthread_mutex_destroy(&s->lock);
+  pthread_cond_destroy(&s->queued);
+  pthread_cond_destroy(&s->left);
+  free(s->workers);
+  free(s->handles);
+  free(s);
+}
+
+// Serve the requests read from `in` until its end or a "quit" line, then
+// wait for the pending replies. `fd` is the socket behind `in`, -1 if it
+// is not one. Returns 1 when the stream asked the server to shut down, 0
+// otherwise, -1 if it could not be served.
+static int stream_run(Service* s, FILE* in, FILE* out, int fd) {
+  ServiceStream* c = calloc(1, sizeof(ServiceStream));
+  if (!c) {
+    fprintf(stderr, "Error creating service stream\n");
+    return -1;
+  }
+  c->s = s;
+  c->out = out;
+  c->fd = fd;
+  pthread_cond_init(&c->done, NULL);
+  pthread_cond_init(&c->space, NULL);
+
+  pthread_t writer;
+  int err = pthread_create(&writer, NULL, service_writer, c);
+  if (err != 0) {
+    fprintf(stderr, "Error starting service writer: %s\n", strerror(err));
+    pthread_cond_destroy(&c->done);
+    pthread_cond_destroy(&c->space);
+    free(c);
+    return -1;
+  }
+
+  // A client arriving while the server shuts down gets nothing more read
+  pthread_mutex_lock(&s->lock);
+  c->link = s->streams;
+  s->streams = c;
+  if (s->shutdown && fd >= 0) shutdown(fd, SHUT_RD);
+  pthread_mutex_unlock(&s->lock);
+
+  char line[SERVICE_LINE];
+  int quit = 0;
+  while (fgets(line, sizeof(line), in)) {
+    // A line that fills the buffer without its newline is cut: the rest
+    // is dropped so that it still gets exactly one reply
+    size_t len = strlen(line);
+    int too_long = 0;
+    if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+      int ch = getc(in);
+      too_long = ch != '\n' && ch != EOF;
+      char rest[SERVICE_LINE];
+      if (too_long) while (fgets(rest, sizeof(rest), in) && !strchr(rest, '\n')) {}
+    }
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!too_long && (line[0] == '\0' || line[0] == '#')) continue;
+    if (!too_long && strcmp(line, "quit") == 0) break;
+    if (!too_long && strcmp(line, "shutdown") == 0) {
+      quit = 1;
+      break;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (c->tail - c->head == SERVICE_QUEUE) pthread_cond_wait(&c->space, &s->lock);
+    ServiceRequest* r = &c->slots[c->tail % SERVICE_QUEUE];
+    memcpy(r->line, line, SERVICE_LINE);
+    r->done = 0;
+    r->too_long = too_long;
+    request_files(r);
+    c->tail++;
+    pthread_cond_signal(&s->queued);
+    pthread_mutex_unlock(&s->lock);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  c->closing = 1;
+  pthread_cond_broadcast(&c->done);
+  pthread_mutex_unlock(&s->lock);
+  pthread_join(writer, NULL);
+
+  pthread_mutex_lock(&s->lock);
+  ServiceStream** p = &s->streams;
+  while (*p != c) p = &(*p)->link;
+  *p = c->link;
+  if (s->cursor == c) s->cursor = c->link;
+  pthread_mutex_unlock(&s->lock);
+
+  pthread_cond_destroy(&c->done);
+  pthread_cond_destroy(&c->space);
+  free(c);
+  return quit;
+}
+
+// Serve the requests of one stream, one per line (see stream_run)
+int service_run(Service* s, FILE* in, FILE* out) {
+  return stream_run(s, in, out, -1);
+}
+
+// Thread of a connection. Its "shutdown" stops the listener and ends the
+// reading of the other clients; their pending requests still get replies.
+static void* service_client(void* arg) {
+  ServiceClient* client = arg;
+  Service* s = client->s;
+  int status = stream_run(s, client->in, client->out, client->fd);
+  fclose(client->out);
+  fclose(client->in);
+
+  pthread_mutex_lock(&s->lock);
+  if (status == 1 && !s->shutdown) {
+    s->shutdown = 1;
+    shutdown(s->listener, SHUT_RDWR);
+    for (ServiceStream* c = s->streams; c; c = c->link) {
+      if (c->fd >= 0) shutdown(c->fd, SHUT_RD);
+    }
+  }
+  s->clients--;
+  pthread_cond_broadcast(&s->left);
+  pthread_mutex_unlock(&s->lock);
+  free(client);
+  return NULL;
+}
+
+// Serve an accepted connection on a thread of its own. Returns 0, or -1
+// if it could not be started (the connection is then closed).
+static int start_client(Service* s, int fd) {
+  ServiceClient* client = malloc(sizeof(ServiceClient));
+  int copy = dup(fd);
+  FILE* in = fdopen(fd, "r");
+  FILE* out = copy >= 0 ? fdopen(copy, "w") : NULL;
+  if (!client || !in || !out) {
+    perror("Error opening connection");
+    if (in) fclose(in);
+    else close(fd);
+    if (out) fclose(out);
+    else if (copy >= 0) close(copy);
+    free(client);
+    return -1;
+  }
+  *client = (ServiceClient){ s, in, out, fd };
+
+  pthread_mutex_lock(&s->lock);
+  s->clients++;
+  pthread_mutex_unlock(&s->lock);
+
+  pthread_t thread;
+  int err = pthread_create(&thread, NULL, service_client, client);
+  if (err != 0) {
+    fprintf(stderr, "Error starting service client: %s\n", strerror(err));
+    fclose(out);
+    fclose(in);
+    free(client);
+    pthread_mutex_lock(&s->lock);
+    s->clients--;
+    pthread_mutex_unlock(&s->lock);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+// Serve the clients of a Unix socket at `path`, up to SERVICE_CLIENTS at
+// once, until one sends "shutdown". Returns 0 once every client has left,
+// or -1 if the socket could not be set up.
+int service_listen(Service* s, const char* path) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+
+  // A socket left by an earlier server is replaced, anything else kept
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s: path exists and is not a socket\n", path);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("Error creating socket");
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 8) < 0) {
+    perror("Error binding socket");
+    close(fd);
+    return -1;
+  }
+
+  // A client leaving early must not take the server down
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_mutex_lock(&s->lock);
+  s->listener = fd;
+  s->shutdown = 0;
+  pthread_mutex_unlock(&s->lock);
+
+  for (;;) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->shutdown && s->clients == SERVICE_CLIENTS) pthread_cond_wait(&s->left, &s->lock);
+    int stop = s->shutdown;
+    pthread_mutex_unlock(&s->lock);
+    if (stop) break;
+
+    // A shutdown wakes accept up with an error
+    int client = accept(fd, NULL, NULL);
+    if (client < 0) {
+      pthread_mutex_lock(&s->lock);
+      stop = s->shutdown;
+      pthread_mutex_unlock(&s->lock);
+      if (stop) break;
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+
+      // e.g. out of descriptors: retrying at once would only spin
+      perror("Error accepting connection");
+      nanosleep(&(struct timespec){ 0, SERVICE_RETRY_MS * 1000000L }, NULL);
+      continue;
+    }
+    start_client(s, client);
+  }
+
+  pthread_mutex_lock(&s->lock);
+  while (s->clients > 0) pthread_cond_wait(&s->left, &s->lock);
+  s->listener = -1;
+  pthread_mutex_unlock(&s->lock);
+
+  close(fd);
+  unlink(path);
+  return 0;
+}
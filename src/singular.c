@@ -0,0 +1,205 @@
+#include "singular.h"
+#include "fingerprint.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// At most this many points are kept, the largest ones first
+#define SINGULAR_MAX_POINTS 16
+
+// Cells are processed this many at a time: rows are padded to a multiple
+// of it so that the inner loops have a fixed length and vectorize
+#define SINGULAR_LANES 16
+
+// Point k of the square curve of radius r around a cell, clockwise from
+// the top left corner
+static void curve_point(int r, int k, int* dx, int* dy) {
+  k %= 8 * r;
+  int t = k % (2 * r);
+  switch (k / (2 * r)) {
+    case 0: *dx = -r + t; *dy = -r; break;
+    case 1: *dx = r; *dy = -r + t; break;
+    case 2: *dx = r - t; *dy = r; break;
+    default: *dx = -r; *dy = r - t; break;
+  }
+}
+
+// One step of the curve for a row of cells: add the turn from a to b, and
+// drop cells whose curve goes through an unusable cell
+static void curve_step(int16_t* restrict sum, uint8_t* restrict ok, const uint8_t* restrict a, const uint8_t* restrict b, const uint8_t* restrict fg, int lanes) {
+  for (int i = 0; i < lanes; i += SINGULAR_LANES) {
+    for (int l = 0; l < SINGULAR_LANES; l++) {
+      sum[i + l] += (int8_t)(b[i + l] - a[i + l]);
+      ok[i + l] &= fg[i + l];
+    }
+  }
+}
+
+// Orientations are quantized to 8 bits, PI being 256: the turn from one
+// orientation to the next, folded into [-PI/2, PI/2) since orientations
+// have no sign, is then just their difference as an int8_t.
+// `angles` and `fg` have a margin of r unusable cells around the grid,
+// rows `stride` cells apart. Every step along the curve is one pass over
+// a row of cells. Cells whose curve leaves the usable cells get index 0.
+static void poincare_index(const uint8_t* angles, const uint8_t* fg, int stride, int width, int height, int r, int8_t* index, Arena* scratch) {
+  int lanes = (width + SINGULAR_LANES - 1) / SINGULAR_LANES * SINGULAR_LANES;
+  ArenaMark mark = arena_mark(scratch);
+  int16_t* acc = arena_alloc(scratch, sizeof(int16_t) * lanes);
+  uint8_t* ok = arena_alloc(scratch, lanes);
+
+  for (int j = 0; j < height; j++) {
+    memset(acc, 0, sizeof(int16_t) * lanes);
+    memset(ok, 1, lanes);
+
+    for (int k = 0; k < 8 * r; k++) {
+      int ax, ay, bx, by;
+      curve_point(r, k, &ax, &ay);
+      curve_point(r, k + 1, &bx, &by);
+      const uint8_t* a = angles + (size_t)(j + r + ay) * stride + r + ax;
+      const uint8_t* b = angles + (size_t)(j + r + by) * stride + r + bx;
+      const uint8_t* f = fg + (size_t)(j + r + ay) * stride + r + ax;
+      curve_step(acc, ok, a, b, f, lanes);
+    }
+
+    // Half turns, rounded
+    for (int i = 0; i < width; i++) {
+      int turns = (acc[i] + (acc[i] >= 0 ? 128 : -128)) / 256;
+      index[(size_t)j * width + i] = ok[i] ? turns : 0;
+    }
+  }
+
+  arena_release(scratch, ok);
+  arena_release(scratch, acc);
+  arena_rewind(scratch, mark);
+}
+
+// Keep the SINGULAR_MAX_POINTS largest points
+static void add_point(Singularities* s, SingularPoint p) {
+  if (s->count < SINGULAR_MAX_POINTS) {
+    s->points[s->count++] = p;
+    return;
+  }
+  int smallest = 0;
+  for (int k = 1; k < s->count; k++) {
+    if (s->points[k].cells < s->points[smallest].cells) smallest = k;
+  }
+  if (p.cells > s->points[smallest].cells) s->points[smallest] = p;
+}
+
+// Cores and deltas of the orientation field: cells where the orientation
+// turns by +PI (core) or -PI (delta) around a square of SINGULAR_RADIUS
+// pixels. Neighbouring cells with the same index are merged into one
+// point at their centroid, which places it between cell centres. Curves
+// must stay on foreground cells of `mask` (NULL: all) with a known
+// orientation. Cells of fp are block_size pixels wide. The result is
+// allocated in `arena` (heap when NULL; only heap results are passed to
+// singularities_free).
+Singularities* singularities_detect(const Fingerprint* fp, const BlockMask* mask, int block_size, Arena* arena) {
+  int width = fp->width, height = fp->height;
+  size_t n = (size_t)width * height;
+
+  Singularities* res = arena_alloc(arena, sizeof(Singularities));
+  res->points = arena_alloc(arena, sizeof(SingularPoint) * SINGULAR_MAX_POINTS);
+  res->count = 0;
+
+  int r = (int)lroundf((float)SINGULAR_RADIUS / block_size);
+  if (r < 1) r = 1;
+
+  // Quantized orientations and usable cells, with a margin of r cells
+  // and room for a whole number of lanes per row
+  int lanes = (width + SINGULAR_LANES - 1) / SINGULAR_LANES * SINGULAR_LANES;
+  int stride = lanes + 2 * r;
+  size_t padded = (size_t)stride * (height + 2 * r);
+
+  ArenaMark mark = arena_mark(arena);
+  uint8_t* angles = arena_calloc(arena, padded, 1);
+  uint8_t* fg = arena_calloc(arena, padded, 1);
+  int8_t* index = arena_alloc(arena, n);
+  int* stack = arena_alloc(arena, sizeof(int) * n);
+
+  for (int j = 0; j < height; j++) {
+    uint8_t* q = angles + (size_t)(j + r) * stride + r;
+    uint8_t* f = fg + (size_t)(j + r) * stride + r;
+    for (int i = 0; i < width; i++) {
+      const Ridge* ridge = &(fp->ridges)[j][i];
+      q[i] = (uint8_t)((long)lroundf(ridge->angle / PI * 256) & 255);
+      f[i] = mask_get(mask, i, j) && ridge->coherence > 0;
+    }
+  }
+
+  poincare_index(angles, fg, stride, width, height, r, index, arena);
+
+  // 8-connected groups of cells of the same type; `index` is cleared as
+  // cells are taken
+  for (int start = 0; start < (int)n; start++) {
+    int type = index[start];
+    if (type != SINGULAR_CORE && type != SINGULAR_DELTA) continue;
+
+    float sum_x = 0, sum_y = 0;
+    int cells = 0, top = 0;
+    stack[top++] = start;
+    index[start] = 0;
+    while (top > 0) {
+      int c = stack[--top];
+      int i = c % width, j = c / width;
+      sum_x += i;
+      sum_y += j;
+      cells++;
+
+      for (int v = j - 1; v <= j + 1; v++) {
+        for (int u = i - 1; u <= i + 1; u++) {
+          if (u < 0 || v < 0 || u >= width || v >= height) continue;
+          int q = v * width + u;
+          if (index[q] != type) continue;
+          index[q] = 0;
+          stack[top++] = q;
+        }
+      }
+    }
+
+    SingularPoint p;
+    p.x = (sum_x / cells) * block_size + block_size / 2.0f;
+    p.y = (sum_y / cells) * block_size + block_size / 2.0f;
+    p.type = type;
+    p.cells = cells;
+    add_point(res, p);
+  }
+
+  arena_release(arena, stack);
+  arena_release(arena, index);
+  arena_release(arena, fg);
+  arena_release(arena, angles);
+  arena_rewind(arena, mark);
+
+  // A core next to a delta is a twist of the noise, not of the ridges
+  float d2 = SINGULAR_MIN_DISTANCE * SINGULAR_MIN_DISTANCE;
+  for (int a = 0; a < res->count; a++) {
+    if (res->points[a].type != SINGULAR_CORE) continue;
+    int nearest = -1;
+    float best = d2;
+    for (int b = 0; b < res->count; b++) {
+      if (res->points[b].type != SINGULAR_DELTA) continue;
+      float dx = res->points[b].x - res->points[a].x, dy = res->points[b].y - res->points[a].y;
+      if (dx * dx + dy * dy < best) {
+        best = dx * dx + dy * dy;
+        nearest = b;
+      }
+    }
+    if (nearest < 0) continue;
+
+    // Remove both, keeping the order of the others
+    int hi = a > nearest ? a : nearest, lo = a > nearest ? nearest : a;
+    memmove(&res->points[hi], &res->points[hi + 1], sizeof(SingularPoint) * (res->count - hi - 1));
+    memmove(&res->points[lo], &res->points[lo + 1], sizeof(SingularPoint) * (res->count - lo - 2));
+    res->count -= 2;
+    a = -1;
+  }
+
+  return res;
+}
+
+void singularities_free(Singularities* s) {
+  if (!s) return;
+  free(s->points);
+  free(s);
+}
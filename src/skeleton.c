@@ -0,0 +1,168 @@
+#include "skeleton.h"
+#include <string.h>
+
+typedef struct binarize_job {
+  const PlaneF* enhanced;
+  const BlockMask* mask;
+  int block_size;
+  BlockMask* ridges;
+} BinarizeJob;
+
+// Pixel row y, packed 64 pixels per word
+static void binarize_row(void* ctx, int y, int worker) {
+  const BinarizeJob* job = ctx;
+  const BlockMask* mask = job->mask;
+  BlockMask* ridges = job->ridges;
+  int width = ridges->width;
+  if (y == 0 || y == ridges->height - 1) return;
+
+  int j = 0;
+  if (mask) {
+    j = y / job->block_size;
+    if (j >= mask->height) j = mask->height - 1;
+  }
+
+  const float* src = planef_row(job->enhanced, y);
+  uint64_t* row = ridges->bits + (size_t)y * ridges->words;
+  for (int w = 0; w < ridges->words; w++) {
+    int x0 = w * 64, x1 = x0 + 64;
+    if (x0 < 1) x0 = 1;
+    if (x1 > width - 1) x1 = width - 1;
+
+    uint64_t bits = 0;
+    for (int x = x0; x < x1; x++) {
+      int i = x / job->block_size;
+      if (mask && i >= mask->width) i = mask->width - 1;
+      if (src[x] < 0 && mask_get(mask, i, j)) bits |= (uint64_t)1 << (x & 63);
+    }
+    row[w] = bits;
+  }
+}
+
+// Ridges are where the zero-centred Gabor response is negative (ridges are
+// dark). Blocks are block_size pixels wide, the last row and column of
+// `mask` (NULL: everything is foreground) also cover what the grid leaves
+// over. Rows run over `pool` (may be NULL); the result is allocated in
+// `arena` (heap when NULL; only heap masks are passed to mask_free).
+BlockMask* binarize(const PlaneF* enhanced, const BlockMask* mask, int block_size, Pool* pool, Arena* arena) {
+  BlockMask* ridges = mask_create_in(arena, enhanced->width, enhanced->height);
+  BinarizeJob job = { enhanced, mask, block_size, ridges };
+  pool_run(pool, enhanced->height, binarize_row, &job);
+  return ridges;
+}
+
+// Guo-Hall deletion tables of both sub-iterations, indexed by the 3x3
+// neighbourhood (see ridge_neighbourhood)
+static uint8_t thin_table[2][512];
+
+__attribute__((constructor))
+static void thin_build_tables(void) {
+  for (int code = 0; code < 512; code++) {
+    int p1 = code >> 4 & 1;
+    int p2 = code >> 1 & 1, p3 = code >> 2 & 1, p4 = code >> 5 & 1, p5 = code >> 8 & 1;
+    int p6 = code >> 7 & 1, p7 = code >> 6 & 1, p8 = code >> 3 & 1, p9 = code & 1;
+
+    // Deleting the pixel must keep its neighbours connected (one
+    // 8-connected component) and must not shorten a line end
+    int c = (!p2 && (p3 || p4)) + (!p4 && (p5 || p6)) + (!p6 && (p7 || p8)) + (!p8 && (p9 || p2));
+    int n1 = (p9 | p2) + (p3 | p4) + (p5 | p6) + (p7 | p8);
+    int n2 = (p2 | p3) + (p4 | p5) + (p6 | p7) + (p8 | p9);
+    int n = n1 < n2 ? n1 : n2;
+    int simple = p1 && c == 1 && n >= 2 && n <= 3;
+
+    // First pass peels south-east borders, second pass north-west ones
+    thin_table[0][code] = simple && ((p2 | p3 | !p5) & p4) == 0;
+    thin_table[1][code] = simple && ((p6 | p7 | !p9) & p8) == 0;
+  }
+}
+
+// Thin the ridges of a binarized image down to 8-connected lines one pixel
+// wide (Guo-Hall). Instead of rescanning the image, every sub-iteration
+// only visits a worklist: the border pixels at first, then the pixels
+// whose neighbourhood changed in one of the last two sub-iterations (a
+// pixel that survived both passes with the same neighbourhood is final).
+// Deletions of a sub-iteration are decided on its input and applied
+// together. Returns the number of sub-iterations.
+int thin(BlockMask* ridges, Arena* scratch) {
+  int width = ridges->width, height = ridges->height;
+  size_t n = (size_t)width * height;
+
+  ArenaMark mark = arena_mark(scratch);
+  int* list = arena_alloc(scratch, sizeof(int) * n);
+  int* next = arena_alloc(scratch, sizeof(int) * n);
+  int* deleted = arena_alloc(scratch, sizeof(int) * n);
+  int* stamp = arena_alloc(scratch, sizeof(int) * n);    // first sub-iteration that saw the current neighbourhood
+  int* queued = arena_calloc(scratch, n, sizeof(int));   // t + 1 once the pixel is on the list of sub-iteration t + 1
+
+  int count = 0;
+  for (int y = 1; y < height - 1; y++) {
+    for (int x = 1; x < width - 1; x++) {
+      unsigned nb = ridge_neighbourhood(ridges, x, y);
+      if ((nb & 0x10) && nb != 0x1ff) {
+        int p = y * width + x;
+        stamp[p] = 0;
+        list[count++] = p;
+      }
+    }
+  }
+
+  int t = 0;
+  for (; count > 0; t++) {
+    const uint8_t* table = thin_table[t & 1];
+    int n_next = 0, n_deleted = 0;
+
+    for (int k = 0; k < count; k++) {
+      int p = list[k];
+      if (table[ridge_neighbourhood(ridges, p % width, p / width)]) {
+        deleted[n_deleted++] = p;
+      } else if (stamp[p] == t) {
+        // Not seen by the other pass yet
+        queued[p] = t + 1;
+        next[n_next++] = p;
+      }
+    }
+
+    for (int k = 0; k < n_deleted; k++) {
+      int p = deleted[k];
+      mask_set(ridges, p % width, p / width, 0);
+    }
+
+    for (int k = 0; k < n_deleted; k++) {
+      int x = deleted[k] % width, y = deleted[k] / width;
+      for (int v = y - 1; v <= y + 1; v++) {
+        for (int u = x - 1; u <= x + 1; u++) {
+          if (!mask_get(ridges, u, v)) continue;
+          int q = v * width + u;
+          stamp[q] = t + 1;
+          if (queued[q] != t + 1) {
+            queued[q] = t + 1;
+            next[n_next++] = q;
+          }
+        }
+      }
+    }
+
+    int* tmp = list;
+    list = next;
+    next = tmp;
+    count = n_next;
+  }
+
+  arena_release(scratch, list);
+  arena_release(scratch, next);
+  arena_release(scratch, deleted);
+  arena_release(scratch, stamp);
+  arena_release(scratch, queued);
+  arena_rewind(scratch, mark);
+  return t;
+}
+
+// Black ridges on white, for saving with pgm_save
+Plane8* skeleton_to_plane8(const BlockMask* ridges, Arena* arena) {
+  Plane8* p = plane8_create_in(arena, ridges->width, ridges->height);
+  for (int y = 0; y < ridges->height; y++) {
+    uint8_t* row = plane8_row(p, y);
+    for (int x = 0; x < ridges->width; x++) row[x] = mask_get(ridges, x, y) ? 0 : 255;
+  }
+  return p;
+}
@@ -0,0 +1,237 @@
+#include "template.h"
+#include "crc32.h"
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(TemplateHeader) == 32, "TemplateHeader must keep its layout");
+_Static_assert(sizeof(TemplateMinutia) == 8, "TemplateMinutia must keep its layout");
+_Static_assert(sizeof(TemplateSingular) == 8, "TemplateSingular must keep its layout");
+
+static size_t align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+// Offsets of the sections, from the counts of the header
+typedef struct template_layout {
+  size_t minutiae;
+  size_t singular;
+  size_t orientation;
+  size_t period;
+  size_t size;
+} TemplateLayout;
+
+static TemplateLayout layout(int minutiae, int singular, int field_width, int field_height) {
+  size_t cells = (size_t)field_width * field_height;
+  TemplateLayout l;
+  l.minutiae = sizeof(TemplateHeader);
+  l.singular = l.minutiae + align8(sizeof(TemplateMinutia) * minutiae);
+  l.orientation = l.singular + align8(sizeof(TemplateSingular) * singular);
+  l.period = l.orientation + cells;
+  l.size = align8(l.period + cells);
+  return l;
+}
+
+size_t template_size(int minutiae, int singular, int field_width, int field_height) {
+  return layout(minutiae, singular, field_width, field_height).size;
+}
+
+// Fields of TEMPLATE_FIELD_STEP pixel cells: orientation from the
+// coherence-weighted doubled angles of the foreground cells of fp inside,
+// period from the mean of their known frequencies
+static void downsample_fields(const Enrollment* res, int field_width, int field_height, uint8_t* orientation, uint8_t* period, Arena* scratch) {
+  const Fingerprint* fp = res->fp;
+  int cells = field_width * field_height;
+  ArenaMark mark = arena_mark(scratch);
+  float* vx = arena_calloc(scratch, 3 * cells, sizeof(float));
+  float* vy = vx + cells;
+  float* freq = vy + cells;
+  int* count = arena_calloc(scratch, cells, sizeof(int));
+
+  for (int j = 0; j < fp->height; j++) {
+    int v = (j * res->grid + res->grid / 2) / TEMPLATE_FIELD_STEP;
+    if (v >= field_height) continue;
+    for (int i = 0; i < fp->width; i++) {
+      int u = (i * res->grid + res->grid / 2) / TEMPLATE_FIELD_STEP;
+      if (u >= field_width || !mask_get(res->mask, i, j)) continue;
+
+      const Ridge* ridge = &(fp->ridges)[j][i];
+      float f = res->frequency[j * fp->width + i];
+      int c = v * field_width + u;
+      vx[c] += ridge->coherence * cosf(2 * ridge->angle);
+      vy[c] += ridge->coherence * sinf(2 * ridge->angle);
+      if (f > 0) {
+        freq[c] += f;
+        count[c]++;
+      }
+    }
+  }
+
+  for (int c = 0; c < cells; c++) {
+    float angle = 0.5f * atan2f(vy[c], vx[c]);
+    if (angle < 0) angle += PI;
+    orientation[c] = (uint8_t)((long)lroundf(angle / PI * 256) & 255);
+
+    long p = count[c] > 0 ? lroundf(TEMPLATE_PERIOD_SCALE * count[c] / freq[c]) : 0;
+    period[c] = p > 255 ? 255 : p;
+  }
+
+  arena_release(scratch, count);
+  arena_release(scratch, vx);
+  arena_rewind(scratch, mark);
+}
+
+// Template of an enrollment, with the downsampled fields when `fields` is
+// set. The buffer is allocated in `arena` (heap when NULL: free() it).
+void* template_build(const Enrollment* res, int fields, size_t* size, Arena* arena) {
+  const Minutiae* m = res->minutiae;
+  const Singularities* s = res->singular;
+  int width = res->enhanced->width, height = res->enhanced->height;
+  int n_minutiae = m->count > UINT16_MAX ? UINT16_MAX : m->count;
+  int field_width = fields ? (width + TEMPLATE_FIELD_STEP - 1) / TEMPLATE_FIELD_STEP : 0;
+  int field_height = fields ? (height + TEMPLATE_FIELD_STEP - 1) / TEMPLATE_FIELD_STEP : 0;
+
+  TemplateLayout l = layout(n_minutiae, s->count, field_width, field_height);
+  uint8_t* buf = arena_calloc(arena, l.size, 1);
+
+  TemplateHeader* h = (TemplateHeader*)buf;
+  memcpy(h->magic, TEMPLATE_MAGIC, 4);
+  h->version = TEMPLATE_VERSION;
+  h->header_size = sizeof(TemplateHeader);
+  h->size = l.size;
+  h->width = width;
+  h->height = height;
+  h->minutiae = n_minutiae;
+  h->singular = s->count;
+  h->field_width = field_width;
+  h->field_height = field_height;
+  h->field_step = fields ? TEMPLATE_FIELD_STEP : 0;
+
+  TemplateMinutia* tm = (TemplateMinutia*)(buf + l.minutiae);
+  for (int k = 0; k < n_minutiae; k++) {
+    const Minutia* p = &m->points[k];
+    tm[k].x = p->x;
+    tm[k].y = p->y;
+    tm[k].angle = (uint8_t)((long)lroundf(p->angle / (2 * PI) * 256) & 255);
+    tm[k].type = p->type;
+    tm[k].quality = p->quality;
+  }
+
+  TemplateSingular* ts = (TemplateSingular*)(buf + l.singular);
+  for (int k = 0; k < s->count; k++) {
+    ts[k].x = lroundf(s->points[k].x);
+    ts[k].y = lroundf(s->points[k].y);
+    ts[k].type = s->points[k].type;
+    ts[k].cells = s->points[k].cells > UINT16_MAX ? UINT16_MAX : s->points[k].cells;
+  }
+
+  if (fields) downsample_fields(res, field_width, field_height, buf + l.orientation, buf + l.period, arena);
+
+  h->crc = crc32(0, buf, l.size);
+  *size = l.size;
+  return buf;
+}
+
+// Point `view` at the sections of the template in data[0, size). Checks
+// the header, the size of the fields and that the sections fit, not the
+// checksum (see template_check). Returns 0 on success, -1 if the template
+// is invalid.
+int template_view(const void* data, size_t size, TemplateView* view) {
+  const TemplateHeader* h = data;
+  if (size < sizeof(TemplateHeader) || memcmp(h->magic, TEMPLATE_MAGIC, 4) != 0
+      || h->version != TEMPLATE_VERSION || h->header_size != sizeof(TemplateHeader)
+      || h->size > size) {
+    return -1;
+  }
+
+  // Fields, when present, cover the image in TEMPLATE_FIELD_STEP cells
+  int step = h->field_width > 0 ? TEMPLATE_FIELD_STEP : 0;
+  int field_width = step ? (h->width + step - 1) / step : 0;
+  int field_height = step ? (h->height + step - 1) / step : 0;
+  if (h->field_step != step || h->field_width != field_width || h->field_height != field_height) return -1;
+
+  TemplateLayout l = layout(h->minutiae, h->singular, h->field_width, h->field_height);
+  if (l.size != h->size) return -1;
+
+  const uint8_t* base = data;
+  view->header = h;
+  view->minutiae = (const TemplateMinutia*)(base + l.minutiae);
+  view->singular = (const TemplateSingular*)(base + l.singular);
+  view->orientation = h->field_width > 0 ? base + l.orientation : NULL;
+  view->period = h->field_width > 0 ? base + l.period : NULL;
+  return 0;
+}
+
+// Returns 0 when the checksum of the template in data[0, size) matches
+int template_check(const void* data, size_t size) {
+  TemplateView view;
+  if (template_view(data, size, &view) != 0) return -1;
+
+  TemplateHeader h = *view.header;
+  h.crc = 0;
+  uint32_t crc = crc32(0, &h, sizeof(h));
+  crc = crc32(crc, (const uint8_t*)data + sizeof(h), h.size - sizeof(h));
+  return crc == view.header->crc ? 0 : -1;
+}
+
+int template_save(const void* data, size_t size, const char* filename) {
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    perror("Error opening file");
+    return -1;
+  }
+
+  int ok = fwrite(data, 1, size, f) == size;
+  if (fclose(f) != 0 || !ok) {
+    fprintf(stderr, "Error writing template %s\n", filename);
+    return -1;
+  }
+  return 0;
+}
+
+// Map a template file read-only; nothing is copied or decoded, pages are
+// loaded as the sections are read. The checksum is left to template_check.
+TemplateMap* template_map(const char* filename) {
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    perror("Error opening file");
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "Error reading file size\n");
+    close(fd);
+    return NULL;
+  }
+
+  size_t length = st.st_size;
+  void* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    perror("Error mapping file");
+    return NULL;
+  }
+
+  TemplateMap* map = malloc(sizeof(TemplateMap));
+  if (!map || template_view(base, length, &map->view) != 0) {
+    fprintf(stderr, "Invalid template %s\n", filename);
+    free(map);
+    munmap(base, length);
+    return NULL;
+  }
+
+  map->base = base;
+  map->length = length;
+  return map;
+}
+
+void template_unmap(TemplateMap* map) {
+  if (!map) return;
+  munmap(map->base, map->length);
+  free(map);
+}
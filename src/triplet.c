@@ -0,0 +1,229 @@
+#include "triplet.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct triplet_point {
+  float x;
+  float y;
+  float angle;
+} TripletPoint;
+
+static int compare_u32(const void* a, const void* b) {
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return (x > y) - (x < y);
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+static inline uint32_t slot_of(uint32_t key, int bits) {
+  return (key * 2654435761u) >> (32 - bits);
+}
+
+// Ridges crossed going from a to b: the length over the mean ridge period
+// of the field cells on the way (0 without fields)
+static int ridge_count(const TemplateView* t, const TripletPoint* a, const TripletPoint* b, float length) {
+  const TemplateHeader* h = t->header;
+  if (!t->period) return 0;
+
+  int steps = (int)(length / (h->field_step / 2)) + 1;
+  int sum = 0, count = 0;
+  for (int s = 0; s <= steps; s++) {
+    float x = a->x + (b->x - a->x) * s / steps;
+    float y = a->y + (b->y - a->y) * s / steps;
+    int u = (int)x / h->field_step, v = (int)y / h->field_step;
+    if (u < 0 || v < 0 || u >= h->field_width || v >= h->field_height) continue;
+    int p = t->period[v * h->field_width + u];
+    if (p == 0) continue;
+    sum += p;
+    count++;
+  }
+  return sum > 0 ? (int)(length * TEMPLATE_PERIOD_SCALE * count / sum) : 0;
+}
+
+static uint32_t quantize_direction(float angle) {
+  int q = (int)floorf(angle / (2 * PI) * 8);
+  return (uint32_t)q & 7;
+}
+
+// Key of the triangle abc. Its vertices are put in a canonical order, by
+// decreasing length of the opposite side, then packed:
+//   bits  0-14  sides, longest first, in TRIPLET_DISTANCE pixels
+//   bit   15    orientation of the vertices (mirror images differ)
+//   bits 16-24  directions of the minutiae relative to the longest side
+//   bits 25-28  ridges crossed by the longest side, in TRIPLET_RIDGES
+// Returns 0 (no key) when a side is longer than TRIPLET_MAX_SIDE.
+static uint32_t triangle_key(const TemplateView* t, const TripletPoint* a, const TripletPoint* b, const TripletPoint* c) {
+  const TripletPoint* v[3] = { a, b, c };
+  float side[3];
+  for (int k = 0; k < 3; k++) {
+    const TripletPoint* p = v[(k + 1) % 3];
+    const TripletPoint* q = v[(k + 2) % 3];
+    side[k] = sqrtf((q->x - p->x) * (q->x - p->x) + (q->y - p->y) * (q->y - p->y));
+    if (side[k] >= TRIPLET_MAX_SIDE) return 0;
+  }
+
+  // Sort the vertices by their opposite side, longest first
+  for (int i = 0; i < 2; i++) {
+    for (int j = 2; j > i; j--) {
+      if (side[j] <= side[j - 1]) continue;
+      float s = side[j]; side[j] = side[j - 1]; side[j - 1] = s;
+      const TripletPoint* p = v[j]; v[j] = v[j - 1]; v[j - 1] = p;
+    }
+  }
+
+  uint32_t key = 0;
+  for (int k = 0; k < 3; k++) key |= (uint32_t)(side[k] / TRIPLET_DISTANCE) << (5 * k);
+
+  float cross = (v[1]->x - v[0]->x) * (v[2]->y - v[0]->y) - (v[1]->y - v[0]->y) * (v[2]->x - v[0]->x);
+  key |= (uint32_t)(cross > 0) << 15;
+
+  float base = atan2f(v[2]->y - v[1]->y, v[2]->x - v[1]->x);
+  for (int k = 0; k < 3; k++) {
+    float d = v[k]->angle - base;
+    if (d < 0) d += 2 * PI;
+    key |= quantize_direction(d) << (16 + 3 * k);
+  }
+
+  int ridges = ridge_count(t, v[1], v[2], side[0]) / TRIPLET_RIDGES;
+  key |= (uint32_t)(ridges < 15 ? ridges : 15) << 25;
+
+  // Bit 31 is always set so that no key is 0
+  return key | (uint32_t)1 << 31;
+}
+
+// Room needed by triplet_keys() for template t
+int triplet_max_keys(const TemplateView* t) {
+  return t->header->minutiae * TRIPLET_NEIGHBOURS * (TRIPLET_NEIGHBOURS - 1) / 2;
+}
+
+// Keys of the triangles of a minutia and two of its TRIPLET_NEIGHBOURS
+// nearest neighbours, sorted, each key once. Returns their number.
+int triplet_keys(const TemplateView* t, uint32_t* keys, Arena* scratch) {
+  int count = t->header->minutiae;
+  ArenaMark mark = arena_mark(scratch);
+  TripletPoint* p = arena_alloc(scratch, sizeof(TripletPoint) * (count > 0 ? count : 1));
+  for (int i = 0; i < count; i++) {
+    p[i].x = t->minutiae[i].x;
+    p[i].y = t->minutiae[i].y;
+    p[i].angle = template_minutia_angle(&t->minutiae[i]);
+  }
+
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    int near[TRIPLET_NEIGHBOURS];
+    float dist[TRIPLET_NEIGHBOURS];
+    int m = 0;
+    for (int j = 0; j < count; j++) {
+      if (j == i) continue;
+      float d = (p[j].x - p[i].x) * (p[j].x - p[i].x) + (p[j].y - p[i].y) * (p[j].y - p[i].y);
+      if (m == TRIPLET_NEIGHBOURS && d >= dist[m - 1]) continue;
+      int k = m < TRIPLET_NEIGHBOURS ? m++ : m - 1;
+      while (k > 0 && dist[k - 1] > d) {
+        dist[k] = dist[k - 1];
+        near[k] = near[k - 1];
+        k--;
+      }
+      dist[k] = d;
+      near[k] = j;
+    }
+
+    for (int a = 0; a < m; a++) {
+      for (int b = a + 1; b < m; b++) {
+        uint32_t key = triangle_key(t, &p[i], &p[near[a]], &p[near[b]]);
+        if (key) keys[n++] = key;
+      }
+    }
+  }
+
+  arena_release(scratch, p);
+  arena_rewind(scratch, mark);
+
+  qsort(keys, n, sizeof(uint32_t), compare_u32);
+  int unique = 0;
+  for (int k = 0; k < n; k++) {
+    if (unique == 0 || keys[k] != keys[unique - 1]) keys[unique++] = keys[k];
+  }
+  return unique;
+}
+
+// Index of the (key << 32 | entry) pairs, which are sorted in place. The
+// index is allocated in `arena`.
+TripletIndex* triplet_index_build(uint64_t* pairs, size_t count, Arena* arena) {
+  qsort(pairs, count, sizeof(uint64_t), compare_u64);
+
+  size_t keys = 0;
+  for (size_t k = 0; k < count; k++) keys += k == 0 || pairs[k] >> 32 != pairs[k - 1] >> 32;
+
+  // At most half full
+  TripletIndex* index = arena_alloc(arena, sizeof(TripletIndex));
+  index->bits = 4;
+  while (((size_t)1 << index->bits) < 2 * keys) index->bits++;
+  index->slots = arena_calloc(arena, (size_t)1 << index->bits, sizeof(TripletSlot));
+  index->postings = arena_alloc(arena, sizeof(uint32_t) * (count > 0 ? count : 1));
+  index->count = 0;
+
+  uint32_t mask = ((uint32_t)1 << index->bits) - 1;
+  TripletSlot* slot = NULL;
+  for (size_t k = 0; k < count; k++) {
+    uint32_t key = pairs[k] >> 32, entry = (uint32_t)pairs[k];
+    if (k > 0 && pairs[k] == pairs[k - 1]) continue;
+    if (k == 0 || key != pairs[k - 1] >> 32) {
+      uint32_t s = slot_of(key, index->bits);
+      while (index->slots[s].count) s = (s + 1) & mask;
+      slot = &index->slots[s];
+      slot->key = key;
+      slot->start = index->count;
+    }
+    index->postings[index->count++] = entry;
+    slot->count++;
+  }
+  return index;
+}
+
+static const TripletSlot* lookup(const TripletIndex* index, uint32_t key) {
+  uint32_t mask = ((uint32_t)1 << index->bits) - 1;
+  uint32_t s = slot_of(key, index->bits);
+  while (index->slots[s].count && index->slots[s].key != key) s = (s + 1) & mask;
+  return index->slots[s].count ? &index->slots[s] : NULL;
+}
+
+// Votes of the gallery entries for the keys of a probe: one per key the
+// entry shares, by increasing entry. The work is proportional to the
+// postings of the keys, not to the size of the gallery. Returns the votes
+// allocated in `scratch` (heap when NULL: free() them) and their number
+// in *count.
+TripletVote* triplet_index_vote(const TripletIndex* index, const uint32_t* keys, int n, int* count, Arena* scratch) {
+  // Every posting may be a different entry
+  size_t total = 0;
+  for (int k = 0; k < n; k++) {
+    const TripletSlot* slot = lookup(index, keys[k]);
+    if (slot) total += slot->count;
+  }
+  TripletVote* votes = arena_alloc(scratch, sizeof(TripletVote) * (total > 0 ? total : 1));
+
+  ArenaMark mark = arena_mark(scratch);
+  uint32_t* entries = arena_alloc(scratch, sizeof(uint32_t) * (total > 0 ? total : 1));
+  size_t e = 0;
+  for (int k = 0; k < n; k++) {
+    const TripletSlot* slot = lookup(index, keys[k]);
+    if (!slot) continue;
+    memcpy(entries + e, index->postings + slot->start, sizeof(uint32_t) * slot->count);
+    e += slot->count;
+  }
+  qsort(entries, total, sizeof(uint32_t), compare_u32);
+
+  // Runs of the same entry
+  *count = 0;
+  for (size_t k = 0; k < total; k++) {
+    if (k == 0 || entries[k] != entries[k - 1]) votes[(*count)++] = (TripletVote){ (int)entries[k], 0 };
+    votes[*count - 1].votes++;
+  }
+
+  arena_release(scratch, entries);
+  arena_rewind(scratch, mark);
+  return votes;
+}